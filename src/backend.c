@@ -0,0 +1,1555 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "route.h"
+#include "routedb.h"
+#include "dns.h"
+#include "sni-private.h"
+
+static const int default_backend_port = 443;
+static const double default_health_timeout = 2.0;
+static const unsigned default_max_fails = 3;
+static const double default_fail_timeout = 10.0;
+static const double default_warm_timeout = 30.0;
+
+/* Resolver of this process, refresh timers run once routes are started */
+static struct dns_resolver *resolver;
+static struct ev_loop *resolver_loop;
+static struct ev_loop *refresh_loop;
+/* Batch resolution keeps at most resolve_parallel queries in flight */
+static struct sni_routes *batch_routes;
+static unsigned batch_next, batch_next_up;
+static unsigned batch_pending;
+/*
+ * Routes used by new sessions, routes of a reload that are still being
+ * resolved, and replaced routes that are freed once their last session ends
+ */
+static struct sni_routes *current_routes;
+static struct sni_routes *pending_routes;
+static struct sni_routes *retired_routes;
+static ev_prepare reap_ev;
+
+static void upstream_resolve(struct sni_upstream *up);
+static void batch_resolve_next(void);
+static void routes_resolved(void);
+static void routes_reap_cb(EV_P_ ev_prepare *w, int revents);
+
+static void
+upstream_refresh_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct sni_upstream *up = w->data;
+
+	upstream_resolve(up);
+}
+
+static bool
+upstream_init(struct sni_upstream *up, struct sni_backend *bk,
+		const ucl_object_t *obj)
+{
+	const ucl_object_t *elt;
+
+	up->bk = bk;
+	up->port = default_backend_port;
+	up->weight = 1;
+	up->refresh.data = up;
+	ev_timer_init(&up->refresh, upstream_refresh_cb, 0.0, 0.0);
+
+	elt = ucl_object_find_key(obj, "port");
+
+	if (elt != NULL) {
+		up->port = ucl_object_toint(elt);
+		if (up->port <= 0 || up->port > 65535) {
+			return false;
+		}
+	}
+
+	elt = ucl_object_find_key(obj, "weight");
+
+	if (elt != NULL) {
+		if (ucl_object_toint(elt) <= 0) {
+			return false;
+		}
+
+		up->weight = ucl_object_toint(elt);
+	}
+
+	elt = ucl_object_find_key(obj, "host");
+
+	if (elt == NULL || ucl_object_tostring(elt) == NULL) {
+		return false;
+	}
+
+	up->host = strdup(ucl_object_tostring(elt));
+
+	/* Literal addresses never expire */
+	up->addrs = dns_addrs_numeric(up->host, up->port);
+
+	if (up->addrs != NULL) {
+		up->state = upstream_ready;
+	}
+
+	return true;
+}
+
+void
+peer_release(struct sni_peer *peer)
+{
+	if (peer && -- peer->ref == 0) {
+		free(peer);
+	}
+}
+
+static bool
+peer_same(const struct sni_peer *peer, const struct sni_upstream *up,
+		const union sni_sockaddr *sa)
+{
+	return peer->up == up && memcmp(&peer->addr, sa, dns_addr_len(sa)) == 0;
+}
+
+/*
+ * Table size is a prime and never changes, otherwise every client would be
+ * remapped when the number of peers changes. Peers beyond the slot type
+ * limit are not used
+ */
+#define MAGLEV_SIZE 65521
+#define MAGLEV_MAX_PEERS 65535
+#define MAGLEV_EMPTY 0xffff
+/* Slots filled per loop iteration while building in background */
+static const unsigned maglev_build_budget = 4096;
+/* Slots tried when the owner of a client's slot is ejected */
+static const unsigned maglev_max_probes = 64;
+
+/*
+ * Maglev lookup table. Each peer walks the slots in its own permutation,
+ * derived from its address, and takes the next free one in turn, so adding
+ * or removing a peer remaps only its share of clients. Heavier peers take
+ * proportionally more turns. The table holds references to its peers, so
+ * it stays usable while a newer one is being built
+ */
+struct sni_maglev {
+	struct sni_backend *bk;
+	struct sni_peer **peers;
+	unsigned npeers;
+	unsigned filled;
+	/* Build state, released once the table is filled */
+	uint32_t *pos;
+	uint32_t *skip;
+	double *credit;
+	unsigned wmax;
+	ev_check check;
+	ev_idle idle;
+	/* Peer indexes */
+	uint16_t lookup[MAGLEV_SIZE];
+};
+
+static void
+maglev_build_done(struct sni_maglev *t)
+{
+	free(t->pos);
+	free(t->skip);
+	free(t->credit);
+	t->pos = NULL;
+	t->skip = NULL;
+	t->credit = NULL;
+}
+
+static void
+maglev_free(struct sni_maglev *t)
+{
+	unsigned i;
+
+	if (t == NULL) {
+		return;
+	}
+
+	if (refresh_loop != NULL) {
+		ev_check_stop(refresh_loop, &t->check);
+		ev_idle_stop(refresh_loop, &t->idle);
+	}
+
+	for (i = 0; i < t->npeers; i ++) {
+		peer_release(t->peers[i]);
+	}
+
+	maglev_build_done(t);
+	free(t->peers);
+	free(t);
+}
+
+/* Fills up to `budget` slots, returns true when the table is complete */
+static bool
+maglev_fill(struct sni_maglev *t, unsigned budget)
+{
+	unsigned i, c, done = 0;
+
+	/* Stop between rounds only, so every peer gets its share */
+	while (t->filled < MAGLEV_SIZE && done < budget) {
+		for (i = 0; i < t->npeers && t->filled < MAGLEV_SIZE; i ++) {
+			t->credit[i] += (double)t->peers[i]->up->weight / t->wmax;
+
+			while (t->credit[i] >= 1.0 && t->filled < MAGLEV_SIZE) {
+				t->credit[i] -= 1.0;
+
+				do {
+					c = t->pos[i];
+					t->pos[i] = (c + t->skip[i]) % MAGLEV_SIZE;
+				} while (t->lookup[c] != MAGLEV_EMPTY);
+
+				t->lookup[c] = i;
+				t->filled ++;
+				done ++;
+			}
+		}
+	}
+
+	return t->filled == MAGLEV_SIZE;
+}
+
+static void
+maglev_install(struct sni_maglev *t)
+{
+	struct sni_backend *bk = t->bk;
+
+	if (refresh_loop != NULL) {
+		ev_check_stop(refresh_loop, &t->check);
+		ev_idle_stop(refresh_loop, &t->idle);
+	}
+
+	maglev_build_done(t);
+
+	if (bk->maglev_next == t) {
+		bk->maglev_next = NULL;
+	}
+
+	maglev_free(bk->maglev);
+	bk->maglev = t;
+}
+
+static void
+maglev_step(struct sni_maglev *t)
+{
+	if (maglev_fill(t, maglev_build_budget)) {
+		maglev_install(t);
+	}
+}
+
+static void
+maglev_check_cb(EV_P_ ev_check *w, int revents)
+{
+	maglev_step(w->data);
+}
+
+/* Keeps the loop from blocking in poll while a table is incomplete */
+static void
+maglev_idle_cb(EV_P_ ev_idle *w, int revents)
+{
+	maglev_step(w->data);
+}
+
+static struct sni_maglev*
+maglev_new(struct sni_backend *bk)
+{
+	struct sni_maglev *t;
+	union sni_sockaddr *sa;
+	unsigned i;
+
+	t = xmalloc(sizeof(*t));
+	memset(t, 0, offsetof(struct sni_maglev, lookup));
+	t->bk = bk;
+	t->npeers = bk->npeers < MAGLEV_MAX_PEERS ? bk->npeers : MAGLEV_MAX_PEERS;
+	t->peers = xmalloc(sizeof(*t->peers) * t->npeers);
+	t->pos = xmalloc(sizeof(*t->pos) * t->npeers);
+	t->skip = xmalloc(sizeof(*t->skip) * t->npeers);
+	t->credit = xmalloc0(sizeof(*t->credit) * t->npeers);
+	memset(t->lookup, 0xff, sizeof(t->lookup));
+
+	for (i = 0; i < t->npeers; i ++) {
+		t->peers[i] = bk->peers[i];
+		t->peers[i]->ref ++;
+		sa = &t->peers[i]->addr;
+		t->pos[i] = dns_addr_hash(sa, true, 0) % MAGLEV_SIZE;
+		t->skip[i] = dns_addr_hash(sa, true, 0x9e3779b9U) % (MAGLEV_SIZE - 1) + 1;
+
+		if (t->peers[i]->up->weight > t->wmax) {
+			t->wmax = t->peers[i]->up->weight;
+		}
+	}
+
+	t->check.data = t;
+	ev_check_init(&t->check, maglev_check_cb);
+	t->idle.data = t;
+	ev_idle_init(&t->idle, maglev_idle_cb);
+
+	return t;
+}
+
+static bool
+maglev_current(const struct sni_maglev *t, const struct sni_backend *bk)
+{
+	return t != NULL && t->npeers == bk->npeers &&
+			memcmp(t->peers, bk->peers, sizeof(*t->peers) * t->npeers) == 0;
+}
+
+/*
+ * Called when the peer list changes. The first table is built at once,
+ * later ones are filled in small steps from the event loop while sessions
+ * keep using the previous table
+ */
+static void
+backend_rebuild_maglev(struct sni_backend *bk)
+{
+	struct sni_maglev *t;
+
+	if (maglev_current(bk->maglev_next, bk)) {
+		return;
+	}
+
+	maglev_free(bk->maglev_next);
+	bk->maglev_next = NULL;
+
+	if (maglev_current(bk->maglev, bk)) {
+		return;
+	}
+
+	if (bk->npeers == 0) {
+		/* Keep the last table, backend_pick does not use it without peers */
+		return;
+	}
+
+	t = maglev_new(bk);
+
+	if (bk->maglev == NULL || refresh_loop == NULL) {
+		maglev_fill(t, UINT_MAX);
+		maglev_install(t);
+	}
+	else {
+		bk->maglev_next = t;
+		ev_check_start(refresh_loop, &t->check);
+		ev_idle_start(refresh_loop, &t->idle);
+	}
+}
+
+/*
+ * Rebuilds the peer list from the addresses of all upstreams. Peers that
+ * are still there keep their counters, new ones start slowly unless this
+ * is the first list of the backend
+ */
+static void
+backend_rebuild_peers(struct sni_backend *bk)
+{
+	struct sni_peer **peers, *peer;
+	struct sni_upstream *up;
+	unsigned i, j, k, n = 0;
+	ev_tstamp now = ev_time();
+	bool first = bk->peers == NULL;
+
+	for (i = 0; i < bk->nupstreams; i ++) {
+		if (bk->upstreams[i].addrs) {
+			n += bk->upstreams[i].addrs->naddrs;
+		}
+	}
+
+	peers = xmalloc(sizeof(*peers) * (n + 1));
+	n = 0;
+
+	for (i = 0; i < bk->nupstreams; i ++) {
+		up = &bk->upstreams[i];
+
+		if (up->addrs == NULL) {
+			continue;
+		}
+
+		for (j = 0; j < up->addrs->naddrs; j ++) {
+			peer = NULL;
+
+			for (k = 0; k < bk->npeers; k ++) {
+				if (peer_same(bk->peers[k], up, &up->addrs->addrs[j])) {
+					peer = bk->peers[k];
+					peer->ref ++;
+					break;
+				}
+			}
+
+			if (peer == NULL) {
+				peer = xmalloc0(sizeof(*peer));
+				memcpy(&peer->addr, &up->addrs->addrs[j],
+						dns_addr_len(&up->addrs->addrs[j]));
+				peer->up = up;
+				peer->ref = 1;
+				peer->since = first ? 0 : now;
+				peer_health_init(peer);
+
+				if (!bk->retired) {
+					peer_health_start(peer);
+					peer_pool_start(peer);
+				}
+			}
+
+			peers[n ++] = peer;
+		}
+	}
+
+	for (k = 0; k < bk->npeers; k ++) {
+		for (j = 0; j < n; j ++) {
+			if (peers[j] == bk->peers[k]) {
+				break;
+			}
+		}
+
+		if (j == n) {
+			peer_health_stop(bk->peers[k]);
+			peer_pool_stop(bk->peers[k]);
+		}
+
+		peer_release(bk->peers[k]);
+	}
+
+	free(bk->peers);
+	bk->peers = peers;
+	bk->npeers = n;
+	bk->ndown = 0;
+
+	for (k = 0; k < n; k ++) {
+		if (peers[k]->down) {
+			bk->ndown ++;
+		}
+	}
+
+	if (bk->balance == balance_maglev) {
+		backend_rebuild_maglev(bk);
+	}
+}
+
+static void
+backend_update_state(struct sni_backend *bk)
+{
+	unsigned i;
+
+	if (bk->npeers > 0) {
+		bk->state = backend_ready;
+		return;
+	}
+
+	for (i = 0; i < bk->nupstreams; i ++) {
+		if (bk->upstreams[i].state == upstream_resolving) {
+			bk->state = backend_resolving;
+			return;
+		}
+	}
+
+	if (bk->state != backend_unloaded) {
+		bk->state = backend_failed;
+	}
+}
+
+static bool
+backend_init(struct sni_backend *bk, const char *name, const ucl_object_t *obj)
+{
+	const ucl_object_t *elt, *cur, *ups;
+	ucl_object_iter_t it = NULL;
+	const char *balance;
+	unsigned i = 0;
+
+	bk->name = strdup(name);
+	bk->loaded = true;
+
+	elt = ucl_object_find_key(obj, "max_buffer");
+
+	if (elt != NULL) {
+		if (ucl_object_toint(elt) <= 0) {
+			return false;
+		}
+
+		bk->max_buffer = ucl_object_toint(elt);
+	}
+
+	elt = ucl_object_find_key(obj, "balance");
+
+	if (elt != NULL) {
+		balance = ucl_object_tostring(elt);
+
+		if (balance == NULL) {
+			return false;
+		}
+		else if (strcmp(balance, "round_robin") == 0) {
+			bk->balance = balance_round_robin;
+		}
+		else if (strcmp(balance, "least_conn") == 0) {
+			bk->balance = balance_least_conn;
+		}
+		else if (strcmp(balance, "p2c") == 0) {
+			bk->balance = balance_p2c;
+		}
+		else if (strcmp(balance, "maglev") == 0) {
+			bk->balance = balance_maglev;
+		}
+		else {
+			return false;
+		}
+	}
+
+	elt = ucl_object_find_key(obj, "slow_start");
+
+	if (elt != NULL) {
+		bk->slow_start = ucl_object_todouble(elt);
+	}
+
+	bk->health_timeout = default_health_timeout;
+	bk->max_fails = default_max_fails;
+	bk->fail_timeout = default_fail_timeout;
+
+	elt = ucl_object_find_key(obj, "health_interval");
+
+	if (elt != NULL) {
+		bk->health_interval = ucl_object_todouble(elt);
+	}
+
+	elt = ucl_object_find_key(obj, "health_timeout");
+
+	if (elt != NULL) {
+		if (ucl_object_todouble(elt) <= 0) {
+			return false;
+		}
+
+		bk->health_timeout = ucl_object_todouble(elt);
+	}
+
+	elt = ucl_object_find_key(obj, "max_fails");
+
+	if (elt != NULL) {
+		if (ucl_object_toint(elt) < 0) {
+			return false;
+		}
+
+		bk->max_fails = ucl_object_toint(elt);
+	}
+
+	elt = ucl_object_find_key(obj, "fail_timeout");
+
+	if (elt != NULL) {
+		if (ucl_object_todouble(elt) <= 0) {
+			return false;
+		}
+
+		bk->fail_timeout = ucl_object_todouble(elt);
+	}
+
+	bk->warm_timeout = default_warm_timeout;
+	elt = ucl_object_find_key(obj, "warm_connections");
+
+	if (elt != NULL) {
+		if (ucl_object_toint(elt) < 0) {
+			return false;
+		}
+
+		bk->warm_connections = ucl_object_toint(elt);
+	}
+
+	elt = ucl_object_find_key(obj, "warm_timeout");
+
+	if (elt != NULL) {
+		if (ucl_object_todouble(elt) <= 0) {
+			return false;
+		}
+
+		bk->warm_timeout = ucl_object_todouble(elt);
+	}
+
+	/* A list of upstreams, or the backend itself is the only upstream */
+	ups = ucl_object_find_key(obj, "upstreams");
+
+	if (ups != NULL) {
+		if (ucl_object_type(ups) != UCL_ARRAY || ucl_array_size(ups) == 0) {
+			return false;
+		}
+
+		bk->nupstreams = ucl_array_size(ups);
+		bk->upstreams = xmalloc0(sizeof(*bk->upstreams) * bk->nupstreams);
+
+		while ((cur = ucl_iterate_object(ups, &it, true)) &&
+				i < bk->nupstreams) {
+			if (!upstream_init(&bk->upstreams[i ++], bk, cur)) {
+				return false;
+			}
+		}
+	}
+	else {
+		bk->nupstreams = 1;
+		bk->upstreams = xmalloc0(sizeof(*bk->upstreams));
+
+		if (!upstream_init(&bk->upstreams[0], bk, obj)) {
+			return false;
+		}
+	}
+
+	backend_rebuild_peers(bk);
+	backend_update_state(bk);
+
+	return true;
+}
+
+static void
+upstream_schedule(struct sni_upstream *up, double after)
+{
+	if (refresh_loop == NULL || up->bk->retired) {
+		return;
+	}
+
+	ev_timer_stop(refresh_loop, &up->refresh);
+	ev_timer_set(&up->refresh, after, 0.0);
+	ev_timer_start(refresh_loop, &up->refresh);
+}
+
+static double
+upstream_ttl(const struct dns_addrs *addrs)
+{
+	double ttl = addrs->ttl;
+
+	if (ttl < dns_min_ttl) {
+		ttl = dns_min_ttl;
+	}
+	if (ttl > dns_max_ttl) {
+		ttl = dns_max_ttl;
+	}
+
+	return ttl;
+}
+
+static void
+backend_wakeup(struct sni_backend *bk)
+{
+	struct ssl_session *ssl, *next;
+
+	if (bk->state == backend_resolving) {
+		return;
+	}
+
+	ssl = bk->waiting;
+	bk->waiting = NULL;
+
+	while (ssl != NULL) {
+		next = ssl->wait_next;
+		ssl->wait_next = NULL;
+
+		if (bk->npeers > 0) {
+			connect_backend(ssl);
+		}
+		else {
+			send_alert(ssl);
+		}
+
+		ssl = next;
+	}
+}
+
+static void
+upstream_resolved_cb(struct dns_addrs *addrs, const char *err, void *ud)
+{
+	struct sni_upstream *up = ud;
+	double after;
+
+	up->query = NULL;
+
+	if (addrs != NULL) {
+		dns_addrs_unref(up->addrs);
+		up->addrs = addrs;
+		up->state = upstream_ready;
+		up->failures = 0;
+		after = upstream_ttl(addrs);
+		backend_rebuild_peers(up->bk);
+	}
+	else {
+		fprintf(stderr, "cannot resolve %s: %s%s\n", up->host, err,
+				up->addrs ? ", using previous addresses" : "");
+
+		if (up->addrs == NULL) {
+			up->state = upstream_failed;
+		}
+
+		/* Back off from the minimal ttl up to a minute */
+		after = dns_min_ttl * (double)(1U << (up->failures < 4 ? up->failures : 4));
+		if (after > 60.0) {
+			after = 60.0;
+		}
+
+		up->failures ++;
+	}
+
+	upstream_schedule(up, after);
+	backend_update_state(up->bk);
+	backend_wakeup(up->bk);
+
+	/* Refreshes of other routes may complete meanwhile */
+	if (batch_routes != NULL && up->bk >= batch_routes->backends &&
+			up->bk < batch_routes->backends + batch_routes->nbackends) {
+		batch_pending --;
+		batch_resolve_next();
+
+		if (batch_pending > 0) {
+			return;
+		}
+
+		if (batch_routes == pending_routes) {
+			routes_resolved();
+		}
+		else {
+			ev_break(resolver_loop, EVBREAK_ONE);
+		}
+	}
+}
+
+static void
+upstream_resolve(struct sni_upstream *up)
+{
+	if (resolver == NULL || up->query != NULL) {
+		return;
+	}
+
+	if (up->state == upstream_unresolved) {
+		up->state = upstream_resolving;
+	}
+
+	up->query = dns_resolve(resolver, up->host, up->port, upstream_resolved_cb,
+			up);
+
+	if (up->query == NULL) {
+		if (errno == EAGAIN) {
+			/* Resolver is saturated, try again later */
+			fprintf(stderr, "cannot resolve %s: too many queries\n", up->host);
+			upstream_schedule(up, dns_min_ttl);
+		}
+		else {
+			fprintf(stderr, "cannot resolve %s: invalid name\n", up->host);
+		}
+
+		if (up->addrs == NULL) {
+			up->state = upstream_failed;
+		}
+	}
+}
+
+static void
+backend_resolve(struct sni_backend *bk)
+{
+	unsigned i;
+
+	bk->state = backend_resolving;
+
+	for (i = 0; i < bk->nupstreams; i ++) {
+		if (bk->upstreams[i].state == upstream_unresolved) {
+			upstream_resolve(&bk->upstreams[i]);
+		}
+	}
+
+	backend_update_state(bk);
+}
+
+void
+backend_select(struct ssl_session *ssl, struct sni_backend *bk)
+{
+	ssl->backend = bk;
+
+	if (bk->npeers > 0) {
+		connect_backend(ssl);
+		return;
+	}
+
+	if (bk->state == backend_unloaded) {
+		backend_resolve(bk);
+	}
+
+	if (bk->state != backend_resolving) {
+		send_alert(ssl);
+		return;
+	}
+
+	/* Woken up by the resolver callback */
+	ssl->wait_next = bk->waiting;
+	bk->waiting = ssl;
+}
+
+/* Weight of a peer, ramped up linearly during slow start */
+static double
+peer_weight(const struct sni_backend *bk, const struct sni_peer *peer,
+		ev_tstamp now)
+{
+	double w = peer->up->weight, frac;
+
+	if (bk->slow_start > 0 && peer->since > 0 &&
+			now - peer->since < bk->slow_start) {
+		frac = (now - peer->since) / bk->slow_start;
+		/* Start with a tenth of the weight, so a new peer is not idle */
+		w *= frac > 0.1 ? frac : 0.1;
+	}
+
+	return w;
+}
+
+/*
+ * Ejected peers are skipped, unless all of them are ejected. Peers dropped
+ * from the list are never used, a maglev table may still refer to them
+ * until it is rebuilt
+ */
+static inline bool
+peer_usable(const struct sni_backend *bk, const struct sni_peer *peer)
+{
+	return peer->listed && (!peer->down || bk->ndown >= bk->npeers);
+}
+
+static struct sni_peer*
+pick_round_robin(struct sni_backend *bk, ev_tstamp now)
+{
+	struct sni_peer *peer, *best = NULL;
+	double total = 0, w;
+	unsigned i;
+
+	/* Smooth weighted round robin, spreads heavy peers evenly */
+	for (i = 0; i < bk->npeers; i ++) {
+		peer = bk->peers[i];
+
+		if (!peer_usable(bk, peer)) {
+			continue;
+		}
+
+		w = peer_weight(bk, peer, now);
+		peer->current += w;
+		total += w;
+
+		if (best == NULL || peer->current > best->current) {
+			best = peer;
+		}
+	}
+
+	best->current -= total;
+
+	return best;
+}
+
+/* Compares active sessions per unit of weight */
+static inline bool
+peer_less_loaded(const struct sni_peer *a, double wa,
+		const struct sni_peer *b, double wb)
+{
+	return (a->active + 1) * wb < (b->active + 1) * wa;
+}
+
+static struct sni_peer*
+pick_least_conn(struct sni_backend *bk, ev_tstamp now)
+{
+	struct sni_peer *peer, *best = NULL;
+	double w, best_w = 0;
+	unsigned i, start;
+
+	/* Ties go to the next peer after the previous choice */
+	start = bk->rr ++;
+
+	for (i = 0; i < bk->npeers; i ++) {
+		peer = bk->peers[(start + i) % bk->npeers];
+
+		if (!peer_usable(bk, peer)) {
+			continue;
+		}
+
+		w = peer_weight(bk, peer, now);
+
+		if (best == NULL || peer_less_loaded(peer, w, best, best_w)) {
+			best = peer;
+			best_w = w;
+		}
+	}
+
+	return best;
+}
+
+static unsigned
+pick_weighted_random(struct sni_backend *bk, double total, ev_tstamp now)
+{
+	double r = drand48() * total;
+	unsigned i, last = 0;
+
+	for (i = 0; i < bk->npeers; i ++) {
+		if (!peer_usable(bk, bk->peers[i])) {
+			continue;
+		}
+
+		last = i;
+		r -= peer_weight(bk, bk->peers[i], now);
+
+		if (r < 0) {
+			break;
+		}
+	}
+
+	return last;
+}
+
+static struct sni_peer*
+pick_p2c(struct sni_backend *bk, ev_tstamp now)
+{
+	struct sni_peer *a, *b;
+	double total = 0;
+	unsigned i, ia, ib;
+
+	for (i = 0; i < bk->npeers; i ++) {
+		if (peer_usable(bk, bk->peers[i])) {
+			total += peer_weight(bk, bk->peers[i], now);
+		}
+	}
+
+	/* Two weighted random choices, the less loaded one wins */
+	ia = pick_weighted_random(bk, total, now);
+	ib = pick_weighted_random(bk, total, now);
+
+	for (i = 1; ia == ib && i < bk->npeers; i ++) {
+		if (peer_usable(bk, bk->peers[(ia + i) % bk->npeers])) {
+			ib = (ia + i) % bk->npeers;
+		}
+	}
+
+	a = bk->peers[ia];
+	b = bk->peers[ib];
+
+	return peer_less_loaded(b, peer_weight(bk, b, now), a,
+			peer_weight(bk, a, now)) ? b : a;
+}
+
+static struct sni_peer*
+pick_maglev(struct sni_backend *bk, struct ssl_session *ssl, ev_tstamp now)
+{
+	const struct sni_maglev *t = bk->maglev;
+	struct sni_peer *peer;
+	uint32_t h;
+	unsigned i;
+
+	if (t == NULL) {
+		return pick_round_robin(bk, now);
+	}
+
+	h = session_client_hash(ssl) % MAGLEV_SIZE;
+
+	/*
+	 * Clients of an ejected peer go to the owners of the following slots,
+	 * which are spread over other peers and stable for each client
+	 */
+	for (i = 0; i < maglev_max_probes; i ++) {
+		peer = t->peers[t->lookup[(h + i) % MAGLEV_SIZE]];
+
+		if (peer_usable(bk, peer)) {
+			return peer;
+		}
+	}
+
+	return pick_round_robin(bk, now);
+}
+
+struct sni_peer*
+backend_pick(struct ssl_session *ssl)
+{
+	struct sni_backend *bk = ssl->backend;
+	struct sni_peer *peer;
+	ev_tstamp now;
+
+	if (bk->npeers == 0) {
+		return NULL;
+	}
+
+	now = ev_time();
+
+	switch (bk->balance) {
+	case balance_least_conn:
+		peer = pick_least_conn(bk, now);
+		break;
+	case balance_p2c:
+		peer = pick_p2c(bk, now);
+		break;
+	case balance_maglev:
+		peer = pick_maglev(bk, ssl, now);
+		break;
+	case balance_round_robin:
+	default:
+		peer = pick_round_robin(bk, now);
+		break;
+	}
+
+	peer->ref ++;
+
+	return peer;
+}
+
+struct sni_peer*
+backend_pick_next(struct sni_backend *bk, struct sni_peer *const *tried,
+		unsigned ntried, int family)
+{
+	struct sni_peer *peer, *other = NULL;
+	unsigned i, j, start = bk->rr ++;
+
+	for (i = 0; i < bk->npeers; i ++) {
+		peer = bk->peers[(start + i) % bk->npeers];
+
+		if (!peer_usable(bk, peer)) {
+			continue;
+		}
+
+		for (j = 0; j < ntried; j ++) {
+			if (tried[j] == peer) {
+				break;
+			}
+		}
+
+		if (j < ntried) {
+			continue;
+		}
+
+		if (family == AF_UNSPEC || peer->addr.sa.sa_family == family) {
+			peer->ref ++;
+			return peer;
+		}
+
+		if (other == NULL) {
+			other = peer;
+		}
+	}
+
+	if (other != NULL) {
+		other->ref ++;
+	}
+
+	return other;
+}
+
+static bool
+resolver_init(struct ev_loop *loop)
+{
+	if (resolver == NULL) {
+		resolver = dns_resolver_create(loop, dns_server, dns_timeout);
+
+		if (resolver == NULL) {
+			return false;
+		}
+
+		resolver_loop = loop;
+	}
+
+	return true;
+}
+
+static void
+batch_resolve_next(void)
+{
+	struct sni_backend *bk;
+	struct sni_upstream *up;
+
+	while (batch_next < batch_routes->nbackends &&
+			batch_pending < (unsigned)resolve_parallel) {
+		bk = &batch_routes->backends[batch_next];
+
+		if (batch_next_up >= bk->nupstreams) {
+			batch_next ++;
+			batch_next_up = 0;
+			continue;
+		}
+
+		up = &bk->upstreams[batch_next_up ++];
+
+		if (up->state == upstream_unresolved) {
+			upstream_resolve(up);
+
+			if (up->query != NULL) {
+				batch_pending ++;
+			}
+
+			backend_update_state(bk);
+		}
+	}
+}
+
+static void
+batch_resolve(struct sni_routes *routes)
+{
+	batch_routes = routes;
+	batch_next = 0;
+	batch_next_up = 0;
+	batch_pending = 0;
+	batch_resolve_next();
+}
+
+/* Returns the number of upstreams without addresses */
+static unsigned
+routes_unresolved(const struct sni_routes *routes)
+{
+	struct sni_backend *bk;
+	struct sni_upstream *up;
+	unsigned i, j, failed = 0;
+
+	for (i = 0; i < routes->nbackends; i ++) {
+		bk = &routes->backends[i];
+
+		for (j = 0; j < bk->nupstreams; j ++) {
+			up = &bk->upstreams[j];
+
+			if (up->addrs == NULL) {
+				fprintf(stderr, "bad backend: %s:%d\n", up->host, up->port);
+				failed ++;
+			}
+		}
+	}
+
+	return failed;
+}
+
+bool
+routes_resolve(struct ev_loop *loop, struct sni_routes *routes)
+{
+	unsigned failed;
+
+	if (!resolver_init(loop)) {
+		return false;
+	}
+
+	batch_resolve(routes);
+
+	if (batch_pending > 0) {
+		ev_run(loop, 0);
+	}
+
+	batch_routes = NULL;
+	failed = routes_unresolved(routes);
+
+	/* Each process refreshes addresses with its own resolver */
+	dns_resolver_destroy(resolver);
+	resolver = NULL;
+	resolver_loop = NULL;
+
+	return failed == 0;
+}
+
+bool
+routes_start(struct ev_loop *loop, struct sni_routes *routes)
+{
+	struct sni_backend *bk;
+	struct sni_upstream *up;
+	unsigned i, j;
+
+	if (!resolver_init(loop)) {
+		return false;
+	}
+
+	refresh_loop = loop;
+	current_routes = routes;
+	ev_prepare_init(&reap_ev, routes_reap_cb);
+	srand48(ev_time() * 1000.0);
+	health_start(loop);
+	connect_start(loop);
+
+	for (i = 0; i < routes->nbackends; i ++) {
+		bk = &routes->backends[i];
+
+		for (j = 0; j < bk->nupstreams; j ++) {
+			up = &bk->upstreams[j];
+
+			if (up->addrs != NULL && up->addrs->ttl > 0) {
+				upstream_schedule(up, upstream_ttl(up->addrs));
+			}
+		}
+
+		/* Peers resolved before the fork are checked by every worker */
+		for (j = 0; j < bk->npeers; j ++) {
+			peer_health_start(bk->peers[j]);
+			peer_pool_start(bk->peers[j]);
+		}
+	}
+
+	return true;
+}
+
+struct sni_routes*
+routes_create(const ucl_object_t *obj)
+{
+	ucl_object_iter_t it = NULL;
+	const ucl_object_t *cur;
+	struct sni_routes *routes;
+	struct route_builder *b;
+	const char *key;
+	size_t keylen;
+	unsigned i = 0;
+
+	if (obj == NULL || ucl_object_type(obj) != UCL_OBJECT) {
+		return NULL;
+	}
+
+	while (ucl_iterate_object(obj, &it, true)) {
+		i ++;
+	}
+
+	routes = xmalloc0(sizeof(*routes));
+	routes->nbackends = i;
+	routes->backends = xmalloc0(sizeof(*routes->backends) * (i + 1));
+	routes->default_backend = ROUTE_NONE;
+	b = route_builder_new();
+	it = NULL;
+	i = 0;
+
+	while ((cur = ucl_iterate_object(obj, &it, true)) && i < routes->nbackends) {
+		key = ucl_object_keyl(cur, &keylen);
+
+		if (!backend_init(&routes->backends[i], key, cur)) {
+			fprintf(stderr, "invalid backend: %s\n", key);
+			goto err;
+		}
+
+		if (strcmp(key, "default") == 0) {
+			routes->default_backend = i;
+		}
+		else if (!route_builder_add(b, key, keylen, i)) {
+			fprintf(stderr, "invalid or duplicate server name: %s\n", key);
+			goto err;
+		}
+
+		i ++;
+	}
+
+	routes->nbackends = i;
+	routes->own_table = route_builder_finish(b);
+	routes->table = routes->own_table;
+
+	return routes;
+
+err:
+	routes->nbackends = i + 1;
+	routes->own_table = route_builder_finish(b);
+	routes_destroy(routes);
+
+	return NULL;
+}
+
+struct sni_routes*
+routes_open_db(const char *path)
+{
+	struct sni_routes *routes;
+	struct routedb *db;
+
+	db = routedb_open(path);
+
+	if (db == NULL) {
+		return NULL;
+	}
+
+	routes = xmalloc0(sizeof(*routes));
+	routes->db = db;
+	routes->table = routedb_table(db);
+	routes->nbackends = routedb_nrecords(db);
+	routes->default_backend = routedb_default(db);
+	/* Zero pages are not touched until a backend is loaded */
+	routes->backends = calloc(routes->nbackends + 1,
+			sizeof(*routes->backends));
+
+	if (routes->backends == NULL) {
+		abort();
+	}
+
+	return routes;
+}
+
+int
+routes_max_buffer(const struct sni_routes *routes)
+{
+	unsigned i;
+	int max = 0;
+
+	if (routes->db != NULL) {
+		return routedb_max_buffer(routes->db);
+	}
+
+	for (i = 0; i < routes->nbackends; i ++) {
+		if (routes->backends[i].max_buffer > max) {
+			max = routes->backends[i].max_buffer;
+		}
+	}
+
+	return max;
+}
+
+static void
+backend_free(struct sni_backend *bk)
+{
+	struct sni_upstream *up;
+	unsigned i;
+
+	for (i = 0; i < bk->nupstreams; i ++) {
+		up = &bk->upstreams[i];
+		free(up->host);
+		dns_addrs_unref(up->addrs);
+		dns_cancel(up->query);
+
+		if (refresh_loop != NULL) {
+			ev_timer_stop(refresh_loop, &up->refresh);
+		}
+	}
+
+	for (i = 0; i < bk->npeers; i ++) {
+		peer_health_stop(bk->peers[i]);
+		peer_pool_stop(bk->peers[i]);
+		peer_release(bk->peers[i]);
+	}
+
+	maglev_free(bk->maglev);
+	maglev_free(bk->maglev_next);
+	free(bk->upstreams);
+	free(bk->peers);
+	free(bk->name);
+}
+
+static void
+backend_load(const struct sni_routes *routes, uint32_t idx)
+{
+	struct sni_backend *bk = &routes->backends[idx];
+	struct ucl_parser *parser;
+	ucl_object_t *obj;
+	const char *rec, *name;
+	size_t len;
+	bool ret;
+
+	rec = routedb_record(routes->db, idx, &len);
+	name = routedb_record_name(routes->db, idx);
+	parser = ucl_parser_new(0);
+
+	if (rec == NULL ||
+			!ucl_parser_add_chunk(parser, (const unsigned char *)rec, len)) {
+		fprintf(stderr, "bad backend record %u: %s\n", idx,
+				rec ? ucl_parser_get_error(parser) : "out of range");
+		ucl_parser_free(parser);
+		bk->loaded = true;
+		bk->state = backend_failed;
+
+		return;
+	}
+
+	obj = ucl_parser_get_object(parser);
+	ucl_parser_free(parser);
+
+	/* Sessions of replaced routes may still load backends */
+	bk->retired = routes->retired;
+	ret = backend_init(bk, name, obj);
+	ucl_object_unref(obj);
+
+	if (!ret) {
+		fprintf(stderr, "bad backend record %u\n", idx);
+		backend_free(bk);
+		memset(bk, 0, sizeof(*bk));
+		/* Invalid records are not parsed again */
+		bk->loaded = true;
+		bk->state = backend_failed;
+	}
+}
+
+struct sni_backend*
+routes_lookup(const struct sni_routes *routes, const char *name, size_t len)
+{
+	struct sni_backend *bk;
+	uint32_t idx = ROUTE_NONE;
+
+	if (len > 0) {
+		idx = route_lookup(routes->table, name, len);
+	}
+
+	if (idx == ROUTE_NONE) {
+		idx = routes->default_backend;
+	}
+
+	if (idx == ROUTE_NONE || idx >= routes->nbackends) {
+		return NULL;
+	}
+
+	bk = &routes->backends[idx];
+
+	if (!bk->loaded) {
+		backend_load(routes, idx);
+	}
+
+	if (bk->nupstreams == 0) {
+		return NULL;
+	}
+
+	return bk;
+}
+
+void
+routes_destroy(struct sni_routes *routes)
+{
+	unsigned i;
+
+	if (routes) {
+		for (i = 0; i < routes->nbackends; i ++) {
+			backend_free(&routes->backends[i]);
+		}
+
+		route_table_destroy(routes->own_table);
+		routedb_close(routes->db);
+		free(routes->backends);
+		free(routes);
+	}
+}
+
+/*
+ * Replaced routes stop refreshing addresses, checking peers and keeping
+ * warm connections, but their sessions go on using them
+ */
+static void
+routes_retire(struct sni_routes *routes)
+{
+	struct sni_backend *bk;
+	unsigned i, j;
+
+	routes->retired = true;
+
+	for (i = 0; i < routes->nbackends; i ++) {
+		bk = &routes->backends[i];
+
+		if (!bk->loaded) {
+			continue;
+		}
+
+		bk->retired = true;
+
+		for (j = 0; j < bk->nupstreams; j ++) {
+			ev_timer_stop(refresh_loop, &bk->upstreams[j].refresh);
+		}
+
+		for (j = 0; j < bk->npeers; j ++) {
+			peer_health_stop(bk->peers[j]);
+			peer_pool_stop(bk->peers[j]);
+		}
+	}
+
+	routes->next_retired = retired_routes;
+	retired_routes = routes;
+
+	if (routes->ref == 0) {
+		ev_prepare_start(refresh_loop, &reap_ev);
+	}
+}
+
+static void
+routes_reap_cb(EV_P_ ev_prepare *w, int revents)
+{
+	struct sni_routes **prev = &retired_routes, *routes;
+
+	ev_prepare_stop(loop, w);
+
+	while ((routes = *prev) != NULL) {
+		if (routes->ref == 0) {
+			*prev = routes->next_retired;
+			routes_destroy(routes);
+		}
+		else {
+			prev = &routes->next_retired;
+		}
+	}
+}
+
+static void
+routes_install(struct sni_routes *routes)
+{
+	struct sni_routes *old = current_routes;
+
+	current_routes = routes;
+	fprintf(stderr, "reload: %u server names installed\n",
+			route_count(routes->table));
+
+	if (old != NULL) {
+		routes_retire(old);
+	}
+}
+
+static void
+routes_resolved(void)
+{
+	struct sni_routes *routes = pending_routes;
+
+	batch_routes = NULL;
+	pending_routes = NULL;
+
+	if (routes_unresolved(routes) > 0) {
+		fprintf(stderr, "reload: cannot resolve backends, keeping the "
+				"previous configuration\n");
+		routes_destroy(routes);
+		return;
+	}
+
+	routes_install(routes);
+}
+
+void
+routes_update(struct sni_routes *routes)
+{
+	if (pending_routes != NULL) {
+		fprintf(stderr, "reload: dropping the configuration that is "
+				"still being resolved\n");
+		batch_routes = NULL;
+		routes_destroy(pending_routes);
+		pending_routes = NULL;
+	}
+
+	if (lazy_resolve) {
+		routes_install(routes);
+		return;
+	}
+
+	/* Resolved off to the side, sessions keep using the current routes */
+	pending_routes = routes;
+	batch_resolve(routes);
+
+	if (batch_pending == 0) {
+		routes_resolved();
+	}
+}
+
+struct sni_routes*
+routes_acquire(void)
+{
+	current_routes->ref ++;
+
+	return current_routes;
+}
+
+void
+routes_release(struct sni_routes *routes)
+{
+	/* Freed out of the callbacks that may still use them */
+	if (-- routes->ref == 0 && routes->retired) {
+		ev_prepare_start(refresh_loop, &reap_ev);
+	}
+}
@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "bufpool.h"
+#include "util.h"
+
+/* Size of a huge page on the common platforms */
+static const size_t hugepage_size = 2 * 1024 * 1024;
+/* Minimal slab size when huge pages are not used */
+static const size_t min_slab_size = 256 * 1024;
+
+#define BUFPOOL_MAX_CLASSES 16
+
+struct bufpool_slab {
+	struct bufpool_slab *next;
+	uint8_t *base;
+	size_t len;
+};
+
+struct bufpool_chunk {
+	struct bufpool_chunk *next;
+};
+
+struct bufpool_class {
+	struct bufpool_chunk *free_list;
+	size_t size;
+};
+
+struct bufpool {
+	struct bufpool_class classes[BUFPOOL_MAX_CLASSES];
+	struct bufpool_slab *slabs;
+	bufpool_release_cb release_cb;
+	void *release_ud;
+	size_t allocated;
+	size_t in_use;
+	size_t limit;
+	int nclasses;
+	bool hugepages;
+	bool starved;
+};
+
+struct bufpool*
+bufpool_create(size_t min_size, size_t max_size, bool hugepages)
+{
+	struct bufpool *pool;
+	size_t sz;
+
+	pool = xmalloc0(sizeof(*pool));
+	pool->hugepages = hugepages;
+
+	/* Keep chunks cache line aligned */
+	for (sz = 64; sz < min_size; sz <<= 1);
+
+	pool->classes[pool->nclasses ++].size = sz;
+
+	while (sz < max_size && pool->nclasses < BUFPOOL_MAX_CLASSES) {
+		sz <<= 1;
+		pool->classes[pool->nclasses ++].size = sz;
+	}
+
+	return pool;
+}
+
+void
+bufpool_set_limit(struct bufpool *pool, size_t limit, bufpool_release_cb cb,
+		void *ud)
+{
+	pool->limit = limit;
+	pool->release_cb = cb;
+	pool->release_ud = ud;
+}
+
+int
+bufpool_class(struct bufpool *pool, size_t size)
+{
+	int i;
+
+	/* Classes are only appended, so indexes held by rings stay valid */
+	while (pool->classes[pool->nclasses - 1].size < size &&
+			pool->nclasses < BUFPOOL_MAX_CLASSES) {
+		pool->classes[pool->nclasses].size =
+				pool->classes[pool->nclasses - 1].size << 1;
+		pool->nclasses ++;
+	}
+
+	for (i = 0; i < pool->nclasses - 1; i ++) {
+		if (pool->classes[i].size >= size) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+int
+bufpool_max_class(struct bufpool *pool)
+{
+	return pool->nclasses - 1;
+}
+
+size_t
+bufpool_class_size(struct bufpool *pool, int cls)
+{
+	return pool->classes[cls].size;
+}
+
+static bool
+bufpool_grow(struct bufpool *pool, struct bufpool_class *cl)
+{
+	struct bufpool_slab *slab;
+	struct bufpool_chunk *chunk;
+	uint8_t *p = MAP_FAILED;
+	size_t i, n, slab_size;
+
+	if (pool->hugepages) {
+		slab_size = (cl->size + hugepage_size - 1) & ~(hugepage_size - 1);
+	}
+	else {
+		slab_size = cl->size > min_slab_size ? cl->size : min_slab_size;
+	}
+
+#ifdef MAP_HUGETLB
+	if (pool->hugepages) {
+		p = mmap(NULL, slab_size, PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+
+		if (p == MAP_FAILED) {
+			fprintf(stderr, "cannot allocate huge pages for buffers: %s, "
+					"using normal pages\n", strerror(errno));
+			pool->hugepages = false;
+		}
+	}
+#endif
+
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, slab_size, PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+
+		if (p == MAP_FAILED) {
+			return false;
+		}
+	}
+
+	slab = xmalloc(sizeof(*slab));
+	slab->base = p;
+	slab->len = slab_size;
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+
+	n = slab_size / cl->size;
+
+	/* Push in reverse order, so chunks are handed out by ascending address */
+	for (i = n; i > 0; i --) {
+		chunk = (struct bufpool_chunk *)(p + (i - 1) * cl->size);
+		chunk->next = cl->free_list;
+		cl->free_list = chunk;
+	}
+
+	pool->allocated += slab_size;
+
+	return true;
+}
+
+bool
+bufpool_can_alloc(struct bufpool *pool, int cls)
+{
+	if (pool->limit > 0 &&
+			pool->in_use + pool->classes[cls].size > pool->limit) {
+		pool->starved = true;
+
+		return false;
+	}
+
+	return true;
+}
+
+uint8_t*
+bufpool_alloc(struct bufpool *pool, int cls)
+{
+	struct bufpool_class *cl = &pool->classes[cls];
+	struct bufpool_chunk *chunk;
+
+	if (!bufpool_can_alloc(pool, cls)) {
+		return NULL;
+	}
+
+	if (cl->free_list == NULL && !bufpool_grow(pool, cl)) {
+		abort();
+	}
+
+	chunk = cl->free_list;
+	cl->free_list = chunk->next;
+	pool->in_use += cl->size;
+
+	return (uint8_t *)chunk;
+}
+
+void
+bufpool_free(struct bufpool *pool, uint8_t *p, int cls)
+{
+	struct bufpool_class *cl = &pool->classes[cls];
+	struct bufpool_chunk *chunk = (struct bufpool_chunk *)p;
+
+	/* LIFO keeps recently used chunks warm in cache */
+	chunk->next = cl->free_list;
+	cl->free_list = chunk;
+	pool->in_use -= cl->size;
+
+	if (pool->starved && pool->release_cb) {
+		pool->starved = false;
+		pool->release_cb(pool->release_ud);
+	}
+}
+
+size_t
+bufpool_in_use(struct bufpool *pool)
+{
+	return pool->in_use;
+}
+
+size_t
+bufpool_allocated(struct bufpool *pool)
+{
+	return pool->allocated;
+}
+
+void
+bufpool_destroy(struct bufpool *pool)
+{
+	struct bufpool_slab *slab, *tmp;
+
+	if (pool) {
+		slab = pool->slabs;
+
+		while (slab) {
+			tmp = slab->next;
+			munmap(slab->base, slab->len);
+			free(slab);
+			slab = tmp;
+		}
+
+		free(pool);
+	}
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SRC_BUFPOOL_H_
+#define SRC_BUFPOOL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Pool of chunks carved from large mmap'ed slabs. Chunk sizes are powers of
+ * two from min_size to max_size, one free list per size class; a larger
+ * class is added when bufpool_class() is asked for it. It is not thread
+ * safe: each worker process owns its own pool.
+ */
+struct bufpool;
+
+typedef void (*bufpool_release_cb)(void *ud);
+
+struct bufpool* bufpool_create(size_t min_size, size_t max_size,
+		bool hugepages);
+
+/*
+ * Limits the number of bytes handed out, allocations over it fail. Once
+ * memory is returned after a failure, `cb` is called
+ */
+void bufpool_set_limit(struct bufpool *pool, size_t limit,
+		bufpool_release_cb cb, void *ud);
+
+/* Smallest class that fits `size`, or the largest one there can be */
+int bufpool_class(struct bufpool *pool, size_t size);
+int bufpool_max_class(struct bufpool *pool);
+size_t bufpool_class_size(struct bufpool *pool, int cls);
+
+bool bufpool_can_alloc(struct bufpool *pool, int cls);
+uint8_t* bufpool_alloc(struct bufpool *pool, int cls);
+void bufpool_free(struct bufpool *pool, uint8_t *chunk, int cls);
+
+size_t bufpool_in_use(struct bufpool *pool);
+size_t bufpool_allocated(struct bufpool *pool);
+
+void bufpool_destroy(struct bufpool *pool);
+
+#endif /* SRC_BUFPOOL_H_ */
@@ -0,0 +1,686 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Backend connects. The first peer is chosen by the balancer; if it has
+ * not connected after `connect_delay`, another peer, of the other address
+ * family when possible, is tried in parallel and the first one to connect
+ * wins (RFC 8305). A failed or timed out attempt is replaced by the next
+ * peer right away, up to `connect_tries` attempts. Nothing is sent to the
+ * backend before the connect completes, so the saved ClientHello goes to
+ * whichever peer wins.
+ *
+ * Peers of backends with `warm_connections` keep that many idle connected
+ * sockets. An attempt takes one of them instead of connecting, and the
+ * slot connects again in background. Idle sockets are replaced after
+ * `warm_timeout`, before the backend closes them itself, or as soon as
+ * the backend closes them.
+ *
+ * With `backend_fastopen` the ClientHello is passed to the kernel with the
+ * connect, so it goes in the SYN when a fast open cookie of the peer is
+ * cached. Completion is still awaited before proxying, so racing and
+ * timeouts work the same; only the bytes the winner already sent are
+ * skipped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "ringbuf.h"
+#include "dns.h"
+#include "sni-private.h"
+
+struct sni_connect;
+
+struct sni_attempt {
+	struct sni_connect *c;
+	struct sni_peer *peer;
+	ev_io io;
+	ev_timer tm;
+	int fd;
+	/* Bytes of the ClientHello sent with a fast open connect */
+	int sent;
+};
+
+struct sni_connect {
+	struct ssl_session *ssl;
+	struct sni_attempt att[2];
+	ev_timer delay;
+	/* Referenced, so they are not picked again */
+	struct sni_peer *tried[CONNECT_MAX_TRIES];
+	unsigned ntried;
+};
+
+/* Idle connection slot of a peer */
+struct sni_warm {
+	struct sni_peer *peer;
+	ev_io io;
+	ev_timer tm;
+	int fd;
+	unsigned fails;
+	enum {
+		warm_waiting = 0,
+		warm_connecting,
+		warm_ready
+	} state;
+};
+
+/* Upper bound of the delay before a failed slot connects again, seconds */
+static const double warm_max_backoff = 30.0;
+
+/* Seconds between fast open reports */
+static const double tfo_report_interval = 300.0;
+
+static struct ev_loop *pool_loop;
+static ev_timer tfo_report;
+
+static void connect_next(struct sni_connect *c, struct sni_attempt *a);
+static int pool_take(struct sni_peer *peer);
+
+static void
+attempt_close(struct sni_attempt *a)
+{
+	struct ev_loop *loop = a->c->ssl->loop;
+
+	if (a->peer == NULL) {
+		return;
+	}
+
+	ev_io_stop(loop, &a->io);
+	ev_timer_stop(loop, &a->tm);
+	close(a->fd);
+	a->fd = -1;
+	a->peer->active --;
+	peer_release(a->peer);
+	a->peer = NULL;
+}
+
+static void
+attempt_fail(struct sni_attempt *a)
+{
+	stats->connect_failures ++;
+	a->c->ssl->bk_stats->connect_failures ++;
+	peer_report(a->peer, false);
+	attempt_close(a);
+}
+
+static void
+connect_free(struct sni_connect *c)
+{
+	unsigned i;
+
+	ev_timer_stop(c->ssl->loop, &c->delay);
+	attempt_close(&c->att[0]);
+	attempt_close(&c->att[1]);
+
+	for (i = 0; i < c->ntried; i ++) {
+		peer_release(c->tried[i]);
+	}
+
+	c->ssl->conn = NULL;
+	free(c);
+}
+
+static void
+connect_done(struct sni_connect *c, struct sni_attempt *a)
+{
+	struct ssl_session *ssl = c->ssl;
+#if defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	if (a->sent > 0 && getsockopt(a->fd, IPPROTO_TCP, TCP_INFO, &ti,
+			&len) == 0 && (ti.tcpi_options & TCPI_OPT_SYN_DATA)) {
+		stats->tfo_acked ++;
+	}
+#endif
+
+	ev_io_stop(ssl->loop, &a->io);
+	ev_timer_stop(ssl->loop, &a->tm);
+
+	/*
+	 * Data that was not accepted with the SYN is retransmitted by the
+	 * kernel, so it is skipped either way
+	 */
+	if (a->sent > 0) {
+		ringbuf_update_write(&ssl->cl2bk, a->sent);
+	}
+
+	/* The session takes the socket and the peer reference */
+	ssl->bk_fd = a->fd;
+	ssl->peer = a->peer;
+	a->fd = -1;
+	a->peer = NULL;
+	connect_free(c);
+	session_phase(ssl, phase_connect);
+
+	ssl->state = ssl_state_backend_ready;
+#ifdef HAVE_LIBURING
+	if (ssl->uring) {
+		uring_connected(ssl);
+		return;
+	}
+#endif
+	proxy_create(ssl);
+}
+
+static void
+attempt_io_cb(EV_P_ ev_io *w, int revents)
+{
+	struct sni_attempt *a = w->data;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(a->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+		err = errno;
+	}
+
+	if (err == 0) {
+		connect_done(a->c, a);
+	}
+	else {
+		attempt_fail(a);
+		connect_next(a->c, a);
+	}
+}
+
+static void
+attempt_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct sni_attempt *a = w->data;
+
+	attempt_fail(a);
+	connect_next(a->c, a);
+}
+
+/*
+ * Connects and sends the ClientHello at once, returns false if fast open
+ * is not used. If the connect fails, the attempt is closed
+ */
+static bool
+attempt_fastopen(struct ssl_session *ssl, struct sni_attempt *a)
+{
+#ifdef MSG_FASTOPEN
+	const struct iovec *iov;
+	struct msghdr msg;
+	ssize_t r;
+	int cnt;
+
+	if (!backend_fastopen || !ringbuf_can_write(&ssl->cl2bk)) {
+		return false;
+	}
+
+	iov = ringbuf_writevec(&ssl->cl2bk, &cnt);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &a->peer->addr;
+	msg.msg_namelen = dns_addr_len(&a->peer->addr);
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = cnt;
+
+	while ((r = sendmsg(a->fd, &msg, MSG_FASTOPEN|MSG_NOSIGNAL)) == -1 &&
+			errno == EINTR);
+
+	if (r >= 0) {
+		a->sent = r;
+		stats->tfo_syn_data ++;
+	}
+	else if (errno == EINPROGRESS) {
+		stats->tfo_no_cookie ++;
+	}
+	else if (errno == EOPNOTSUPP) {
+		/* Disabled by the net.ipv4.tcp_fastopen sysctl */
+		return false;
+	}
+	else {
+		attempt_fail(a);
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* Takes the peer reference, returns false if the connect failed at once */
+static bool
+attempt_start(struct sni_connect *c, struct sni_attempt *a,
+		struct sni_peer *peer)
+{
+	struct ev_loop *loop = c->ssl->loop;
+	int fd;
+
+	peer->ref ++;
+	c->tried[c->ntried ++] = peer;
+	peer->active ++;
+	a->peer = peer;
+	a->sent = 0;
+	a->fd = pool_take(peer);
+	stats->connects ++;
+
+	if (a->fd != -1) {
+		stats->warm_hits ++;
+
+		/* Writable at once, completes on the next loop iteration */
+		ev_io_set(&a->io, a->fd, EV_WRITE);
+		ev_io_start(loop, &a->io);
+		ev_timer_set(&a->tm, connect_timeout, 0.0);
+		ev_timer_start(loop, &a->tm);
+
+		return true;
+	}
+
+	fd = socket(peer->addr.sa.sa_family, SOCK_STREAM, 0);
+
+	if (fd == -1) {
+		/* Not the peer's fault */
+		peer->active --;
+		peer_release(peer);
+		a->peer = NULL;
+
+		return false;
+	}
+
+	a->fd = fd;
+
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+		attempt_close(a);
+
+		return false;
+	}
+
+	if (!attempt_fastopen(c->ssl, a)) {
+		while (connect(fd, &peer->addr.sa,
+				dns_addr_len(&peer->addr)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if (errno != EINPROGRESS) {
+				attempt_fail(a);
+
+				return false;
+			}
+
+			break;
+		}
+	}
+	else if (a->fd == -1) {
+		/* Failed at once */
+		return false;
+	}
+
+	/* Completion, immediate or not, is checked with SO_ERROR */
+	ev_io_set(&a->io, fd, EV_WRITE);
+	ev_io_start(loop, &a->io);
+	ev_timer_set(&a->tm, connect_timeout, 0.0);
+	ev_timer_start(loop, &a->tm);
+
+	return true;
+}
+
+static struct sni_peer*
+connect_pick(struct sni_connect *c)
+{
+	struct sni_backend *bk = c->ssl->backend;
+	int family = AF_UNSPEC, last;
+
+	if (c->ntried >= (unsigned)connect_tries) {
+		return NULL;
+	}
+	if (c->ntried == 0) {
+		return backend_pick(c->ssl);
+	}
+
+	/* Alternate address families, like RFC 8305 sorting does */
+	last = c->tried[c->ntried - 1]->addr.sa.sa_family;
+	family = last == AF_INET6 ? AF_INET : AF_INET6;
+
+	return backend_pick_next(bk, c->tried, c->ntried, family);
+}
+
+/* Starts the next attempt in the free slot `a` */
+static void
+connect_next(struct sni_connect *c, struct sni_attempt *a)
+{
+	struct sni_attempt *other = a == &c->att[0] ? &c->att[1] : &c->att[0];
+	struct sni_peer *peer;
+	struct ssl_session *ssl;
+
+	while ((peer = connect_pick(c)) != NULL) {
+		if (attempt_start(c, a, peer)) {
+			return;
+		}
+	}
+
+	if (other->peer == NULL) {
+		/* Nothing left to try */
+		ssl = c->ssl;
+		connect_free(c);
+		send_alert(ssl);
+	}
+}
+
+static void
+connect_delay_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct sni_connect *c = w->data;
+
+	/* Race a second peer against the slow one */
+	if (c->att[1].peer == NULL) {
+		connect_next(c, &c->att[1]);
+	}
+	else if (c->att[0].peer == NULL) {
+		connect_next(c, &c->att[0]);
+	}
+}
+
+void
+connect_backend(struct ssl_session *ssl)
+{
+	struct sni_connect *c;
+	unsigned i;
+
+	c = xmalloc0(sizeof(*c));
+	c->ssl = ssl;
+	ssl->conn = c;
+
+	for (i = 0; i < 2; i ++) {
+		c->att[i].c = c;
+		c->att[i].fd = -1;
+		c->att[i].io.data = &c->att[i];
+		ev_io_init(&c->att[i].io, attempt_io_cb, -1, EV_WRITE);
+		c->att[i].tm.data = &c->att[i];
+		ev_timer_init(&c->att[i].tm, attempt_timer_cb, 0.0, 0.0);
+	}
+
+	c->delay.data = c;
+	ev_timer_init(&c->delay, connect_delay_cb, connect_delay, 0.0);
+
+	connect_next(c, &c->att[0]);
+
+	/* Unless every peer failed at once and the alert is being sent */
+	if (ssl->conn != NULL && connect_delay > 0 && connect_tries > 1) {
+		ev_timer_start(ssl->loop, &c->delay);
+	}
+}
+
+void
+connect_cancel(struct ssl_session *ssl)
+{
+	if (ssl->conn != NULL) {
+		connect_free(ssl->conn);
+	}
+}
+
+static void warm_connect(struct sni_warm *w);
+
+static void
+warm_close(struct sni_warm *w)
+{
+	ev_io_stop(pool_loop, &w->io);
+	ev_timer_stop(pool_loop, &w->tm);
+
+	if (w->fd != -1) {
+		close(w->fd);
+		w->fd = -1;
+	}
+
+	w->state = warm_waiting;
+}
+
+static void
+warm_retry(struct sni_warm *w, double after)
+{
+	warm_close(w);
+	ev_timer_set(&w->tm, after, 0.0);
+	ev_timer_start(pool_loop, &w->tm);
+}
+
+static void
+warm_failed(struct sni_warm *w)
+{
+	unsigned shift = w->fails < 5 ? w->fails : 5;
+	double after = (double)(1U << shift);
+
+	peer_report(w->peer, false);
+	w->fails ++;
+	warm_retry(w, after < warm_max_backoff ? after : warm_max_backoff);
+}
+
+static void
+warm_io_cb(EV_P_ ev_io *w, int revents)
+{
+	struct sni_warm *slot = w->data;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (slot->state == warm_ready) {
+		/* Closed by the backend, or it sent something unexpected */
+		warm_retry(slot, 1.0);
+		return;
+	}
+
+	if (getsockopt(slot->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+		err = errno;
+	}
+
+	if (err != 0) {
+		warm_failed(slot);
+		return;
+	}
+
+	slot->fails = 0;
+	slot->state = warm_ready;
+	ev_io_stop(pool_loop, &slot->io);
+	ev_io_set(&slot->io, slot->fd, EV_READ);
+	ev_io_start(pool_loop, &slot->io);
+	ev_timer_stop(pool_loop, &slot->tm);
+	ev_timer_set(&slot->tm, slot->peer->up->bk->warm_timeout, 0.0);
+	ev_timer_start(pool_loop, &slot->tm);
+}
+
+static void
+warm_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct sni_warm *slot = w->data;
+
+	switch (slot->state) {
+	case warm_connecting:
+		warm_failed(slot);
+		break;
+	case warm_ready:
+		/* Replace it before the backend times it out */
+		warm_close(slot);
+		warm_connect(slot);
+		break;
+	case warm_waiting:
+	default:
+		warm_connect(slot);
+		break;
+	}
+}
+
+static void
+warm_connect(struct sni_warm *w)
+{
+	struct sni_peer *peer = w->peer;
+	int fd;
+
+	if (peer->down) {
+		/* Health checks bring it back, look again later */
+		warm_retry(w, warm_max_backoff);
+		return;
+	}
+
+	fd = socket(peer->addr.sa.sa_family, SOCK_STREAM, 0);
+
+	if (fd == -1) {
+		warm_retry(w, warm_max_backoff);
+		return;
+	}
+
+	w->fd = fd;
+
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+		warm_retry(w, warm_max_backoff);
+		return;
+	}
+
+	while (connect(fd, &peer->addr.sa, dns_addr_len(&peer->addr)) == -1) {
+		if (errno == EINTR) {
+			continue;
+		}
+
+		if (errno != EINPROGRESS) {
+			warm_failed(w);
+			return;
+		}
+
+		break;
+	}
+
+	w->state = warm_connecting;
+	ev_io_set(&w->io, fd, EV_WRITE);
+	ev_io_start(pool_loop, &w->io);
+	ev_timer_set(&w->tm, connect_timeout, 0.0);
+	ev_timer_start(pool_loop, &w->tm);
+}
+
+/* Returns an idle connected socket of the peer or -1 */
+static int
+pool_take(struct sni_peer *peer)
+{
+	struct sni_warm *w;
+	unsigned i;
+	char c;
+	int fd;
+
+	for (i = 0; i < peer->nwarm; i ++) {
+		w = &peer->warm[i];
+
+		if (w->state != warm_ready) {
+			continue;
+		}
+
+		/* Closed by the backend but not noticed yet */
+		if (recv(w->fd, &c, 1, MSG_PEEK|MSG_DONTWAIT) != -1 ||
+				(errno != EAGAIN && errno != EWOULDBLOCK)) {
+			warm_retry(w, 1.0);
+			continue;
+		}
+
+		fd = w->fd;
+		w->fd = -1;
+		warm_close(w);
+		warm_connect(w);
+
+		return fd;
+	}
+
+	return -1;
+}
+
+static void
+tfo_report_cb(EV_P_ ev_timer *w, int revents)
+{
+	static uint64_t last;
+
+	if (stats->tfo_syn_data + stats->tfo_no_cookie == last) {
+		return;
+	}
+
+	last = stats->tfo_syn_data + stats->tfo_no_cookie;
+	fprintf(stderr, "fast open: %" PRIu64 " connects with data in SYN, "
+			"%" PRIu64 " accepted, %" PRIu64 " without cookie\n",
+			stats->tfo_syn_data, stats->tfo_acked, stats->tfo_no_cookie);
+}
+
+void
+connect_start(struct ev_loop *loop)
+{
+	pool_loop = loop;
+
+	if (backend_fastopen) {
+		ev_timer_init(&tfo_report, tfo_report_cb, tfo_report_interval,
+				tfo_report_interval);
+		ev_timer_start(loop, &tfo_report);
+		/* Not a reason to keep the loop running */
+		ev_unref(loop);
+	}
+}
+
+void
+peer_pool_start(struct sni_peer *peer)
+{
+	const struct sni_backend *bk = peer->up->bk;
+	struct sni_warm *w;
+	unsigned i;
+
+	if (pool_loop == NULL || bk->warm_connections == 0 || peer->warm != NULL) {
+		return;
+	}
+
+	peer->nwarm = bk->warm_connections;
+	peer->warm = xmalloc0(sizeof(*peer->warm) * peer->nwarm);
+
+	for (i = 0; i < peer->nwarm; i ++) {
+		w = &peer->warm[i];
+		w->peer = peer;
+		w->fd = -1;
+		w->io.data = w;
+		ev_io_init(&w->io, warm_io_cb, -1, EV_WRITE);
+		w->tm.data = w;
+		ev_timer_init(&w->tm, warm_timer_cb, 0.0, 0.0);
+		warm_connect(w);
+	}
+}
+
+void
+peer_pool_stop(struct sni_peer *peer)
+{
+	unsigned i;
+
+	for (i = 0; i < peer->nwarm; i ++) {
+		warm_close(&peer->warm[i]);
+	}
+
+	free(peer->warm);
+	peer->warm = NULL;
+	peer->nwarm = 0;
+}
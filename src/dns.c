@@ -0,0 +1,1259 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
+
+#include "ev.h"
+#include "dns.h"
+#include "util.h"
+
+#define DNS_PORT 53
+#define DNS_TYPE_A 1
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+#define DNS_MAX_ADDRS 32
+#define DNS_MAX_TRIES 3
+#define DNS_MAX_SERVERS 3
+#define DNS_MAX_SEARCH 6
+#define DNS_MAX_NDOTS 15
+#define DNS_PACKET 1232
+/* Queries sent from one source port before a server socket is replaced */
+#define DNS_PORT_QUERIES 64
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_TC 0x0200
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_RCODE_REFUSED 5
+#define DNS_RESOLV_CONF "/etc/resolv.conf"
+#define DNS_HOSTS "/etc/hosts"
+/*
+ * Answers from the hosts file get the shortest TTL, so callers refresh
+ * them as often as their minimal TTL allows and notice edits of the file
+ */
+#define DNS_HOSTS_TTL 1
+
+static const uint16_t dns_types[2] = {DNS_TYPE_A, DNS_TYPE_AAAA};
+
+struct dns_query {
+	struct dns_resolver *r;
+	ev_timer tm;
+	dns_cb cb;
+	void *ud;
+	int port;
+	int tries;
+	unsigned ttl;
+	unsigned naddrs;
+	int rcode;
+	bool truncated;
+	/* One request per address family */
+	uint16_t id[2];
+	bool done[2];
+	/* Server each request is sent to, and how many have failed it */
+	uint8_t server[2];
+	uint8_t failed[2];
+	/* Name as given, and the search list entry tried next */
+	bool absolute;
+	unsigned search;
+	size_t originlen;
+	char origin[256];
+	/* Name being queried */
+	size_t namelen;
+	char name[256];
+	union sni_sockaddr addrs[DNS_MAX_ADDRS];
+};
+
+struct dns_host {
+	char *name;
+	union sni_sockaddr addr;
+};
+
+/*
+ * Connected sockets of a server. The current one is replaced every
+ * DNS_PORT_QUERIES queries to move to another random source port, the
+ * previous one is kept open for late replies
+ */
+struct dns_server {
+	union sni_sockaddr sa;
+	ev_io io[2];
+	unsigned cur;
+	unsigned sent;
+};
+
+struct dns_resolver {
+	struct ev_loop *loop;
+	/* Replies are accepted from any of the servers */
+	struct dns_server servers[DNS_MAX_SERVERS];
+	unsigned nservers;
+	double timeout;
+	unsigned pending;
+	unsigned ndots;
+	unsigned nsearch;
+	char *search[DNS_MAX_SEARCH];
+	/* Hosts file sorted by name, reloaded when it changes */
+	struct dns_host *hosts;
+	unsigned nhosts;
+	struct stat hosts_st;
+	/* Indexed by request id */
+	struct dns_query **ids;
+	/* Random bytes for request ids */
+	uint8_t rnd[256];
+	unsigned rnd_left;
+};
+
+struct dns_header {
+	uint16_t id;
+	uint16_t flags;
+	uint16_t qdcount;
+	uint16_t ancount;
+	uint16_t nscount;
+	uint16_t arcount;
+};
+
+static bool
+dns_parse_server(const char *server, union sni_sockaddr *sa)
+{
+	char host[INET6_ADDRSTRLEN + 1];
+	const char *p, *port = NULL;
+	size_t len;
+	int nport = DNS_PORT;
+
+	if (server[0] == '[') {
+		p = strchr(server, ']');
+
+		if (p == NULL) {
+			return false;
+		}
+
+		len = p - server - 1;
+		server ++;
+
+		if (p[1] == ':') {
+			port = p + 2;
+		}
+	}
+	else if ((p = strchr(server, ':')) != NULL && strchr(p + 1, ':') == NULL) {
+		/* IPv4 address with a port */
+		len = p - server;
+		port = p + 1;
+	}
+	else {
+		len = strlen(server);
+	}
+
+	if (len == 0 || len >= sizeof(host)) {
+		return false;
+	}
+
+	memcpy(host, server, len);
+	host[len] = '\0';
+
+	if (port != NULL) {
+		nport = atoi(port);
+
+		if (nport <= 0 || nport > 65535) {
+			return false;
+		}
+	}
+
+	memset(sa, 0, sizeof(*sa));
+
+	if (inet_pton(AF_INET, host, &sa->sin.sin_addr) == 1) {
+		sa->sin.sin_family = AF_INET;
+		sa->sin.sin_port = htons(nport);
+	}
+	else if (inet_pton(AF_INET6, host, &sa->sin6.sin6_addr) == 1) {
+		sa->sin6.sin6_family = AF_INET6;
+		sa->sin6.sin6_port = htons(nport);
+	}
+	else {
+		return false;
+	}
+
+	return true;
+}
+
+/* Lower cases `len` bytes of `src`, returns false if it is not a valid name */
+static bool
+dns_copy_name(char *dst, const char *src, size_t len)
+{
+	size_t i, label = 0;
+
+	if (len == 0 || len > 253) {
+		return false;
+	}
+
+	for (i = 0; i < len; i ++) {
+		dst[i] = src[i] >= 'A' && src[i] <= 'Z' ? src[i] + ('a' - 'A') : src[i];
+
+		if (src[i] == '.') {
+			if (label == 0) {
+				return false;
+			}
+
+			label = 0;
+		}
+		else if (++ label > 63) {
+			return false;
+		}
+	}
+
+	dst[len] = '\0';
+
+	return label > 0;
+}
+
+static void
+dns_add_search(struct dns_resolver *r, const char *dom)
+{
+	size_t len = strlen(dom);
+
+	if (len > 0 && dom[len - 1] == '.') {
+		len --;
+	}
+
+	if (r->nsearch < DNS_MAX_SEARCH) {
+		r->search[r->nsearch] = xmalloc(len + 1);
+
+		if (dns_copy_name(r->search[r->nsearch], dom, len)) {
+			r->nsearch ++;
+		}
+		else {
+			free(r->search[r->nsearch]);
+		}
+	}
+}
+
+static void
+dns_clear_search(struct dns_resolver *r)
+{
+	while (r->nsearch > 0) {
+		free(r->search[-- r->nsearch]);
+	}
+}
+
+/*
+ * Reads nameservers, the search list and ndots from resolv.conf the way
+ * libc does: the last of `domain` and `search` wins, and without either
+ * the domain of the host name is searched
+ */
+static void
+dns_system_conf(struct dns_resolver *r, union sni_sockaddr *servers,
+		unsigned *nservers)
+{
+	char line[1024], host[256], *p, *tok, *save;
+	bool searched = false;
+	FILE *f;
+
+	r->ndots = 1;
+	f = fopen(DNS_RESOLV_CONF, "r");
+
+	while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+		tok = strtok_r(line, " \t\r\n", &save);
+
+		if (tok == NULL || tok[0] == '#' || tok[0] == ';') {
+			continue;
+		}
+
+		if (strcmp(tok, "nameserver") == 0) {
+			tok = strtok_r(NULL, " \t\r\n", &save);
+
+			if (tok != NULL && *nservers < DNS_MAX_SERVERS) {
+				/* Scope of a link local address is not supported */
+				tok[strcspn(tok, "%")] = '\0';
+
+				if (dns_parse_server(tok, &servers[*nservers])) {
+					(*nservers) ++;
+				}
+			}
+		}
+		else if (strcmp(tok, "domain") == 0 || strcmp(tok, "search") == 0) {
+			dns_clear_search(r);
+			searched = true;
+
+			while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+				dns_add_search(r, tok);
+			}
+		}
+		else if (strcmp(tok, "options") == 0) {
+			while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+				if (strncmp(tok, "ndots:", sizeof("ndots:") - 1) == 0) {
+					r->ndots = atoi(tok + sizeof("ndots:") - 1);
+
+					if (r->ndots > DNS_MAX_NDOTS) {
+						r->ndots = DNS_MAX_NDOTS;
+					}
+				}
+			}
+		}
+	}
+
+	if (f != NULL) {
+		fclose(f);
+	}
+
+	if (!searched && gethostname(host, sizeof(host) - 1) == 0) {
+		host[sizeof(host) - 1] = '\0';
+		p = strchr(host, '.');
+
+		if (p != NULL && p[1] != '\0') {
+			dns_add_search(r, p + 1);
+		}
+	}
+}
+
+static int
+dns_host_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct dns_host *)a)->name,
+			((const struct dns_host *)b)->name);
+}
+
+static void
+dns_hosts_free(struct dns_resolver *r)
+{
+	unsigned i;
+
+	for (i = 0; i < r->nhosts; i ++) {
+		free(r->hosts[i].name);
+	}
+
+	free(r->hosts);
+	r->hosts = NULL;
+	r->nhosts = 0;
+}
+
+/* Rereads the hosts file if it has been changed since the last read */
+static void
+dns_hosts_load(struct dns_resolver *r)
+{
+	struct stat st;
+	union sni_sockaddr sa;
+	char *line = NULL, *tok, *save, name[256];
+	size_t linecap = 0, len, cap = 0;
+	FILE *f;
+
+	if (stat(DNS_HOSTS, &st) == -1) {
+		memset(&st, 0, sizeof(st));
+	}
+
+	if (st.st_ino == r->hosts_st.st_ino && st.st_size == r->hosts_st.st_size &&
+			st.st_mtime == r->hosts_st.st_mtime) {
+		return;
+	}
+
+	r->hosts_st = st;
+	dns_hosts_free(r);
+	f = fopen(DNS_HOSTS, "r");
+
+	if (f == NULL) {
+		return;
+	}
+
+	while (getline(&line, &linecap, f) != -1) {
+		line[strcspn(line, "#")] = '\0';
+		tok = strtok_r(line, " \t\r\n", &save);
+
+		if (tok == NULL) {
+			continue;
+		}
+
+		tok[strcspn(tok, "%")] = '\0';
+		memset(&sa, 0, sizeof(sa));
+
+		if (inet_pton(AF_INET, tok, &sa.sin.sin_addr) == 1) {
+			sa.sin.sin_family = AF_INET;
+		}
+		else if (inet_pton(AF_INET6, tok, &sa.sin6.sin6_addr) == 1) {
+			sa.sin6.sin6_family = AF_INET6;
+		}
+		else {
+			continue;
+		}
+
+		while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+			len = strlen(tok);
+
+			if (len > 0 && tok[len - 1] == '.') {
+				len --;
+			}
+
+			if (!dns_copy_name(name, tok, len)) {
+				continue;
+			}
+
+			if (r->nhosts == cap) {
+				cap = cap ? cap * 2 : 64;
+				r->hosts = xrealloc(r->hosts, cap * sizeof(*r->hosts));
+			}
+
+			r->hosts[r->nhosts].name = strdup(name);
+			r->hosts[r->nhosts].addr = sa;
+			r->nhosts ++;
+		}
+	}
+
+	free(line);
+	fclose(f);
+
+	if (r->nhosts > 1) {
+		qsort(r->hosts, r->nhosts, sizeof(*r->hosts), dns_host_cmp);
+	}
+}
+
+socklen_t
+dns_addr_len(const union sni_sockaddr *sa)
+{
+	return sa->sa.sa_family == AF_INET6 ? sizeof(sa->sin6) : sizeof(sa->sin);
+}
+
+uint32_t
+dns_addr_hash(const union sni_sockaddr *sa, bool with_port, uint32_t seed)
+{
+	static const uint8_t v4mapped[12] = {0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+	const uint8_t *p;
+	uint32_t h = 2166136261U ^ seed;
+	uint16_t port;
+	size_t len, i;
+
+	if (sa->sa.sa_family == AF_INET6) {
+		p = sa->sin6.sin6_addr.s6_addr;
+		len = 16;
+		port = sa->sin6.sin6_port;
+
+		if (memcmp(p, v4mapped, sizeof(v4mapped)) == 0) {
+			p += sizeof(v4mapped);
+			len = 4;
+		}
+	}
+	else {
+		p = (const uint8_t *)&sa->sin.sin_addr;
+		len = 4;
+		port = sa->sin.sin_port;
+	}
+
+	for (i = 0; i < len; i ++) {
+		h = (h ^ p[i]) * 16777619U;
+	}
+
+	if (with_port) {
+		h = (h ^ (port & 0xff)) * 16777619U;
+		h = (h ^ (port >> 8)) * 16777619U;
+	}
+
+	/* FNV alone has weak low bits, which are used for table slots */
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+
+	return h;
+}
+
+struct dns_addrs*
+dns_addrs_ref(struct dns_addrs *a)
+{
+	a->ref ++;
+
+	return a;
+}
+
+void
+dns_addrs_unref(struct dns_addrs *a)
+{
+	if (a && -- a->ref == 0) {
+		free(a);
+	}
+}
+
+static struct dns_addrs*
+dns_addrs_new(const union sni_sockaddr *addrs, unsigned naddrs, unsigned ttl)
+{
+	struct dns_addrs *a;
+
+	a = xmalloc(sizeof(*a) + sizeof(*addrs) * naddrs);
+	a->ref = 1;
+	a->naddrs = naddrs;
+	a->ttl = ttl;
+	memcpy(a->addrs, addrs, sizeof(*addrs) * naddrs);
+
+	return a;
+}
+
+struct dns_addrs*
+dns_addrs_numeric(const char *name, int port)
+{
+	union sni_sockaddr sa;
+
+	memset(&sa, 0, sizeof(sa));
+
+	if (inet_pton(AF_INET, name, &sa.sin.sin_addr) == 1) {
+		sa.sin.sin_family = AF_INET;
+		sa.sin.sin_port = htons(port);
+	}
+	else if (inet_pton(AF_INET6, name, &sa.sin6.sin6_addr) == 1) {
+		sa.sin6.sin6_family = AF_INET6;
+		sa.sin6.sin6_port = htons(port);
+	}
+	else {
+		return NULL;
+	}
+
+	return dns_addrs_new(&sa, 1, 0);
+}
+
+/* Writes the question section, returns its length or 0 */
+static size_t
+dns_write_question(uint8_t *p, const char *name, size_t namelen, uint16_t type)
+{
+	const char *label = name, *dot;
+	size_t llen, off = 0;
+
+	while (label < name + namelen) {
+		dot = memchr(label, '.', name + namelen - label);
+		llen = dot ? (size_t)(dot - label) : (size_t)(name + namelen - label);
+
+		if (llen == 0 || llen > 63) {
+			return 0;
+		}
+
+		p[off ++] = llen;
+		memcpy(p + off, label, llen);
+		off += llen;
+		label += llen + 1;
+	}
+
+	p[off ++] = 0;
+	p[off ++] = type >> 8;
+	p[off ++] = type & 0xff;
+	p[off ++] = 0;
+	p[off ++] = DNS_CLASS_IN;
+
+	return off;
+}
+
+static void dns_read_cb(EV_P_ ev_io *w, int revents);
+
+static bool
+dns_open_socket(struct dns_resolver *r, struct dns_server *srv, ev_io *io)
+{
+	int fd;
+
+	fd = socket(srv->sa.sa.sa_family, SOCK_DGRAM, 0);
+
+	if (fd == -1) {
+		fprintf(stderr, "cannot create dns socket: %s\n", strerror(errno));
+		return false;
+	}
+
+	/* Unbound socket gets a random ephemeral port on connect */
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1 ||
+			connect(fd, &srv->sa.sa, dns_addr_len(&srv->sa)) == -1) {
+		fprintf(stderr, "cannot connect dns socket: %s\n", strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	io->data = r;
+	ev_io_init(io, dns_read_cb, fd, EV_READ);
+	ev_io_start(r->loop, io);
+
+	return true;
+}
+
+static void
+dns_close_socket(struct dns_resolver *r, ev_io *io)
+{
+	if (ev_is_active(io)) {
+		ev_io_stop(r->loop, io);
+		close(io->fd);
+	}
+}
+
+/* Moves the server to a new source port, keeping the old one for replies */
+static void
+dns_rotate(struct dns_resolver *r, struct dns_server *srv)
+{
+	ev_io *prev = &srv->io[srv->cur ^ 1];
+
+	srv->sent = 0;
+	dns_close_socket(r, prev);
+
+	if (dns_open_socket(r, srv, prev)) {
+		srv->cur ^= 1;
+	}
+}
+
+static void
+dns_send(struct dns_query *q, int i)
+{
+	struct dns_server *srv = &q->r->servers[q->server[i]];
+	uint8_t pkt[DNS_PACKET];
+	struct dns_header *h = (struct dns_header *)pkt;
+	size_t len;
+
+	memset(h, 0, sizeof(*h));
+	h->id = q->id[i];
+	/* Recursion desired */
+	h->flags = htons(0x0100);
+	h->qdcount = htons(1);
+	len = dns_write_question(pkt + sizeof(*h), q->name, q->namelen,
+			dns_types[i]);
+
+	/* Lost datagrams are retried by the timer */
+	(void)send(srv->io[srv->cur].fd, pkt, sizeof(*h) + len, 0);
+
+	if (++ srv->sent >= DNS_PORT_QUERIES) {
+		dns_rotate(q->r, srv);
+	}
+}
+
+/* Request ids must not be guessable, or forged replies could be accepted */
+static uint16_t
+dns_random(struct dns_resolver *r)
+{
+	uint16_t v;
+#if !defined(HAVE_ARC4RANDOM_BUF) && !defined(HAVE_GETRANDOM)
+	int fd;
+#endif
+
+	if (r->rnd_left < sizeof(v)) {
+#if defined(HAVE_ARC4RANDOM_BUF)
+		arc4random_buf(r->rnd, sizeof(r->rnd));
+#elif defined(HAVE_GETRANDOM)
+		if (getrandom(r->rnd, sizeof(r->rnd), 0) != sizeof(r->rnd)) {
+			abort();
+		}
+#else
+		fd = open("/dev/urandom", O_RDONLY|O_CLOEXEC);
+
+		if (fd == -1 || read(fd, r->rnd, sizeof(r->rnd)) !=
+				(ssize_t)sizeof(r->rnd)) {
+			abort();
+		}
+
+		close(fd);
+#endif
+		r->rnd_left = sizeof(r->rnd);
+	}
+
+	r->rnd_left -= sizeof(v);
+	memcpy(&v, r->rnd + r->rnd_left, sizeof(v));
+
+	return v;
+}
+
+/* False if all ids are taken */
+static bool
+dns_alloc_id(struct dns_resolver *r, struct dns_query *q, uint16_t *id)
+{
+	uint16_t i = 0;
+	int tries;
+
+	for (tries = 0; tries < 8; tries ++) {
+		i = dns_random(r);
+
+		if (r->ids[i] == NULL) {
+			goto found;
+		}
+	}
+
+	/* Table is crowded, take the next free id */
+	for (tries = 0; tries < 65536; tries ++, i ++) {
+		if (r->ids[i] == NULL) {
+			goto found;
+		}
+	}
+
+	return false;
+
+found:
+	r->ids[i] = q;
+	*id = i;
+
+	return true;
+}
+
+static void
+dns_query_free(struct dns_query *q)
+{
+	struct dns_resolver *r = q->r;
+
+	ev_timer_stop(r->loop, &q->tm);
+	r->ids[q->id[0]] = NULL;
+	r->ids[q->id[1]] = NULL;
+	r->pending --;
+	free(q);
+}
+
+static void
+dns_finish(struct dns_query *q)
+{
+	struct dns_addrs *a = NULL;
+	const char *err = NULL;
+	dns_cb cb = q->cb;
+	void *ud = q->ud;
+
+	if (q->naddrs > 0) {
+		a = dns_addrs_new(q->addrs, q->naddrs, q->ttl);
+	}
+	else if (q->rcode == DNS_RCODE_NXDOMAIN) {
+		err = "name does not exist";
+	}
+	else if (q->rcode != 0) {
+		err = "server failure";
+	}
+	else if (q->truncated) {
+		err = "truncated reply";
+	}
+	else if (q->done[0] && q->done[1]) {
+		err = "no addresses";
+	}
+	else {
+		err = "timed out";
+	}
+
+	dns_query_free(q);
+	cb(a, err, ud);
+}
+
+/*
+ * Sets the next name to query from the search list: a name with fewer
+ * than ndots dots is tried with the search domains first, any other name
+ * as is first, and a name with a trailing dot only as is
+ */
+static bool
+dns_next_name(struct dns_query *q)
+{
+	struct dns_resolver *r = q->r;
+	unsigned dots = 0, n, idx;
+	const char *dom = NULL;
+	size_t i, dlen;
+
+	for (i = 0; i < q->originlen; i ++) {
+		dots += q->origin[i] == '.';
+	}
+
+	n = q->absolute ? 1 : r->nsearch + 1;
+
+	while (q->search < n) {
+		idx = q->search ++;
+
+		if (q->absolute) {
+			dom = NULL;
+		}
+		else if (dots < r->ndots) {
+			dom = idx < r->nsearch ? r->search[idx] : NULL;
+		}
+		else {
+			dom = idx > 0 ? r->search[idx - 1] : NULL;
+		}
+
+		if (dom == NULL) {
+			memcpy(q->name, q->origin, q->originlen + 1);
+			q->namelen = q->originlen;
+
+			return true;
+		}
+
+		dlen = strlen(dom);
+
+		if (q->originlen + 1 + dlen > 253) {
+			continue;
+		}
+
+		memcpy(q->name, q->origin, q->originlen);
+		q->name[q->originlen] = '.';
+		memcpy(q->name + q->originlen + 1, dom, dlen + 1);
+		q->namelen = q->originlen + 1 + dlen;
+
+		return true;
+	}
+
+	return false;
+}
+
+/* Sends both requests for the current name to the first server */
+static void
+dns_query_start(struct dns_query *q)
+{
+	struct dns_resolver *r = q->r;
+	int i;
+
+	q->tries = 0;
+	q->ttl = UINT32_MAX;
+	q->rcode = 0;
+	q->truncated = false;
+
+	for (i = 0; i < 2; i ++) {
+		q->done[i] = false;
+		q->server[i] = 0;
+		q->failed[i] = 0;
+		dns_send(q, i);
+	}
+
+	ev_timer_stop(r->loop, &q->tm);
+	ev_timer_set(&q->tm, r->timeout, r->timeout);
+	ev_timer_start(r->loop, &q->tm);
+}
+
+static void
+dns_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct dns_query *q = w->data;
+	struct dns_resolver *r = q->r;
+	int i;
+
+	/* Answered from the hosts file */
+	if (q->done[0] && q->done[1]) {
+		dns_finish(q);
+		return;
+	}
+
+	/* Every server gets all of the tries, each retry goes to the next one */
+	if (++ q->tries >= DNS_MAX_TRIES * (int)r->nservers) {
+		dns_finish(q);
+		return;
+	}
+
+	for (i = 0; i < 2; i ++) {
+		if (!q->done[i]) {
+			q->server[i] = (q->server[i] + 1) % r->nservers;
+			dns_send(q, i);
+		}
+	}
+
+	ev_timer_again(loop, &q->tm);
+}
+
+/* Skips a possibly compressed name, returns the new offset or 0 */
+static size_t
+dns_skip_name(const uint8_t *pkt, size_t len, size_t off)
+{
+	while (off < len) {
+		if (pkt[off] == 0) {
+			return off + 1;
+		}
+
+		if ((pkt[off] & 0xc0) == 0xc0) {
+			return off + 2 <= len ? off + 2 : 0;
+		}
+
+		off += pkt[off] + 1;
+	}
+
+	return 0;
+}
+
+static void
+dns_parse_reply(struct dns_resolver *r, const uint8_t *pkt, size_t len)
+{
+	const struct dns_header *h = (const struct dns_header *)pkt;
+	struct dns_query *q;
+	union sni_sockaddr *sa;
+	uint8_t qname[DNS_PACKET];
+	size_t off, qlen, j;
+	uint16_t type, rdlen, ancount, flags;
+	uint8_t c;
+	uint32_t ttl;
+	int i, rcode;
+
+	if (len < sizeof(*h) || (ntohs(h->flags) & DNS_FLAG_QR) == 0) {
+		return;
+	}
+
+	q = r->ids[h->id];
+
+	if (q == NULL) {
+		return;
+	}
+
+	i = q->id[0] == h->id ? 0 : 1;
+
+	if (q->done[i] || ntohs(h->qdcount) != 1) {
+		return;
+	}
+
+	/* Question must be exactly ours, which also rules out stray replies */
+	qlen = dns_write_question(qname, q->name, q->namelen, dns_types[i]);
+	off = sizeof(*h);
+
+	if (qlen == 0 || len < off + qlen) {
+		return;
+	}
+
+	for (j = 0; j < qlen; j ++) {
+		c = pkt[off + j];
+
+		if (c >= 'A' && c <= 'Z') {
+			c += 'a' - 'A';
+		}
+
+		if (c != qname[j]) {
+			return;
+		}
+	}
+
+	off += qlen;
+	flags = ntohs(h->flags);
+	rcode = flags & 0xf;
+
+	/* A failing server is skipped, as long as there is another one to ask */
+	if ((rcode == DNS_RCODE_SERVFAIL || rcode == DNS_RCODE_REFUSED) &&
+			++ q->failed[i] < r->nservers) {
+		q->server[i] = (q->server[i] + 1) % r->nservers;
+		dns_send(q, i);
+		return;
+	}
+
+	q->done[i] = true;
+
+	if (rcode != 0) {
+		q->rcode = rcode;
+	}
+
+	ancount = ntohs(h->ancount);
+
+	/*
+	 * A truncated reply would have to be repeated over TCP, which is not
+	 * supported, so it is a failure rather than a silently partial set
+	 */
+	if (flags & DNS_FLAG_TC) {
+		q->truncated = true;
+		ancount = 0;
+	}
+
+	while (ancount -- > 0) {
+		off = dns_skip_name(pkt, len, off);
+
+		if (off == 0 || off + 10 > len) {
+			break;
+		}
+
+		type = pkt[off] << 8 | pkt[off + 1];
+		ttl = (uint32_t)pkt[off + 4] << 24 | pkt[off + 5] << 16 |
+				pkt[off + 6] << 8 | pkt[off + 7];
+		rdlen = pkt[off + 8] << 8 | pkt[off + 9];
+		off += 10;
+
+		if (off + rdlen > len) {
+			break;
+		}
+
+		if (type == dns_types[i] && q->naddrs < DNS_MAX_ADDRS &&
+				rdlen == (type == DNS_TYPE_A ? 4 : 16)) {
+			sa = &q->addrs[q->naddrs ++];
+			memset(sa, 0, sizeof(*sa));
+
+			if (type == DNS_TYPE_A) {
+				sa->sin.sin_family = AF_INET;
+				sa->sin.sin_port = htons(q->port);
+				memcpy(&sa->sin.sin_addr, pkt + off, 4);
+			}
+			else {
+				sa->sin6.sin6_family = AF_INET6;
+				sa->sin6.sin6_port = htons(q->port);
+				memcpy(&sa->sin6.sin6_addr, pkt + off, 16);
+			}
+
+			/* The whole set expires with its shortest lived record */
+			if (ttl < q->ttl) {
+				q->ttl = ttl;
+			}
+		}
+
+		off += rdlen;
+	}
+
+	if (q->done[0] && q->done[1]) {
+		/* An address found in one family is enough */
+		if (q->naddrs > 0) {
+			q->rcode = 0;
+		}
+		/* A name that does not exist is tried with the next search domain */
+		else if ((q->rcode == 0 || q->rcode == DNS_RCODE_NXDOMAIN) &&
+				!q->truncated && dns_next_name(q)) {
+			dns_query_start(q);
+			return;
+		}
+
+		dns_finish(q);
+	}
+}
+
+static void
+dns_read_cb(EV_P_ ev_io *w, int revents)
+{
+	struct dns_resolver *r = w->data;
+	uint8_t pkt[DNS_PACKET * 4];
+	ssize_t len;
+
+	while ((len = recv(w->fd, pkt, sizeof(pkt), 0)) > 0) {
+		dns_parse_reply(r, pkt, len);
+	}
+}
+
+static void
+dns_add_addr(struct dns_query *q, const union sni_sockaddr *addr)
+{
+	union sni_sockaddr *sa;
+
+	if (q->naddrs < DNS_MAX_ADDRS) {
+		sa = &q->addrs[q->naddrs ++];
+		*sa = *addr;
+
+		if (sa->sa.sa_family == AF_INET) {
+			sa->sin.sin_port = htons(q->port);
+		}
+		else {
+			sa->sin6.sin6_port = htons(q->port);
+		}
+	}
+}
+
+/*
+ * Looks the current name up in the hosts file. Names under localhost are
+ * loopback even without an entry, as RFC 6761 recommends
+ */
+static bool
+dns_hosts_lookup(struct dns_query *q)
+{
+	struct dns_resolver *r = q->r;
+	struct dns_host key, *h, *end;
+	union sni_sockaddr lo;
+	static const char local[] = "localhost";
+	size_t llen = sizeof(local) - 1;
+
+	key.name = q->name;
+	h = r->nhosts > 0 ? bsearch(&key, r->hosts, r->nhosts, sizeof(*r->hosts),
+			dns_host_cmp) : NULL;
+
+	if (h != NULL) {
+		end = r->hosts + r->nhosts;
+
+		while (h > r->hosts && strcmp(h[-1].name, q->name) == 0) {
+			h --;
+		}
+
+		for (; h < end && strcmp(h->name, q->name) == 0; h ++) {
+			dns_add_addr(q, &h->addr);
+		}
+
+		return true;
+	}
+
+	if (strcmp(q->name, local) == 0 || (q->namelen > llen &&
+			q->name[q->namelen - llen - 1] == '.' &&
+			strcmp(q->name + q->namelen - llen, local) == 0)) {
+		memset(&lo, 0, sizeof(lo));
+		lo.sin.sin_family = AF_INET;
+		lo.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		dns_add_addr(q, &lo);
+		memset(&lo, 0, sizeof(lo));
+		lo.sin6.sin6_family = AF_INET6;
+		lo.sin6.sin6_addr = in6addr_loopback;
+		dns_add_addr(q, &lo);
+
+		return true;
+	}
+
+	return false;
+}
+
+static bool
+dns_open_server(struct dns_resolver *r, const union sni_sockaddr *sa)
+{
+	struct dns_server *srv = &r->servers[r->nservers];
+
+	srv->sa = *sa;
+
+	if (!dns_open_socket(r, srv, &srv->io[0])) {
+		return false;
+	}
+
+	r->nservers ++;
+
+	return true;
+}
+
+struct dns_resolver*
+dns_resolver_create(struct ev_loop *loop, const char *server, double timeout)
+{
+	struct dns_resolver *r;
+	union sni_sockaddr servers[DNS_MAX_SERVERS];
+	unsigned nservers = 0, i;
+
+	r = xmalloc0(sizeof(*r));
+	r->loop = loop;
+	r->timeout = timeout;
+	dns_system_conf(r, servers, &nservers);
+
+	if (server != NULL) {
+		if (!dns_parse_server(server, &servers[0])) {
+			fprintf(stderr, "invalid dns server: %s\n", server);
+			dns_resolver_destroy(r);
+			return NULL;
+		}
+
+		nservers = 1;
+	}
+	else if (nservers == 0) {
+		dns_parse_server("127.0.0.1", &servers[0]);
+		nservers = 1;
+	}
+
+	for (i = 0; i < nservers; i ++) {
+		if (!dns_open_server(r, &servers[i])) {
+			dns_resolver_destroy(r);
+			return NULL;
+		}
+	}
+
+	r->ids = xmalloc0(sizeof(*r->ids) * 65536);
+
+	return r;
+}
+
+struct dns_query*
+dns_resolve(struct dns_resolver *r, const char *name, int port, dns_cb cb,
+		void *ud)
+{
+	struct dns_query *q;
+	size_t len = strlen(name);
+	bool absolute = false;
+
+	if (len > 0 && name[len - 1] == '.') {
+		len --;
+		absolute = true;
+	}
+
+	q = xmalloc0(sizeof(*q));
+
+	/* Name is sent in lower case, replies are compared against it */
+	if (!dns_copy_name(q->origin, name, len)) {
+		free(q);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	q->r = r;
+	q->cb = cb;
+	q->ud = ud;
+	q->port = port;
+	q->originlen = len;
+	q->absolute = absolute;
+	if (!dns_alloc_id(r, q, &q->id[0])) {
+		free(q);
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	if (!dns_alloc_id(r, q, &q->id[1])) {
+		r->ids[q->id[0]] = NULL;
+		free(q);
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	q->tm.data = q;
+	ev_timer_init(&q->tm, dns_timer_cb, r->timeout, r->timeout);
+	r->pending ++;
+
+	/* Hosts file is searched first, with the same search list */
+	dns_hosts_load(r);
+
+	while (dns_next_name(q)) {
+		if (dns_hosts_lookup(q)) {
+			/* Completed from the loop, callers expect no reentrance */
+			q->ttl = DNS_HOSTS_TTL;
+			q->done[0] = q->done[1] = true;
+			ev_timer_set(&q->tm, 0.0, r->timeout);
+			ev_timer_start(r->loop, &q->tm);
+
+			return q;
+		}
+	}
+
+	q->search = 0;
+	dns_next_name(q);
+	dns_query_start(q);
+
+	return q;
+}
+
+void
+dns_cancel(struct dns_query *q)
+{
+	if (q) {
+		dns_query_free(q);
+	}
+}
+
+unsigned
+dns_pending(const struct dns_resolver *r)
+{
+	return r->pending;
+}
+
+void
+dns_resolver_destroy(struct dns_resolver *r)
+{
+	unsigned i;
+
+	if (r) {
+		/* Outstanding queries are dropped silently */
+		for (i = 0; r->ids != NULL && i < 65536; i ++) {
+			if (r->ids[i] != NULL && r->ids[i]->id[0] == i) {
+				dns_query_free(r->ids[i]);
+			}
+		}
+
+		for (i = 0; i < r->nservers; i ++) {
+			dns_close_socket(r, &r->servers[i].io[0]);
+			dns_close_socket(r, &r->servers[i].io[1]);
+		}
+
+		dns_clear_search(r);
+		dns_hosts_free(r);
+		free(r->ids);
+		free(r);
+	}
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SRC_DNS_H_
+#define SRC_DNS_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ev.h"
+
+/*
+ * Minimal asynchronous stub resolver: the hosts file, then A and AAAA
+ * queries over UDP to the recursive servers, driven by the event loop
+ */
+union sni_sockaddr {
+	struct sockaddr sa;
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+};
+
+/*
+ * Immutable set of resolved addresses. Holders take a reference, so a set
+ * can be replaced while sessions still connect to the old addresses
+ */
+struct dns_addrs {
+	unsigned ref;
+	unsigned naddrs;
+	unsigned ttl; /* 0 if addresses never expire */
+	union sni_sockaddr addrs[];
+};
+
+struct dns_resolver;
+struct dns_query;
+
+/* On success `addrs` is passed with a reference owned by the callback */
+typedef void (*dns_cb)(struct dns_addrs *addrs, const char *err, void *ud);
+
+/*
+ * `server` is "host", "host:port" or "[host]:port", NULL for the servers
+ * of resolv.conf. The search list of resolv.conf applies in either case
+ */
+struct dns_resolver* dns_resolver_create(struct ev_loop *loop,
+		const char *server, double timeout);
+/* NULL with EINVAL for an invalid name, EAGAIN if all request ids are taken */
+struct dns_query* dns_resolve(struct dns_resolver *r, const char *name,
+		int port, dns_cb cb, void *ud);
+/* Callback is not called for a cancelled query */
+void dns_cancel(struct dns_query *q);
+unsigned dns_pending(const struct dns_resolver *r);
+void dns_resolver_destroy(struct dns_resolver *r);
+
+/* Returns NULL if `name` is not a numeric address */
+struct dns_addrs* dns_addrs_numeric(const char *name, int port);
+struct dns_addrs* dns_addrs_ref(struct dns_addrs *a);
+void dns_addrs_unref(struct dns_addrs *a);
+socklen_t dns_addr_len(const union sni_sockaddr *sa);
+/* IPv4 mapped addresses hash as IPv4, the port is optional */
+uint32_t dns_addr_hash(const union sni_sockaddr *sa, bool with_port,
+		uint32_t seed);
+
+#endif /* SRC_DNS_H_ */
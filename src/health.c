@@ -0,0 +1,324 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Peer health. A peer is ejected from selection after `max_fails`
+ * consecutive failures, either seen by sessions (refused connects, resets)
+ * or by active TCP connect checks. When its ejection time is over, the peer
+ * is probed with a connect: it is restored if the probe succeeds and
+ * ejected again for twice as long otherwise. Ejection time goes back to
+ * `fail_timeout` once a session gets a reply from the peer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "dns.h"
+#include "sni-private.h"
+
+/* Upper bound of the ejection time, seconds */
+static const double max_ejection = 300.0;
+
+static struct ev_loop *health_loop;
+
+static void
+peer_log(const struct sni_peer *peer, const char *what)
+{
+	char addr[INET6_ADDRSTRLEN];
+	const void *a;
+
+	if (peer->addr.sa.sa_family == AF_INET6) {
+		a = &peer->addr.sin6.sin6_addr;
+	}
+	else {
+		a = &peer->addr.sin.sin_addr;
+	}
+
+	if (inet_ntop(peer->addr.sa.sa_family, a, addr, sizeof(addr)) == NULL) {
+		strcpy(addr, "?");
+	}
+
+	fprintf(stderr, "backend %s: %s (%s) %s\n", peer->up->bk->name,
+			peer->up->host, addr, what);
+}
+
+static void
+peer_schedule(struct sni_peer *peer, double after)
+{
+	ev_timer_stop(health_loop, &peer->health_tm);
+
+	if (after > 0) {
+		ev_timer_set(&peer->health_tm, after, 0.0);
+		ev_timer_start(health_loop, &peer->health_tm);
+	}
+}
+
+static void
+probe_stop(struct sni_peer *peer)
+{
+	if (peer->probe_fd != -1) {
+		ev_io_stop(health_loop, &peer->probe_io);
+		close(peer->probe_fd);
+		peer->probe_fd = -1;
+	}
+}
+
+static void
+peer_eject(struct sni_peer *peer)
+{
+	struct sni_backend *bk = peer->up->bk;
+	unsigned shift = peer->ejections < 5 ? peer->ejections : 5;
+	double after;
+	char msg[64];
+
+	after = bk->fail_timeout * (double)(1U << shift);
+	if (after > max_ejection) {
+		after = max_ejection;
+	}
+
+	peer->ejections ++;
+	peer->fails = 0;
+	backend_stats(bk)->ejections ++;
+
+	if (!peer->down) {
+		peer->down = true;
+		bk->ndown ++;
+	}
+
+	snprintf(msg, sizeof(msg), "ejected for %.1f seconds", after);
+	peer_log(peer, msg);
+	probe_stop(peer);
+	peer_schedule(peer, after);
+}
+
+static void
+peer_restore(struct sni_peer *peer)
+{
+	struct sni_backend *bk = peer->up->bk;
+
+	if (peer->down) {
+		peer->down = false;
+		bk->ndown --;
+		peer_log(peer, "restored");
+	}
+
+	peer->fails = 0;
+}
+
+static void
+probe_done(struct sni_peer *peer, bool ok)
+{
+	const struct sni_backend *bk = peer->up->bk;
+
+	probe_stop(peer);
+
+	if (peer->down) {
+		if (ok) {
+			peer_restore(peer);
+		}
+		else {
+			peer_eject(peer);
+			return;
+		}
+	}
+	else if (ok) {
+		peer->fails = 0;
+	}
+	else if (++ peer->fails >= (bk->max_fails > 0 ? bk->max_fails : 1)) {
+		peer_eject(peer);
+		return;
+	}
+
+	peer_schedule(peer, bk->health_interval);
+}
+
+static void
+probe_cb(EV_P_ ev_io *w, int revents)
+{
+	struct sni_peer *peer = w->data;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(peer->probe_fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+		err = errno;
+	}
+
+	probe_done(peer, err == 0);
+}
+
+static void
+probe_start(struct sni_peer *peer)
+{
+	const struct sni_backend *bk = peer->up->bk;
+	int fd;
+
+	fd = socket(peer->addr.sa.sa_family, SOCK_STREAM, 0);
+
+	if (fd == -1) {
+		/* Not the peer's fault, try again later */
+		peer_schedule(peer, bk->health_timeout);
+		return;
+	}
+
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+		close(fd);
+		peer_schedule(peer, bk->health_timeout);
+		return;
+	}
+
+	peer->probe_fd = fd;
+
+	while (connect(fd, &peer->addr.sa, dns_addr_len(&peer->addr)) == -1) {
+		if (errno == EINTR) {
+			continue;
+		}
+
+		if (errno != EINPROGRESS) {
+			probe_done(peer, false);
+			return;
+		}
+
+		ev_io_set(&peer->probe_io, fd, EV_WRITE);
+		ev_io_start(health_loop, &peer->probe_io);
+		peer_schedule(peer, bk->health_timeout);
+		return;
+	}
+
+	probe_done(peer, true);
+}
+
+static void
+health_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct sni_peer *peer = w->data;
+
+	if (peer->probe_fd != -1) {
+		/* Probe timed out */
+		probe_done(peer, false);
+	}
+	else {
+		probe_start(peer);
+	}
+}
+
+void
+health_start(struct ev_loop *loop)
+{
+	health_loop = loop;
+}
+
+void
+peer_health_init(struct sni_peer *peer)
+{
+	peer->probe_fd = -1;
+	peer->listed = true;
+	peer->health_tm.data = peer;
+	ev_timer_init(&peer->health_tm, health_timer_cb, 0.0, 0.0);
+	peer->probe_io.data = peer;
+	ev_io_init(&peer->probe_io, probe_cb, -1, EV_WRITE);
+}
+
+void
+peer_health_start(struct sni_peer *peer)
+{
+	const struct sni_backend *bk = peer->up->bk;
+
+	if (health_loop == NULL || bk->health_interval <= 0 ||
+			ev_is_active(&peer->health_tm) || peer->probe_fd != -1) {
+		return;
+	}
+
+	/* Spread checks of different peers and workers over the interval */
+	peer_schedule(peer, bk->health_interval * (0.5 + drand48() * 0.5));
+}
+
+void
+peer_health_stop(struct sni_peer *peer)
+{
+	if (health_loop != NULL) {
+		probe_stop(peer);
+		ev_timer_stop(health_loop, &peer->health_tm);
+	}
+
+	if (peer->down) {
+		peer->down = false;
+		peer->up->bk->ndown --;
+	}
+
+	peer->listed = false;
+}
+
+void
+peer_report(struct sni_peer *peer, bool ok)
+{
+	const struct sni_backend *bk = peer->up->bk;
+
+	if (ok) {
+		peer->fails = 0;
+		peer->ejections = 0;
+		return;
+	}
+
+	/* Sessions may outlive the peer in the backend's list */
+	if (!peer->listed || peer->down || bk->max_fails == 0 ||
+			health_loop == NULL) {
+		return;
+	}
+
+	if (++ peer->fails >= bk->max_fails) {
+		peer_eject(peer);
+	}
+}
+
+void
+session_backend_error(struct ssl_session *ssl, int err)
+{
+	/* A reset after the backend has replied is counted as well */
+	if (ssl->peer != NULL && (!ssl->bk_replied || err == ECONNRESET)) {
+		peer_report(ssl->peer, false);
+	}
+}
+
+void
+session_backend_replied(struct ssl_session *ssl)
+{
+	ssl->bk_replied = true;
+	session_phase(ssl, phase_reply);
+
+	if (ssl->peer != NULL) {
+		peer_report(ssl->peer, true);
+	}
+}
@@ -0,0 +1,167 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hello-gen.h"
+
+const struct hello_shape hello_shapes[] = {
+	{"curl", 31, 38, 12, 10, 0, false, 0},
+	{"go", 14, 38, 11, 12, 0, false, 0},
+	{"chrome", 16, 43, 16, 12, 180, false, 0},
+	{"chrome-pq", 16, 1263, 16, 12, 0, false, 0},
+	{"firefox-pq", 17, 1330, 15, 14, 0, true, 0},
+	{"mlkem1024", 16, 1672, 16, 12, 0, true, 0},
+	{"many-ext", 16, 38, 64, 8, 0, true, 0},
+	{"pq-fragmented", 16, 1263, 16, 12, 0, true, 256},
+};
+
+const unsigned hello_nshapes = sizeof(hello_shapes) / sizeof(hello_shapes[0]);
+
+static uint8_t *
+put16(uint8_t *p, unsigned v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+
+	return p + 2;
+}
+
+static uint8_t *
+put_ext(uint8_t *p, unsigned type, unsigned len)
+{
+	p = put16(p, type);
+	p = put16(p, len);
+	memset(p, 0x5a, len);
+
+	return p + len;
+}
+
+static uint8_t *
+put_sni(uint8_t *p, const char *host)
+{
+	unsigned hlen = strlen(host);
+
+	p = put16(p, 0);
+	p = put16(p, hlen + 5);
+	p = put16(p, hlen + 3);
+	*p ++ = 0;
+	p = put16(p, hlen);
+	memcpy(p, host, hlen);
+
+	return p + hlen;
+}
+
+const struct hello_shape *
+hello_shape_find(const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < hello_nshapes; i ++) {
+		if (strcmp(hello_shapes[i].name, name) == 0) {
+			return &hello_shapes[i];
+		}
+	}
+
+	return NULL;
+}
+
+size_t
+hello_generate(const struct hello_shape *sh, const char *host,
+		uint8_t buf[HELLO_GEN_MAX], unsigned *records)
+{
+	uint8_t msg[HELLO_GEN_MAX / 2], *p = msg, *exts;
+	size_t mlen, off, n, len = 0;
+	unsigned i;
+
+	if (host && strlen(host) > 255) {
+		abort();
+	}
+
+	/* Handshake header is filled in below */
+	p += 4;
+	p = put16(p, 0x0303);
+	memset(p, 0x11, 32 + 1 + 32);
+	p[32] = 32;
+	p += 32 + 1 + 32;
+	p = put16(p, sh->ciphers * 2);
+
+	for (i = 0; i < sh->ciphers; i ++) {
+		p = put16(p, 0x1301 + i);
+	}
+
+	*p ++ = 1;
+	*p ++ = 0;
+	exts = p;
+	p += 2;
+
+	if (host && !sh->sni_last) {
+		p = put_sni(p, host);
+	}
+
+	for (i = 0; i < sh->nexts; i ++) {
+		p = put_ext(p, 0x0a + i, sh->ext_len);
+	}
+
+	/* Key share */
+	p = put_ext(p, 51, sh->key_share);
+
+	if (sh->padding) {
+		p = put_ext(p, 21, sh->padding);
+	}
+
+	if (host && sh->sni_last) {
+		p = put_sni(p, host);
+	}
+
+	put16(exts, p - exts - 2);
+	mlen = p - msg;
+	msg[0] = 1;
+	msg[1] = (mlen - 4) >> 16;
+	msg[2] = (mlen - 4) >> 8;
+	msg[3] = mlen - 4;
+
+	/* Split into records */
+	*records = 0;
+
+	for (off = 0; off < mlen; off += n) {
+		n = sh->fragment ? MIN(sh->fragment, mlen - off) : mlen - off;
+		buf[len ++] = 0x16;
+		buf[len ++] = 0x3;
+		buf[len ++] = 0x1;
+		put16(buf + len, n);
+		len += 2;
+		memcpy(buf + len, msg + off, n);
+		len += n;
+		(*records) ++;
+	}
+
+	return len;
+}
@@ -0,0 +1,63 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+
+#ifndef SRC_HELLO_GEN_H_
+#define SRC_HELLO_GEN_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Synthetic ClientHellos for the benchmarks and the load generator. The
+ * shapes follow what common clients send: number of cipher suites, key
+ * share sizes (ML-KEM hybrids add 1-1.6k) and the number and position of
+ * extensions, which is what the parser walks. Nothing else in them makes
+ * sense to a TLS server
+ */
+struct hello_shape {
+	const char *name;
+	unsigned ciphers;
+	unsigned key_share;
+	unsigned nexts;
+	unsigned ext_len;
+	unsigned padding;
+	bool sni_last;
+	/* Largest record fragment, the whole hello in one record if 0 */
+	unsigned fragment;
+};
+
+/* Buffer large enough for any of the shapes */
+#define HELLO_GEN_MAX 8192
+
+extern const struct hello_shape hello_shapes[];
+extern const unsigned hello_nshapes;
+
+const struct hello_shape* hello_shape_find(const char *name);
+/* Writes a ClientHello for `host` (no SNI if NULL), returns its length */
+size_t hello_generate(const struct hello_shape *sh, const char *host,
+		uint8_t buf[HELLO_GEN_MAX], unsigned *records);
+
+#endif /* SRC_HELLO_GEN_H_ */
@@ -0,0 +1,299 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+
+#include <sys/types.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hello.h"
+
+static const uint8_t tls_handshake = 0x16;
+static const uint8_t tls_client_hello = 0x1;
+static const unsigned tls_ext_sni = 0x0;
+static const uint8_t tls_sni_host = 0x0;
+/* Record header and the largest plaintext fragment */
+static const size_t tls_record_header = 5;
+static const unsigned tls_max_fragment = 16384;
+
+/*
+ * Reads the handshake message in place, stepping over the headers of the
+ * records it is split into
+ */
+struct hello_cursor {
+	const uint8_t *p;
+	/* Bytes left in the current record and in the message */
+	size_t frag;
+	size_t remain;
+};
+
+static inline unsigned int
+int_2byte_be(const uint8_t *p)
+{
+	return ((unsigned int)p[0] << 8) | p[1];
+}
+
+static inline unsigned int
+int_3byte_be(const uint8_t *p)
+{
+	return ((unsigned int)p[0] << 16) | ((unsigned int)p[1] << 8) | p[2];
+}
+
+/* Slow path of cursor_take() for fields crossing a record boundary */
+static bool
+cursor_cross(struct hello_cursor *c, uint8_t *d, size_t n)
+{
+	size_t chunk;
+
+	c->remain -= n;
+
+	while (n > 0) {
+		if (c->frag == 0) {
+			/* Record headers are checked before the message is parsed */
+			c->frag = int_2byte_be(c->p + 3);
+			c->p += tls_record_header;
+		}
+
+		chunk = n < c->frag ? n : c->frag;
+
+		if (d) {
+			memcpy(d, c->p, chunk);
+			d += chunk;
+		}
+
+		c->p += chunk;
+		c->frag -= chunk;
+		n -= chunk;
+	}
+
+	return true;
+}
+
+/* Copies `n` bytes to `dst`, or skips them if it is NULL */
+static inline bool
+cursor_take(struct hello_cursor *c, void *dst, size_t n)
+{
+	if (n > c->remain) {
+		return false;
+	}
+
+	if (n > c->frag) {
+		return cursor_cross(c, dst, n);
+	}
+
+	if (dst) {
+		memcpy(dst, c->p, n);
+	}
+
+	c->p += n;
+	c->frag -= n;
+	c->remain -= n;
+
+	return true;
+}
+
+static inline bool
+cursor_u8(struct hello_cursor *c, unsigned int *v)
+{
+	uint8_t b;
+
+	if (!cursor_take(c, &b, 1)) {
+		return false;
+	}
+
+	*v = b;
+
+	return true;
+}
+
+static inline bool
+cursor_u16(struct hello_cursor *c, unsigned int *v)
+{
+	uint8_t b[2];
+
+	if (!cursor_take(c, b, 2)) {
+		return false;
+	}
+
+	*v = int_2byte_be(b);
+
+	return true;
+}
+
+static enum tls_hello_status
+hello_parse_sni(struct tls_hello *h, struct hello_cursor *c, unsigned int elen)
+{
+	unsigned int slen, type, hlen;
+
+	/* A list with exactly one host name */
+	if (elen <= 5 ||
+			!cursor_u16(c, &slen) || slen != elen - 2 ||
+			!cursor_u8(c, &type) || type != tls_sni_host ||
+			!cursor_u16(c, &hlen) || hlen != elen - 5 ||
+			hlen >= h->hostsz ||
+			!cursor_take(c, h->host, hlen)) {
+		return tls_hello_bad;
+	}
+
+	h->host[hlen] = '\0';
+	h->hostlen = hlen;
+
+	return tls_hello_done;
+}
+
+static enum tls_hello_status
+hello_parse_message(struct tls_hello *h, const uint8_t *buf)
+{
+	struct hello_cursor c;
+	unsigned int len, type, elen;
+
+	c.p = buf;
+	c.frag = 0;
+	c.remain = h->need;
+
+	/* Handshake header, client version and random */
+	if (!cursor_take(&c, NULL, 4 + 2 + 32)) {
+		return tls_hello_bad;
+	}
+
+	/* Session id */
+	if (!cursor_u8(&c, &len) || len > 32 || !cursor_take(&c, NULL, len)) {
+		return tls_hello_bad;
+	}
+
+	/* Cipher suites */
+	if (!cursor_u16(&c, &len) || !cursor_take(&c, NULL, len)) {
+		return tls_hello_bad;
+	}
+
+	/* Compression methods */
+	if (!cursor_u8(&c, &len) || !cursor_take(&c, NULL, len)) {
+		return tls_hello_bad;
+	}
+
+	if (c.remain == 0) {
+		/* No extensions at all */
+		return tls_hello_done;
+	}
+
+	if (!cursor_u16(&c, &len) || len > c.remain) {
+		return tls_hello_bad;
+	}
+
+	c.remain = len;
+
+	while (c.remain >= 4) {
+		if (!cursor_u16(&c, &type) || !cursor_u16(&c, &elen) ||
+				elen > c.remain) {
+			return tls_hello_bad;
+		}
+
+		if (type == tls_ext_sni) {
+			/* Nothing else is needed */
+			return hello_parse_sni(h, &c, elen);
+		}
+
+		cursor_take(&c, NULL, elen);
+	}
+
+	return tls_hello_done;
+}
+
+void
+tls_hello_init(struct tls_hello *h, char *host, size_t hostsz)
+{
+	memset(h, 0, sizeof(*h));
+	h->host = host;
+	h->hostsz = hostsz;
+
+	if (hostsz > 0) {
+		host[0] = '\0';
+	}
+}
+
+enum tls_hello_status
+tls_hello_parse(struct tls_hello *h, const uint8_t *buf, size_t len)
+{
+	struct hello_cursor c;
+	const uint8_t *rec;
+	uint8_t hs[4];
+	unsigned int flen;
+
+	/* Count complete records until they hold the whole message */
+	while (h->need == 0 || h->have < h->need) {
+		if (len < h->next + tls_record_header) {
+			if (h->records == 0 && len > 0 && buf[0] != tls_handshake) {
+				/* Not TLS, do not wait for more */
+				return tls_hello_bad;
+			}
+
+			return tls_hello_more;
+		}
+
+		rec = buf + h->next;
+		flen = int_2byte_be(rec + 3);
+
+		if (rec[0] != tls_handshake || rec[1] != 0x3 ||
+				flen == 0 || flen > tls_max_fragment) {
+			return tls_hello_bad;
+		}
+
+		if (h->records == 0) {
+			memcpy(h->version, rec + 1, sizeof(h->version));
+
+			if (len > tls_record_header && rec[5] != tls_client_hello) {
+				return tls_hello_bad;
+			}
+		}
+
+		if (len < h->next + tls_record_header + flen) {
+			return tls_hello_more;
+		}
+
+		h->next += tls_record_header + flen;
+		h->have += flen;
+		h->records ++;
+
+		if (h->need == 0 && h->have >= sizeof(hs)) {
+			/* Handshake header can be split too */
+			c.p = buf;
+			c.frag = 0;
+			c.remain = sizeof(hs);
+			cursor_take(&c, hs, sizeof(hs));
+
+			if (hs[0] != tls_client_hello) {
+				return tls_hello_bad;
+			}
+
+			h->need = sizeof(hs) + int_3byte_be(hs + 1);
+
+			if (h->need > TLS_HELLO_MAX) {
+				return tls_hello_bad;
+			}
+		}
+	}
+
+	return hello_parse_message(h, buf);
+}
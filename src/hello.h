@@ -0,0 +1,72 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+
+#ifndef SRC_HELLO_H_
+#define SRC_HELLO_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Incremental ClientHello parser. The caller accumulates the bytes sent by
+ * the client in one linear buffer and calls tls_hello_parse() each time it
+ * grows; record headers are walked only once, and the handshake message is
+ * parsed where it lies, across as many TLS records as the client split it
+ * into, once it is complete. Anything after the ClientHello is left to the
+ * caller.
+ */
+
+/* Largest ClientHello accepted, with its handshake header */
+#define TLS_HELLO_MAX 65536
+
+enum tls_hello_status {
+	tls_hello_more = 0,
+	tls_hello_done,
+	tls_hello_bad
+};
+
+struct tls_hello {
+	/* Server name is copied to `host`, empty if there is no SNI */
+	char *host;
+	size_t hostsz;
+	unsigned hostlen;
+	/* Offset of the next record header */
+	uint32_t next;
+	/* Handshake bytes in complete records */
+	uint32_t have;
+	/* Length of the handshake message, 0 until its header is received */
+	uint32_t need;
+	uint32_t records;
+	/* Record layer version, valid after the first 5 bytes */
+	uint8_t version[2];
+};
+
+void tls_hello_init(struct tls_hello *h, char *host, size_t hostsz);
+/* `buf` holds everything received so far and may move between calls */
+enum tls_hello_status tls_hello_parse(struct tls_hello *h, const uint8_t *buf,
+		size_t len);
+
+#endif /* SRC_HELLO_H_ */
@@ -30,14 +30,17 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
 
 #include "ev.h"
 #include "ucl.h"
 #include "util.h"
 #include "ringbuf.h"
+#include "dns.h"
 #include "sni-private.h"
 
 #if defined(__GNUC__)
@@ -46,6 +49,12 @@
 #  define _PACKED
 #endif
 
+#if defined(__GNUC__)
+#  define _CACHELINE_ALIGNED __attribute__ ((aligned (64)))
+#else
+#  define _CACHELINE_ALIGNED
+#endif
+
 #if !defined(__GNUC__)
 #  ifdef __IBMC__
 #    pragma pack(1)
@@ -54,31 +63,10 @@
 #  endif
 #endif
 
-static const unsigned char tls_magic[3] = {0x16, 0x3, 0x1};
-static const unsigned int tls_greeting = 0x1;
-static const unsigned int sni_type = 0x0;
-static const unsigned int sni_host = 0x0;
 static const unsigned int tls_alert = 0x15;
 static const unsigned int tls_alert_level = 0x2;
 static const unsigned int tls_alert_description = 0x28;
 
-struct ssl_header {
-	uint8_t tls_type;
-	uint8_t ssl_version[2]; /* 3 bytes of magic we'd expect */
-	uint8_t len[2];
-	uint8_t type;
-	uint8_t greeting_len[3];
-	uint16_t tls_version;
-	uint8_t random[32];
-} _PACKED;
-
-struct sni_ext {
-	uint8_t slen[2];
-	uint8_t type;
-	uint8_t hlen[2];
-	uint8_t host[1]; /* Extended */
-} _PACKED;
-
 struct ssl_alert {
 	uint8_t type;
 	uint8_t version[2];
@@ -87,27 +75,74 @@ struct ssl_alert {
 	uint8_t description;
 } _PACKED;
 
-extern int buflen;
-extern void proxy_create(struct ssl_session *s);
 
-static inline unsigned int
-int_3byte_be(const unsigned char *p) {
-	return
-	(((unsigned int)(p[2])      ) |
-	 ((unsigned int)(p[1]) <<  8) |
-	 ((unsigned int)(p[0]) << 16));
+/*
+ * Sessions are carved from cache line aligned slabs and recycled through
+ * a free list, so accepting a connection does not call malloc. Slabs are
+ * kept for the process lifetime
+ */
+union session_slot {
+	struct ssl_session s;
+	union session_slot *next;
+} _CACHELINE_ALIGNED;
+
+static const unsigned sessions_per_slab = 256;
+static union session_slot *free_sessions;
+
+/* Timeouts are whole seconds, a quarter of a second is precise enough */
+static const double session_tick = 0.25;
+struct wheel session_wheel;
+
+static struct ssl_session *
+session_alloc(void)
+{
+	union session_slot *slab, *slot;
+	unsigned i;
+
+	if (free_sessions == NULL) {
+		if (posix_memalign((void **)&slab, 64,
+				sizeof(*slab) * sessions_per_slab) != 0) {
+			abort();
+		}
+
+		for (i = 0; i < sessions_per_slab; i ++) {
+			slab[i].next = free_sessions;
+			free_sessions = &slab[i];
+		}
+	}
+
+	slot = free_sessions;
+	free_sessions = slot->next;
+	memset(&slot->s, 0, sizeof(slot->s));
+
+	return &slot->s;
+}
+
+size_t
+session_size(void)
+{
+	return sizeof(union session_slot);
 }
 
-static inline unsigned int
-int_2byte_be(const unsigned char *p) {
-	return
-	(((unsigned int)(p[1])      ) |
-	 ((unsigned int)(p[0]) <<  8));
+static void
+session_free(struct ssl_session *ssl)
+{
+	union session_slot *slot = (union session_slot *)ssl;
+
+	slot->next = free_sessions;
+	free_sessions = slot;
 }
 
 void
 terminate_session(struct ssl_session *ssl)
 {
+#ifdef HAVE_LIBURING
+	if (ssl->uring && !uring_release(ssl)) {
+		/* Called again when the pending operations are completed */
+		return;
+	}
+#endif
+	connect_cancel(ssl);
 	if (ssl->fd != -1) {
 		ev_io_stop(ssl->loop, &ssl->io);
 		close(ssl->fd);
@@ -116,12 +151,29 @@ terminate_session(struct ssl_session *ssl)
 		ev_io_stop(ssl->loop, &ssl->bk_io);
 		close(ssl->bk_fd);
 	}
-	ev_timer_stop(ssl->loop, &ssl->tm);
-	free(ssl->hostname);
-	free(ssl->saved_buf);
-	ringbuf_destroy(ssl->bk2cl);
-	ringbuf_destroy(ssl->cl2bk);
-	free(ssl);
+	wheel_del(&session_wheel, &ssl->tm);
+	if (ssl->peer) {
+		ssl->peer->active --;
+		peer_release(ssl->peer);
+	}
+	routes_release(ssl->routes);
+	session_phase(ssl, phase_session);
+	stats->states[ssl->stat_state] --;
+	stats->sessions ++;
+	ssl->bk_stats->active --;
+	proxy_destroy(ssl);
+	session_free(ssl);
+}
+
+static void
+make_alert(struct ssl_session *ssl, struct ssl_alert *alert)
+{
+	memset(alert, 0, sizeof(*alert));
+	alert->type = tls_alert;
+	memcpy (alert->version, ssl->ssl_version, 2);
+	alert->len[1] = 2;
+	alert->level = tls_alert_level;
+	alert->description = tls_alert_description;
 }
 
 static void
@@ -132,12 +184,9 @@ alert_cb(EV_P_ ev_io *w, int revents)
 	size_t ret;
 
 	if (ssl->state == ssl_state_alert) {
-		alert.type = tls_alert;
-		memcpy (alert.version, ssl->ssl_version, 2);
-		alert.len[1] = 2;
-		alert.level = tls_alert_level;
-		alert.description = tls_alert_description;
+		make_alert(ssl, &alert);
 		ssl->state = ssl_state_alert_sent;
+		session_account(ssl);
 
 		ret = write(ssl->fd, &alert, sizeof(alert));
 		if (ret != sizeof(alert)) {
@@ -152,325 +201,326 @@ alert_cb(EV_P_ ev_io *w, int revents)
 void
 send_alert(struct ssl_session *ssl)
 {
+#ifdef HAVE_LIBURING
+	struct ssl_alert alert;
+#endif
+
+	stats->alerts ++;
 	ssl->state = ssl_state_alert;
+	session_account(ssl);
+	/* A client that does not read the alert is not waited for */
+	session_timeout(ssl, handshake_timeout, false);
+
+#ifdef HAVE_LIBURING
+	if (ssl->uring) {
+		make_alert(ssl, &alert);
+		uring_send_alert(ssl, &alert, sizeof(alert));
+		return;
+	}
+#endif
 	ev_io_init(&ssl->io, alert_cb, ssl->fd, EV_WRITE);
 	ev_io_start(ssl->loop, &ssl->io);
 }
 
-static void
-backend_connect_cb(EV_P_ ev_io *w, int revents)
-{
-	struct ssl_session *ssl = w->data;
-
-	ev_io_stop(ssl->loop, &ssl->bk_io);
-	//printf("connected to hostname: %s\n", ssl->hostname);
-	ssl->cl2bk = ringbuf_create(buflen, ssl->saved_buf, ssl->buflen);
-	ssl->bk2cl = ringbuf_create(buflen, NULL, 0);
-	proxy_create(ssl);
-}
-
-static void
-connect_backend(struct ssl_session *ssl, const struct addrinfo *ai)
+bool
+parse_ssl_greeting(struct ssl_session *ssl)
 {
-	int sock, ofl;
+	enum tls_hello_status st;
+	struct sni_backend *bk;
 
-	/* TODO: Need upstreams support here */
-	sock = socket(ai->ai_family, SOCK_STREAM, 0);
+	st = tls_hello_parse(&ssl->hello, ssl->cl2bk.buf + ssl->cl2bk.write_pos,
+			ssl->cl2bk.wr_avail);
 
-	if (sock == -1) {
-		goto err;
+	if (ssl->hello.records > 0) {
+		memcpy(ssl->ssl_version, ssl->hello.version, 2);
 	}
 
-	if (fcntl(sock, F_SETFD, FD_CLOEXEC) == -1) {
-		close(sock);
-
-		goto err;
+	if (st == tls_hello_more) {
+		return true;
 	}
 
-	ofl = fcntl(sock, F_GETFL, 0);
-
-	if (fcntl(sock, F_SETFL, ofl | O_NONBLOCK) == -1) {
-		close(sock);
-
-		goto err;
-	}
-
-	while (connect (sock, ai->ai_addr, ai->ai_addrlen) == -1) {
-
-		if (errno == EINTR) {
-			continue;
-		}
-
-		if (errno != EINPROGRESS) {
-			close(sock);
-
-			goto err;
-		}
-		else {
-			break;
-		}
-	}
-
-	ssl->bk_fd = sock;
-	ssl->state = ssl_state_backend_ready;
-
-	ssl->bk_io.data = ssl;
-	ev_io_init(&ssl->bk_io, backend_connect_cb, sock, EV_WRITE);
-	ev_io_start(ssl->loop, &ssl->bk_io);
-
-	return;
-
-err:
-	send_alert(ssl);
-}
-
-static int
-parse_extension(struct ssl_session *ssl, const unsigned char *pos, int remain)
-{
-	unsigned int tlen, type, hlen;
-	const struct sni_ext *sni;
+	ev_io_stop(ssl->loop, &ssl->io);
+	wheel_del(&session_wheel, &ssl->tm);
 
-	if (remain < 0) {
-		return -1;
-	}
-	if (remain < 4) {
-		return 0;
+	if (st == tls_hello_bad) {
+		send_alert(ssl);
+		return false;
 	}
 
-	type = int_2byte_be(pos);
-	tlen = int_2byte_be(pos + 2);
+	/* Here we can select a backend */
+	bk = routes_lookup(ssl->routes, ssl->hostname, ssl->hello.hostlen);
 
-	if (tlen > remain) {
-		return -1;
+	if (bk == NULL) {
+		/* Cowardly give up */
+		fprintf(stderr, "cannot found hostname: %s\n", ssl->hostname);
+		stats->unknown_names ++;
+		send_alert(ssl);
+		return false;
 	}
 
-	if (type == sni_type) {
-		if (tlen < sizeof(*sni)) {
-			return -1;
-		}
-
-		sni = (const struct sni_ext *)(pos + 4);
-		if (int_2byte_be(sni->slen) != tlen - 2 ||
-			sni->type != sni_host ||
-			int_2byte_be(sni->hlen) != tlen - 5) {
-			return -1;
-		}
+	ssl->max_buffer = bk->max_buffer;
+	ssl->state = ssl_state_backend_selected;
+	session_account(ssl);
+	ssl->bk_stats = backend_stats(bk);
+	ssl->bk_stats->sessions ++;
+	ssl->bk_stats->active ++;
+	ssl->bk_stats->bytes_cl2bk += ssl->cl2bk.wr_avail;
+	session_phase(ssl, phase_hello);
+	proxy_save_greeting(ssl);
+	backend_select(ssl, bk);
 
-		hlen = int_2byte_be(sni->hlen);
-		free(ssl->hostname);
-		ssl->hostname = xmalloc(hlen + 1);
-		memcpy(ssl->hostname, sni->host, hlen);
-		ssl->hostlen = hlen;
-		ssl->hostname[hlen] = '\0';
-	}
-
-	return tlen + 4;
+	return false;
 }
 
-static void
-parse_ssl_greeting(struct ssl_session *ssl, const unsigned char *buf, int len)
+/*
+ * Session waits for memory when the pool is over the limit, an alert is
+ * only sent for a ClientHello too large for any greeting buffer
+ */
+void
+greeting_overflow(struct ssl_session *ssl, int err)
 {
-	const unsigned char *p = buf;
-	int remain = len, ret;
-	unsigned int tlen;
-	const struct ssl_header *sslh;
-	const ucl_object_t *bk = NULL, *sa = NULL;
-
-	ev_io_stop(ssl->loop, &ssl->io);
-
-	if (len <= sizeof(struct ssl_header)) {
-		send_alert(ssl);
+	if (err == ENOBUFS) {
+		proxy_park_greeting(ssl);
 		return;
 	}
 
-	sslh = (const struct ssl_header *)p;
-	memcpy (ssl->ssl_version, sslh->ssl_version, 2);
-
-	/* Not an SSL packet */
-	if (memcmp(&sslh->tls_type, tls_magic, sizeof(tls_magic)) != 0 ||
-		sslh->type != tls_greeting ||
-		int_2byte_be(sslh->len) != len - 5 ||
-		int_3byte_be(sslh->greeting_len) != len - 5 - 4) {
-		goto err;
-	}
-
-	p = p + sizeof(*sslh);
-	remain -= sizeof(*sslh);
-
-	/* Session id */
-	tlen = *p;
-	if (tlen >= remain + 4) {
-		goto err;
-	}
-	p = p + tlen + 1;
-	remain -= tlen + 1;
-
-	/* Cipher suite */
-	tlen = int_2byte_be(p);
-	if (tlen >= remain + 4) {
-		goto err;
-	}
-	p = p + tlen + 2;
-	remain -= tlen + 2;
-
-	/* Compression methods */
-	tlen = *p;
-	if (tlen >= remain + 4) {
-		goto err;
-	}
-	p = p + tlen + 1;
-	remain -= tlen + 1;
-
-	/* Now extensions */
-	tlen = int_2byte_be(p);
-	if (tlen > remain) {
-		goto err;
-	}
-
-	p += 2;
-	remain -= 2;
-
-	while ((ret = parse_extension(ssl, p, remain)) > 0) {
-		p += ret;
-		remain -= ret;
-	}
-
-	if (ret == 0) {
-		/* Here we can select a backend */
-		if (ssl->hostname != NULL) {
-			bk = ucl_object_find_keyl(ssl->backends, ssl->hostname, ssl->hostlen);
-		}
-
-		if (bk == NULL) {
-			/* Try to select default backend */
-			bk = ucl_object_find_key(ssl->backends, "default");
-		}
-
-		if (bk == NULL) {
-			/* Cowardly give up */
-			fprintf(stderr, "cannot found hostname: %s\n", ssl->hostname);
-			send_alert(ssl);
-			return;
-		}
-		else {
-			sa = ucl_object_find_key(bk, "ai");
-
-			if (sa == NULL) {
-				/* Should not happen */
-				send_alert(ssl);
-				return;
-			}
-
-			ssl->state = ssl_state_backend_selected;
-			ssl->saved_buf = xmalloc(len);
-			memcpy(ssl->saved_buf, buf, len);
-			ssl->buflen = len;
-			connect_backend(ssl, sa->value.ud);
-
-			return;
-		}
-	}
-err:
+	ev_io_stop(ssl->loop, &ssl->io);
+	wheel_del(&session_wheel, &ssl->tm);
 	send_alert(ssl);
 }
 
 static void
 greet_cb(EV_P_ ev_io *w, int revents)
 {
-	unsigned char buf[8192];
-	int r;
+	ssize_t r;
 	struct ssl_session *ssl = w->data;
 
-	ev_timer_stop(loop, &ssl->tm);
-	r = read(w->fd, buf, sizeof (buf));
+	/* Greeting timer keeps running until the whole ClientHello is here */
+	r = proxy_read_greeting(ssl);
+
+	if (r == -1 && errno == EAGAIN) {
+		return;
+	}
 
-	if (r <= 0) {
+	if (r == -1 && (errno == ENOBUFS || errno == EMSGSIZE)) {
+		greeting_overflow(ssl, errno);
+	}
+	else if (r <= 0) {
 		terminate_session(ssl);
 	}
 	else {
-		parse_ssl_greeting(ssl, buf, r);
+		parse_ssl_greeting(ssl);
 	}
 }
 
 /*
- * Called if client failed to send SSL greeting in time
+ * Called if client failed to send SSL greeting in time, or the session
+ * has been idle or half closed for too long
  */
 static void
-timer_cb(EV_P_ ev_timer *w, int revents)
+timer_cb(struct wheel_timer *t)
 {
-	struct ssl_session *ssl = w->data;
+	struct ssl_session *ssl = t->data;
 
-	ev_timer_stop(loop, &ssl->tm);
 	terminate_session(ssl);
 }
 
+void
+session_timeout(struct ssl_session *ssl, double after, bool idle)
+{
+	if (after <= 0) {
+		wheel_del(&session_wheel, &ssl->tm);
+	}
+	else if (idle) {
+		wheel_add_idle(&session_wheel, &ssl->tm, after);
+	}
+	else {
+		wheel_add(&session_wheel, &ssl->tm, after);
+	}
+}
+
 static int
-accept_from_socket(int sock)
+accept_from_socket(int sock, union sni_sockaddr *sa)
 {
-	int nfd, serrno, ofl;
+	int nfd;
+	socklen_t slen = sizeof(*sa);
 
-	if ((nfd = accept (sock, NULL, 0)) == -1) {
-		if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK) {
+#ifdef HAVE_ACCEPT4
+	nfd = accept4(sock, &sa->sa, &slen, SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+	nfd = accept(sock, &sa->sa, &slen);
+#endif
+
+	if (nfd == -1) {
+		if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK ||
+				errno == ECONNABORTED) {
 			return 0;
 		}
 
 		return -1;
 	}
 
-	ofl = fcntl(nfd, F_GETFL, 0);
+#ifndef HAVE_ACCEPT4
+	if (fcntl(nfd, F_SETFL, fcntl(nfd, F_GETFL, 0) | O_NONBLOCK) == -1 ||
+			fcntl(nfd, F_SETFD, FD_CLOEXEC) == -1) {
+		int serrno = errno;
 
-	if (fcntl(nfd, F_SETFL, ofl | O_NONBLOCK) == -1) {
-		close(sock);
+		fprintf(stderr, "fcntl failed: %d, '%s'\n", errno, strerror (errno));
+		close(nfd);
+		errno = serrno;
 
-		goto out;
+		return -1;
 	}
+#endif
 
-	/* Set close on exec */
-	if (fcntl (nfd, F_SETFD, FD_CLOEXEC) == -1) {
-		fprintf(stderr, "fcntl failed: %d, '%s'\n", errno, strerror (errno));
-		goto out;
+	return nfd;
+}
+
+struct ssl_session *
+session_create(struct ev_loop *loop, int nfd, const union sni_sockaddr *sa)
+{
+	struct ssl_session *ssl;
+
+	ssl = session_alloc();
+	ssl->t_accept = session_clock();
+
+	if (sa != NULL) {
+		ssl->client_hash = dns_addr_hash(sa, false, 0);
+		ssl->client_hashed = true;
 	}
 
-	return (nfd);
+	ssl->io.data = ssl;
+	ssl->routes = routes_acquire();
+	ssl->loop = loop;
+	ssl->fd = nfd;
+	ssl->bk_fd = -1;
+	ssl->bk_stats = backend_stats(NULL);
+	stats->accepts ++;
+	stats->states[ssl_state_init] ++;
+	/* TLS 1.0 (SSL 3.1) */
+	ssl->ssl_version[0] = 0x3;
+	ssl->ssl_version[1] = 0x1;
+	tls_hello_init(&ssl->hello, ssl->hostname, sizeof(ssl->hostname));
+
+	if (session_wheel.loop == NULL) {
+		wheel_init(&session_wheel, loop, session_tick);
+	}
+
+	wheel_timer_init(&ssl->tm, timer_cb, ssl);
+	session_timeout(ssl, handshake_timeout, false);
+
+	return ssl;
+}
+
+/* Sessions accepted without the address look it up when it is needed */
+uint32_t
+session_client_hash(struct ssl_session *ssl)
+{
+	union sni_sockaddr sa;
+	socklen_t slen = sizeof(sa);
 
-out:
-	serrno = errno;
-	close (nfd);
-	errno = serrno;
+	if (!ssl->client_hashed) {
+		memset(&sa, 0, sizeof(sa));
+
+		if (getpeername(ssl->fd, &sa.sa, &slen) == 0) {
+			ssl->client_hash = dns_addr_hash(&sa, false, 0);
+		}
 
-	return (-1);
+		ssl->client_hashed = true;
+	}
 
+	return ssl->client_hash;
 }
 
+/*
+ * Listening sockets are created before workers are forked and stay open in
+ * the main process, so a restarted worker takes over the queue of its
+ * predecessor and the whole set can be passed to a new binary on upgrade.
+ * Each address has a SO_REUSEPORT socket per worker
+ */
+struct sni_listener {
+	ev_io io;
+	union sni_sockaddr addr;
+	int fd;
+	/* Index among the sockets of the same address */
+	unsigned set;
+	bool matched;
+};
+
+static struct sni_listener *listeners;
+static unsigned nlisteners;
+static ev_timer drain_tm;
+static ev_tstamp drain_start;
+static struct ev_loop *quit_loop;
+static ev_async quit_ev;
+
+/*
+ * Takes up to accept_batch connections per wakeup, so a burst costs one
+ * poll for many accepts while other events still get their turn
+ */
 static void
 accept_cb(EV_P_ ev_io *w, int revents)
 {
-	int nfd;
+	int nfd, i;
 	struct ssl_session *ssl;
+	union sni_sockaddr sa;
+
+	for (i = 0; i < accept_batch; i ++) {
+		nfd = accept_from_socket(w->fd, &sa);
+
+		/* 0 if the queue is empty or another worker took the connection */
+		if (nfd == 0) {
+			break;
+		}
+		else if (nfd == -1) {
+			stats->accept_errors ++;
+			fprintf(stderr, "accept failed: %d, '%s'\n", errno,
+					strerror (errno));
+			break;
+		}
 
-	if ((nfd = accept_from_socket(w->fd)) > 0) {
-		ssl = xmalloc0(sizeof(*ssl));
-		ssl->io.data = ssl;
-		ssl->backends = w->data;
-		ssl->loop = loop;
-		ssl->fd = nfd;
-		ssl->bk_fd = -1;
-		/* TLS 1.0 (SSL 3.1) */
-		ssl->ssl_version[0] = 0x3;
-		ssl->ssl_version[0] = 0x1;
+		ssl = session_create(loop, nfd, &sa);
 		ev_io_init(&ssl->io, greet_cb, nfd, EV_READ);
 		ev_io_start(loop, &ssl->io);
-		ssl->tm.data = ssl;
-		ev_timer_init(&ssl->tm, timer_cb, 2.0, 1);
-		ev_timer_start(loop, &ssl->tm);
+
+		if (defer_accept > 0) {
+			/* The kernel has held the connection until data arrived */
+			greet_cb(loop, &ssl->io, EV_READ);
+		}
 	}
-	else {
-		fprintf(stderr, "accept failed: %d, '%s'\n", errno, strerror (errno));
+}
+
+/* Options that follow the configuration, also set on passed sockets */
+static bool
+listen_tune(int sock)
+{
+#ifdef TCP_FASTOPEN
+	if (tcp_fastopen > 0 && setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN,
+			(const void *)&tcp_fastopen, sizeof (int)) == -1) {
+		/* Not fatal, clients just do a normal handshake */
+		fprintf(stderr, "cannot enable TCP fast open: %s\n", strerror(errno));
+	}
+#endif
+
+	if (defer_accept > 0) {
+#ifdef TCP_DEFER_ACCEPT
+		if (setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+				(const void *)&defer_accept, sizeof (int)) == -1) {
+			fprintf(stderr, "cannot enable deferred accept: %s\n",
+					strerror(errno));
+		}
+#else
+		fprintf(stderr, "deferred accept is not supported\n");
+		defer_accept = 0;
+#endif
 	}
+
+	/* Listening again only changes the backlog */
+	return listen(sock, listen_backlog) == 0;
 }
 
 static int
-listen_on(const struct sockaddr *sa, socklen_t slen)
+listen_on(const struct sockaddr *sa, socklen_t slen, bool reuseport)
 {
 	int sock, on = 1, ofl;
 
@@ -487,6 +537,28 @@ listen_on(const struct sockaddr *sa, socklen_t slen)
 	}
 
 	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const void *)&on, sizeof (int));
+
+	if (sa->sa_family == AF_INET6) {
+		/* Do not steal IPv4 connections from the INADDR_ANY socket */
+		setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, (const void *)&on,
+				sizeof (int));
+	}
+
+	if (reuseport) {
+#ifdef SO_REUSEPORT
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const void *)&on,
+				sizeof (int)) == -1) {
+			close(sock);
+
+			return -1;
+		}
+#else
+		close(sock);
+		errno = ENOTSUP;
+
+		return -1;
+#endif
+	}
 	ofl = fcntl(sock, F_GETFL, 0);
 
 	if (fcntl(sock, F_SETFL, ofl | O_NONBLOCK) == -1) {
@@ -501,7 +573,7 @@ listen_on(const struct sockaddr *sa, socklen_t slen)
 		return -1;
 	}
 
-	if (listen(sock, -1) == -1) {
+	if (!listen_tune(sock)) {
 		close(sock);
 
 		return -1;
@@ -510,13 +582,65 @@ listen_on(const struct sockaddr *sa, socklen_t slen)
 	return sock;
 }
 
+static unsigned
+listen_count(const union sni_sockaddr *sa)
+{
+	unsigned i, n = 0;
+
+	for (i = 0; i < nlisteners; i ++) {
+		if (memcmp(&listeners[i].addr, sa, dns_addr_len(sa)) == 0) {
+			n ++;
+		}
+	}
+
+	return n;
+}
+
+static void
+listen_add(int sock, const union sni_sockaddr *sa, bool matched)
+{
+	struct sni_listener *l;
+
+	listeners = xrealloc(listeners, sizeof(*listeners) * (nlisteners + 1));
+	l = &listeners[nlisteners];
+	memset(l, 0, sizeof(*l));
+	memcpy(&l->addr, sa, sizeof(*sa));
+	l->set = listen_count(sa);
+	l->fd = sock;
+	l->matched = matched;
+	nlisteners ++;
+}
+
 bool
-start_listen(struct ev_loop *loop, int port, const ucl_object_t *backends)
+listen_adopt(int sock)
+{
+	union sni_sockaddr sa;
+	socklen_t slen = sizeof(sa);
+
+	memset(&sa, 0, sizeof(sa));
+
+	if (getsockname(sock, &sa.sa, &slen) == -1 ||
+			(sa.sa.sa_family != AF_INET && sa.sa.sa_family != AF_INET6) ||
+			fcntl(sock, F_SETFD, FD_CLOEXEC) == -1 ||
+			fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) == -1 ||
+			!listen_tune(sock)) {
+		close(sock);
+
+		return false;
+	}
+
+	listen_add(sock, &sa, false);
+
+	return true;
+}
+
+bool
+listen_prepare(int port, unsigned nsets)
 {
 	struct addrinfo ai, *res, *cur_ai;
+	union sni_sockaddr sa;
+	unsigned i, have;
 	int sock, r;
-	ev_io *watcher;
-	bool ret = false;
 
 	memset(&ai, 0, sizeof(ai));
 	ai.ai_family = AF_UNSPEC;
@@ -528,24 +652,194 @@ start_listen(struct ev_loop *loop, int port, const ucl_object_t *backends)
 		return false;
 	}
 
-	cur_ai = res;
+	for (cur_ai = res; cur_ai != NULL; cur_ai = cur_ai->ai_next) {
+		if (cur_ai->ai_addrlen > sizeof(sa)) {
+			continue;
+		}
+
+		memset(&sa, 0, sizeof(sa));
+		memcpy(&sa, cur_ai->ai_addr, cur_ai->ai_addrlen);
+		have = listen_count(&sa);
+
+		/* Sockets passed by the previous binary are used first */
+		for (i = 0; i < nlisteners; i ++) {
+			if (memcmp(&listeners[i].addr, &sa, dns_addr_len(&sa)) == 0) {
+				listeners[i].matched = true;
+			}
+		}
+
+		for (i = have; i < nsets; i ++) {
+			sock = listen_on(cur_ai->ai_addr, cur_ai->ai_addrlen, nsets > 1);
+
+			if (sock == -1) {
+				if (have > 0) {
+					/* Passed sockets without SO_REUSEPORT */
+					fprintf(stderr, "cannot add a listening socket, %u workers "
+							"share %u: %s\n", nsets, i, strerror(errno));
+				}
+				else {
+					fprintf(stderr, "socket listen: %s\n", strerror(errno));
+				}
+
+				break;
+			}
 
-	while (cur_ai != NULL) {
-		sock = listen_on(cur_ai->ai_addr, cur_ai->ai_addrlen);
+			listen_add(sock, &sa, true);
+		}
+	}
+
+	freeaddrinfo(res);
+
+	/* Passed sockets of a port that is no longer configured */
+	for (i = 0; i < nlisteners; ) {
+		if (!listeners[i].matched) {
+			close(listeners[i].fd);
+			memmove(&listeners[i], &listeners[i + 1],
+					sizeof(*listeners) * (nlisteners - i - 1));
+			nlisteners --;
+		}
+		else {
+			i ++;
+		}
+	}
+
+	return nlisteners > 0;
+}
 
-		if (sock == -1) {
-			fprintf(stderr, "socket listen: %s\n", strerror(errno));
-			cur_ai = cur_ai->ai_next;
+bool
+listen_start(struct ev_loop *loop, unsigned idx, unsigned nworkers)
+{
+	struct sni_listener *l;
+	unsigned i, n;
+	bool ret = false;
+
+	for (i = 0; i < nlisteners; i ++) {
+		l = &listeners[i];
+		n = listen_count(&l->addr);
+
+		/* Spare sockets go round robin, missing ones are shared */
+		if (n < nworkers ? l->set != idx % n : l->set % nworkers != idx) {
 			continue;
 		}
 
-		watcher = xmalloc0(sizeof(*watcher));
-		watcher->data = (void *)backends;
-		ev_io_init(watcher, accept_cb, sock, EV_READ);
-		ev_io_start(loop, watcher);
+#ifdef HAVE_LIBURING
+		if (use_io_uring) {
+			if (uring_listen(loop, l->fd)) {
+				ret = true;
+			}
+
+			continue;
+		}
+#endif
+
+		ev_io_init(&l->io, accept_cb, l->fd, EV_READ);
+		ev_io_start(loop, &l->io);
 		ret = true;
-		cur_ai = cur_ai->ai_next;
 	}
 
 	return ret;
 }
+
+unsigned
+listen_fds(int *fds, unsigned max)
+{
+	unsigned i;
+
+	for (i = 0; i < nlisteners && i < max; i ++) {
+		fds[i] = listeners[i].fd;
+	}
+
+	return nlisteners;
+}
+
+void
+listen_stop(struct ev_loop *loop)
+{
+	unsigned i;
+
+#ifdef HAVE_LIBURING
+	if (use_io_uring) {
+		uring_unlisten();
+	}
+#endif
+
+	for (i = 0; i < nlisteners; i ++) {
+		if (ev_is_active(&listeners[i].io)) {
+			ev_io_stop(loop, &listeners[i].io);
+		}
+
+		close(listeners[i].fd);
+	}
+
+	free(listeners);
+	listeners = NULL;
+	nlisteners = 0;
+}
+
+static void
+drain_cb(EV_P_ ev_timer *w, int revents)
+{
+	int64_t open = 0;
+	unsigned i;
+
+	for (i = 0; i < sizeof(stats->states) / sizeof(stats->states[0]); i ++) {
+		open += stats->states[i];
+	}
+
+	if (open <= 0) {
+		ev_break(loop, EVBREAK_ALL);
+	}
+	else if (drain_timeout > 0 && ev_now(loop) - drain_start >= drain_timeout) {
+		fprintf(stderr, "drain: closing %lld sessions after %.0f seconds\n",
+				(long long)open, drain_timeout);
+		ev_break(loop, EVBREAK_ALL);
+	}
+}
+
+void
+listen_drain(struct ev_loop *loop)
+{
+	if (ev_is_active(&drain_tm)) {
+		return;
+	}
+
+	listen_stop(loop);
+	drain_start = ev_now(loop);
+	ev_timer_init(&drain_tm, drain_cb, 0.0, 1.0);
+	ev_timer_start(loop, &drain_tm);
+}
+
+static void
+quit_signal(int sig)
+{
+	ev_async_send(quit_loop, &quit_ev);
+}
+
+static void
+quit_cb(EV_P_ ev_async *w, int revents)
+{
+	listen_drain(loop);
+}
+
+/* Same as config_reload_start() for SIGHUP */
+void
+listen_quit_start(struct ev_loop *loop)
+{
+	struct sigaction sa;
+	sigset_t set;
+
+	quit_loop = loop;
+	ev_async_init(&quit_ev, quit_cb);
+	ev_async_start(loop, &quit_ev);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = quit_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGQUIT, &sa, NULL);
+
+	/* Workers start with it blocked, so a drain request is not lost */
+	sigemptyset(&set);
+	sigaddset(&set, SIGQUIT);
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+}
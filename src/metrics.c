@@ -0,0 +1,929 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Counters in Prometheus text format. Every worker writes to its own slot
+ * of an anonymous shared mapping created before forking, with no atomics
+ * and no communication; the master, which always runs when metrics are
+ * enabled, reads all slots when scraped. Aligned 64 bit stores are not
+ * torn, so a scrape sees each counter either before or after an update.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "sni-private.h"
+
+#define STATS_ALIGN 64
+#define STATS_ROUND(x) (((x) + STATS_ALIGN - 1) & ~(size_t)(STATS_ALIGN - 1))
+
+/* Longest request accepted and the time to send it */
+#define METRICS_REQUEST_MAX 2048
+static const double metrics_timeout = 5.0;
+
+struct metrics_conn {
+	ev_io io;
+	ev_timer tm;
+	char *out;
+	size_t outlen;
+	size_t outsz;
+	size_t sent;
+	size_t reqlen;
+	char req[METRICS_REQUEST_MAX];
+};
+
+struct metrics_counter {
+	const char *name;
+	const char *help;
+	size_t off;
+};
+
+#define COUNTER(f, n, h) { n, h, offsetof(struct sni_stats, f) }
+static const struct metrics_counter worker_counters[] = {
+	COUNTER(accepts, "accepts_total", "Accepted client connections"),
+	COUNTER(accept_errors, "accept_errors_total", "Failed accepts"),
+	COUNTER(alerts, "alerts_total", "TLS alerts sent to clients"),
+	COUNTER(unknown_names, "unknown_names_total",
+			"Server names without a backend"),
+	COUNTER(sessions, "sessions_total", "Finished sessions"),
+	COUNTER(bytes_cl2bk, "client_bytes_total",
+			"Bytes received from clients"),
+	COUNTER(bytes_bk2cl, "upstream_bytes_total",
+			"Bytes received from backends"),
+	COUNTER(connects, "connects_total", "Connect attempts to backends"),
+	COUNTER(connect_failures, "connect_failures_total",
+			"Failed connect attempts to backends"),
+	COUNTER(warm_hits, "warm_hits_total",
+			"Sessions given a pre-connected backend socket"),
+	COUNTER(tfo_syn_data, "fastopen_syn_data_total",
+			"Backend connects with the ClientHello in the SYN"),
+	COUNTER(tfo_no_cookie, "fastopen_no_cookie_total",
+			"Backend connects without a fast open cookie"),
+	COUNTER(tfo_acked, "fastopen_acked_total",
+			"Backend connects with data in the SYN accepted"),
+};
+#undef COUNTER
+
+#define COUNTER(f, n, h) { n, h, offsetof(struct sni_backend_stats, f) }
+static const struct metrics_counter backend_counters[] = {
+	COUNTER(sessions, "backend_sessions_total", "Sessions routed to a backend"),
+	COUNTER(bytes_cl2bk, "backend_client_bytes_total",
+			"Bytes received from clients of a backend"),
+	COUNTER(bytes_bk2cl, "backend_upstream_bytes_total",
+			"Bytes received from a backend"),
+	COUNTER(connect_failures, "backend_connect_failures_total",
+			"Failed connect attempts to peers of a backend"),
+	COUNTER(ejections, "backend_ejections_total",
+			"Ejections of peers of a backend"),
+};
+#undef COUNTER
+
+static const char *state_names[ssl_state_proxy_both_closed + 1] = {
+	[ssl_state_init] = "greeting",
+	[ssl_state_alert] = "alert",
+	[ssl_state_alert_sent] = "alert_sent",
+	[ssl_state_backend_selected] = "backend_selected",
+	[ssl_state_backend_ready] = "backend_ready",
+	[ssl_state_backend_greeting] = "backend_greeting",
+	[ssl_state_proxy] = "proxy",
+	[ssl_state_proxy_peer_closed] = "proxy_half_closed",
+	[ssl_state_proxy_both_closed] = "closing",
+};
+
+static const char *phase_names[phase_max] = {
+	[phase_hello] = "hello",
+	[phase_connect] = "connect",
+	[phase_reply] = "reply",
+	[phase_session] = "session",
+};
+
+/* Slow sessions logged per second, the rest are only counted */
+static const unsigned slow_log_rate = 10;
+
+/*
+ * Backends are counted by name, so counters survive reloads and restarts
+ * of a worker. Entries are only added, and published by the count in the
+ * worker's slot once their name is written
+ */
+struct metrics_backend {
+	struct sni_backend_stats st;
+	char name[256];
+};
+
+/* Backend entries of all workers, sorted by name when served */
+struct metrics_ref {
+	const char *name;
+	const struct sni_backend_stats *st;
+};
+
+/* Counters of a process that is not a worker or when metrics are off */
+static struct sni_stats local_stats;
+static struct sni_backend_stats sink_stats;
+
+struct sni_stats *stats = &local_stats;
+
+static uint8_t *shared;
+static size_t shared_len;
+static int stats_workers;
+static size_t backends_stride;
+static struct metrics_backend *worker_backends;
+/* Listening socket of the server and one passed by the previous binary */
+static ev_io accept_ev;
+static int passed_sock = -1;
+
+static inline struct sni_stats *
+worker_stats(int idx)
+{
+	return (struct sni_stats *)(shared +
+			idx * STATS_ROUND(sizeof(struct sni_stats)));
+}
+
+static inline struct metrics_backend *
+worker_backend_stats(int idx)
+{
+	return (struct metrics_backend *)(shared +
+			stats_workers * STATS_ROUND(sizeof(struct sni_stats)) +
+			idx * backends_stride);
+}
+
+void
+metrics_init(int nworkers)
+{
+	if (metrics_addr == NULL) {
+		return;
+	}
+
+	stats_workers = nworkers;
+	backends_stride = STATS_ROUND(sizeof(struct metrics_backend) *
+			metrics_backends);
+	shared_len = nworkers * (STATS_ROUND(sizeof(struct sni_stats)) +
+			backends_stride);
+	/* Pages of unused backend entries are never touched */
+	shared = mmap(NULL, shared_len, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+
+	if (shared == MAP_FAILED) {
+		fprintf(stderr, "metrics: cannot map counters: %s\n", strerror(errno));
+		abort();
+	}
+}
+
+void
+metrics_worker(int idx)
+{
+	unsigned i;
+
+	if (shared == NULL) {
+		return;
+	}
+
+	stats = worker_stats(idx);
+	worker_backends = worker_backend_stats(idx);
+
+	/* Sessions of a previous instance of this worker are gone */
+	memset(stats->states, 0, sizeof(stats->states));
+
+	for (i = 0; i < stats->nbackends; i ++) {
+		worker_backends[i].st.active = 0;
+	}
+}
+
+static struct sni_backend_stats *
+backend_register(const char *name)
+{
+	static bool warned = false;
+	struct metrics_backend *mb;
+	uint32_t i, n = stats->nbackends;
+
+	for (i = 0; i < n; i ++) {
+		if (strcmp(worker_backends[i].name, name) == 0) {
+			return &worker_backends[i].st;
+		}
+	}
+
+	if (n >= metrics_backends) {
+		if (!warned) {
+			fprintf(stderr, "metrics: only %u backends are counted\n",
+					metrics_backends);
+			warned = true;
+		}
+
+		return &sink_stats;
+	}
+
+	mb = &worker_backends[n];
+	snprintf(mb->name, sizeof(mb->name), "%s", name);
+	__atomic_store_n(&stats->nbackends, n + 1, __ATOMIC_RELEASE);
+
+	return &mb->st;
+}
+
+struct sni_backend_stats *
+backend_stats(struct sni_backend *bk)
+{
+	if (bk == NULL || bk->name == NULL || worker_backends == NULL) {
+		return &sink_stats;
+	}
+
+	/* Looked up once per backend of the current routes */
+	if (bk->stats == NULL) {
+		bk->stats = backend_register(bk->name);
+	}
+
+	return bk->stats;
+}
+
+static inline unsigned
+latency_bucket(uint32_t us)
+{
+	unsigned o, idx;
+
+	if (us < 128) {
+		return 0;
+	}
+
+	/* Power of two and the next bit select one of two halves */
+	o = 31 - __builtin_clz(us);
+	idx = 1 + (o - 7) * 2 + ((us >> (o - 1)) & 1);
+
+	return idx < LATENCY_BUCKETS ? idx : LATENCY_BUCKETS - 1;
+}
+
+/* Upper bound of a bucket in microseconds */
+static uint32_t
+latency_bound(unsigned idx)
+{
+	unsigned o = (idx - 1) / 2 + 7;
+
+	if (idx == 0) {
+		return 128;
+	}
+
+	return (idx - 1) % 2 == 0 ? (3U << (o - 1)) : (2U << o);
+}
+
+static void
+phase_format(char *buf, size_t len, uint32_t from, uint32_t to)
+{
+	if (to == 0) {
+		snprintf(buf, len, "-");
+	}
+	else {
+		snprintf(buf, len, "%.1f ms", (to - from) / 1000.0);
+	}
+}
+
+static void
+slow_log(struct ssl_session *ssl, uint32_t now)
+{
+	static uint64_t second;
+	static unsigned logged, suppressed;
+	char hello[32], conn[32], reply[32];
+	uint64_t cur = (ssl->t_accept + now) / 1000000;
+
+	if (cur != second) {
+		if (suppressed > 0) {
+			fprintf(stderr, "slow session: %u more not logged\n", suppressed);
+		}
+
+		second = cur;
+		logged = 0;
+		suppressed = 0;
+	}
+
+	if (logged >= slow_log_rate) {
+		suppressed ++;
+		return;
+	}
+
+	logged ++;
+	phase_format(hello, sizeof(hello), 0, ssl->t_hello);
+	phase_format(conn, sizeof(conn), ssl->t_hello, ssl->t_connected);
+	phase_format(reply, sizeof(reply), ssl->t_connected, ssl->t_replied);
+	fprintf(stderr, "slow session: %s: client hello %s, backend connect %s, "
+			"backend reply %s, %.1f ms in total\n",
+			ssl->hostname[0] != '\0' ? ssl->hostname : "(no name)",
+			hello, conn, reply, now / 1000.0);
+}
+
+void
+session_phase(struct ssl_session *ssl, enum sni_phase phase)
+{
+	struct sni_backend_stats *bs = ssl->bk_stats;
+	uint64_t elapsed = session_clock() - ssl->t_accept;
+	uint32_t now, from = 0;
+
+	/* Zero means that a phase is not over */
+	now = elapsed == 0 ? 1 : (elapsed > UINT32_MAX ? UINT32_MAX : elapsed);
+
+	switch (phase) {
+	case phase_hello:
+		ssl->t_hello = now;
+		break;
+	case phase_connect:
+		from = ssl->t_hello;
+		ssl->t_connected = now;
+		break;
+	case phase_reply:
+		from = ssl->t_connected;
+		ssl->t_replied = now;
+		break;
+	default:
+		break;
+	}
+
+	bs->latency[phase][latency_bucket(now - from)] ++;
+	bs->latency_sum[phase] += now - from;
+
+	/*
+	 * Handshake is over once the backend replies, the rest is transfer.
+	 * Connections that never sent a ClientHello are not worth a line
+	 */
+	if (slow_session > 0 && now >= slow_session * 1e6 &&
+			(phase == phase_reply || (phase == phase_session &&
+			ssl->t_replied == 0 && ssl->t_hello != 0))) {
+		slow_log(ssl, now);
+	}
+}
+
+static void
+out_append(struct metrics_conn *c, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void
+out_append(struct metrics_conn *c, const char *fmt, ...)
+{
+	va_list ap;
+	int r;
+
+	for (;;) {
+		va_start(ap, fmt);
+		r = vsnprintf(c->out + c->outlen, c->outsz - c->outlen, fmt, ap);
+		va_end(ap);
+
+		if (r < 0) {
+			return;
+		}
+		if ((size_t)r < c->outsz - c->outlen) {
+			c->outlen += r;
+			return;
+		}
+
+		c->outsz = c->outsz * 2 + r;
+		c->out = xrealloc(c->out, c->outsz);
+	}
+}
+
+static void
+out_header(struct metrics_conn *c, const char *name, const char *type,
+		const char *help)
+{
+	out_append(c, "# HELP sni_proxy_%s %s\n# TYPE sni_proxy_%s %s\n",
+			name, help, name, type);
+}
+
+/* Label values are backend names, escaped as the text format requires */
+static void
+out_label(struct metrics_conn *c, const char *s)
+{
+	for (; *s != '\0'; s ++) {
+		if (*s == '\\' || *s == '"') {
+			out_append(c, "\\%c", *s);
+		}
+		else if (*s == '\n') {
+			out_append(c, "\\n");
+		}
+		else {
+			out_append(c, "%c", *s);
+		}
+	}
+}
+
+static void
+out_backend(struct metrics_conn *c, const char *name)
+{
+	out_append(c, "backend=\"");
+	out_label(c, name);
+	out_append(c, "\"");
+}
+
+static int
+metrics_ref_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct metrics_ref *)a)->name,
+			((const struct metrics_ref *)b)->name);
+}
+
+/* Collects backend entries of all workers, equal names are adjacent */
+static struct metrics_ref *
+metrics_refs(unsigned *nrefs)
+{
+	struct metrics_ref *refs = NULL;
+	struct metrics_backend *mb;
+	unsigned i, n = 0, cnt;
+	int w;
+
+	for (w = 0; w < stats_workers; w ++) {
+		/* Entries below the published count have their names written */
+		cnt = __atomic_load_n(&worker_stats(w)->nbackends, __ATOMIC_ACQUIRE);
+		mb = worker_backend_stats(w);
+		refs = xrealloc(refs, sizeof(*refs) * (n + cnt + 1));
+
+		for (i = 0; i < cnt; i ++) {
+			refs[n].name = mb[i].name;
+			refs[n].st = &mb[i].st;
+			n ++;
+		}
+	}
+
+	qsort(refs, n, sizeof(*refs), metrics_ref_cmp);
+	*nrefs = n;
+
+	return refs;
+}
+
+/* Number of entries with the name of the first one */
+static unsigned
+metrics_group(const struct metrics_ref *refs, unsigned n)
+{
+	unsigned i;
+
+	for (i = 1; i < n && strcmp(refs[i].name, refs[0].name) == 0; i ++);
+
+	return i;
+}
+
+/* Counter of a backend summed over workers */
+static uint64_t
+backend_sum(const struct metrics_ref *refs, unsigned n, size_t off)
+{
+	uint64_t v = 0;
+	unsigned i;
+
+	for (i = 0; i < n; i ++) {
+		v += *(const uint64_t *)((const uint8_t *)refs[i].st + off);
+	}
+
+	return v;
+}
+
+static void
+out_latency(struct metrics_conn *c, const struct metrics_ref *refs,
+		unsigned n, unsigned phase)
+{
+	uint64_t total = 0;
+	unsigned b;
+
+	for (b = 0; b < LATENCY_BUCKETS; b ++) {
+		total += backend_sum(refs, n, offsetof(struct sni_backend_stats,
+				latency) + (phase * LATENCY_BUCKETS + b) * sizeof(uint64_t));
+
+		if (b == LATENCY_BUCKETS - 1) {
+			break;
+		}
+
+		out_append(c, "sni_proxy_backend_phase_seconds_bucket{");
+		out_backend(c, refs[0].name);
+		out_append(c, ",phase=\"%s\",le=\"%.6f\"} %" PRIu64 "\n",
+				phase_names[phase], latency_bound(b) / 1e6, total);
+	}
+
+	out_append(c, "sni_proxy_backend_phase_seconds_bucket{");
+	out_backend(c, refs[0].name);
+	out_append(c, ",phase=\"%s\",le=\"+Inf\"} %" PRIu64 "\n",
+			phase_names[phase], total);
+	out_append(c, "sni_proxy_backend_phase_seconds_sum{");
+	out_backend(c, refs[0].name);
+	out_append(c, ",phase=\"%s\"} %.6f\n", phase_names[phase],
+			backend_sum(refs, n, offsetof(struct sni_backend_stats,
+			latency_sum) + phase * sizeof(uint64_t)) / 1e6);
+	out_append(c, "sni_proxy_backend_phase_seconds_count{");
+	out_backend(c, refs[0].name);
+	out_append(c, ",phase=\"%s\"} %" PRIu64 "\n", phase_names[phase],
+			total);
+}
+
+static void
+metrics_render(struct metrics_conn *c)
+{
+	const struct metrics_counter *m;
+	struct metrics_ref *refs;
+	unsigned i, j, n, nrefs;
+	int w;
+
+	for (m = worker_counters; m < worker_counters +
+			sizeof(worker_counters) / sizeof(worker_counters[0]); m ++) {
+		out_header(c, m->name, "counter", m->help);
+
+		for (w = 0; w < stats_workers; w ++) {
+			out_append(c, "sni_proxy_%s{worker=\"%d\"} %" PRIu64 "\n",
+					m->name, w, *(const uint64_t *)
+					((const uint8_t *)worker_stats(w) + m->off));
+		}
+	}
+
+	out_header(c, "sessions_open", "gauge", "Open sessions by state");
+
+	for (w = 0; w < stats_workers; w ++) {
+		for (j = 0; j <= ssl_state_proxy_both_closed; j ++) {
+			out_append(c, "sni_proxy_sessions_open{worker=\"%d\",state=\"%s\"} "
+					"%" PRId64 "\n", w, state_names[j],
+					worker_stats(w)->states[j]);
+		}
+	}
+
+	/* Backends are summed over workers */
+	refs = metrics_refs(&nrefs);
+
+	for (m = backend_counters; m < backend_counters +
+			sizeof(backend_counters) / sizeof(backend_counters[0]); m ++) {
+		out_header(c, m->name, "counter", m->help);
+
+		for (i = 0; i < nrefs; i += n) {
+			n = metrics_group(&refs[i], nrefs - i);
+			out_append(c, "sni_proxy_%s{", m->name);
+			out_backend(c, refs[i].name);
+			out_append(c, "} %" PRIu64 "\n",
+					backend_sum(&refs[i], n, m->off));
+		}
+	}
+
+	out_header(c, "backend_sessions_open", "gauge",
+			"Open sessions routed to a backend");
+
+	for (i = 0; i < nrefs; i += n) {
+		n = metrics_group(&refs[i], nrefs - i);
+		out_append(c, "sni_proxy_backend_sessions_open{");
+		out_backend(c, refs[i].name);
+		out_append(c, "} %" PRId64 "\n", (int64_t)backend_sum(&refs[i], n,
+				offsetof(struct sni_backend_stats, active)));
+	}
+
+	out_header(c, "backend_phase_seconds", "histogram",
+			"Duration of session phases of a backend");
+
+	for (i = 0; i < nrefs; i += n) {
+		n = metrics_group(&refs[i], nrefs - i);
+
+		for (j = 0; j < phase_max; j ++) {
+			out_latency(c, &refs[i], n, j);
+		}
+	}
+
+	free(refs);
+}
+
+static void
+metrics_conn_free(struct ev_loop *loop, struct metrics_conn *c)
+{
+	ev_io_stop(loop, &c->io);
+	ev_timer_stop(loop, &c->tm);
+	close(c->io.fd);
+	free(c->out);
+	free(c);
+}
+
+static void
+metrics_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	metrics_conn_free(loop, w->data);
+}
+
+static void
+metrics_write_cb(EV_P_ ev_io *w, int revents)
+{
+	struct metrics_conn *c = w->data;
+	ssize_t r;
+
+	while ((r = write(w->fd, c->out + c->sent, c->outlen - c->sent)) == -1 &&
+			errno == EINTR);
+
+	if (r == -1 && errno == EAGAIN) {
+		return;
+	}
+
+	if (r > 0) {
+		c->sent += r;
+
+		if (c->sent < c->outlen) {
+			return;
+		}
+	}
+
+	metrics_conn_free(loop, c);
+}
+
+static void
+metrics_respond(struct ev_loop *loop, struct metrics_conn *c)
+{
+	const char *status = "404 Not Found";
+	char hdr[160];
+	char *body;
+	size_t bodylen;
+	int hlen;
+
+	c->outsz = 16384;
+	c->out = xmalloc(c->outsz);
+	c->outlen = 0;
+
+	if (strncmp(c->req, "GET /metrics", sizeof("GET /metrics") - 1) == 0 &&
+			(c->req[12] == ' ' || c->req[12] == '?')) {
+		status = "200 OK";
+		metrics_render(c);
+	}
+
+	hlen = snprintf(hdr, sizeof(hdr), "HTTP/1.0 %s\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\nConnection: close\r\n\r\n",
+			status, c->outlen);
+
+	body = c->out;
+	bodylen = c->outlen;
+	c->outsz = hlen + bodylen;
+	c->out = xmalloc(c->outsz);
+	memcpy(c->out, hdr, hlen);
+	memcpy(c->out + hlen, body, bodylen);
+	c->outlen = c->outsz;
+	free(body);
+
+	ev_io_stop(loop, &c->io);
+	ev_io_init(&c->io, metrics_write_cb, c->io.fd, EV_WRITE);
+	ev_io_start(loop, &c->io);
+}
+
+static void
+metrics_read_cb(EV_P_ ev_io *w, int revents)
+{
+	struct metrics_conn *c = w->data;
+	ssize_t r;
+
+	while ((r = read(w->fd, c->req + c->reqlen,
+			sizeof(c->req) - c->reqlen - 1)) == -1 && errno == EINTR);
+
+	if (r == -1 && errno == EAGAIN) {
+		return;
+	}
+	if (r <= 0) {
+		metrics_conn_free(loop, c);
+		return;
+	}
+
+	c->reqlen += r;
+	c->req[c->reqlen] = '\0';
+
+	if (strstr(c->req, "\r\n\r\n") != NULL || strstr(c->req, "\n\n") != NULL) {
+		metrics_respond(loop, c);
+	}
+	else if (c->reqlen == sizeof(c->req) - 1) {
+		metrics_conn_free(loop, c);
+	}
+}
+
+static void
+metrics_accept_cb(EV_P_ ev_io *w, int revents)
+{
+	struct metrics_conn *c;
+	int nfd;
+
+	while ((nfd = accept(w->fd, NULL, NULL)) == -1 && errno == EINTR);
+
+	if (nfd == -1) {
+		return;
+	}
+
+	if (fcntl(nfd, F_SETFD, FD_CLOEXEC) == -1 ||
+			fcntl(nfd, F_SETFL, fcntl(nfd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+		close(nfd);
+		return;
+	}
+
+	c = xmalloc0(sizeof(*c));
+	c->io.data = c;
+	c->tm.data = c;
+	ev_io_init(&c->io, metrics_read_cb, nfd, EV_READ);
+	ev_io_start(loop, &c->io);
+	ev_timer_init(&c->tm, metrics_timer_cb, metrics_timeout, 0.0);
+	ev_timer_start(loop, &c->tm);
+}
+
+union metrics_sockaddr {
+	union sni_sockaddr in;
+	struct sockaddr_un un;
+};
+
+/* `addr` is "/path" for a UNIX socket, "ip:port" or "[ip6]:port" */
+static bool
+metrics_parse_addr(const char *addr, union metrics_sockaddr *sa,
+		socklen_t *slen)
+{
+	struct dns_addrs *a = NULL;
+	char host[64];
+	const char *p;
+	size_t len;
+	int port;
+
+	memset(sa, 0, sizeof(*sa));
+
+	if (addr[0] == '/') {
+		if (strlen(addr) >= sizeof(sa->un.sun_path)) {
+			errno = ENAMETOOLONG;
+			return false;
+		}
+
+		sa->un.sun_family = AF_UNIX;
+		strcpy(sa->un.sun_path, addr);
+		*slen = sizeof(sa->un);
+
+		return true;
+	}
+
+	p = strrchr(addr, ':');
+	port = p != NULL ? atoi(p + 1) : 0;
+
+	if (port > 0 && port <= 65535) {
+		len = p - addr;
+
+		if (addr[0] == '[' && len > 1 && addr[len - 1] == ']') {
+			addr ++;
+			len -= 2;
+		}
+
+		if (len > 0 && len < sizeof(host)) {
+			memcpy(host, addr, len);
+			host[len] = '\0';
+			a = dns_addrs_numeric(host, port);
+		}
+	}
+
+	if (a == NULL) {
+		errno = EINVAL;
+		return false;
+	}
+
+	memcpy(&sa->in, &a->addrs[0], sizeof(sa->in));
+	*slen = dns_addr_len(&sa->in);
+	dns_addrs_unref(a);
+
+	return true;
+}
+
+/* A socket passed on upgrade is kept if it listens on the same address */
+static bool
+metrics_same_addr(int sock, const union metrics_sockaddr *sa)
+{
+	union metrics_sockaddr cur;
+	socklen_t slen = sizeof(cur);
+
+	memset(&cur, 0, sizeof(cur));
+
+	if (getsockname(sock, &cur.in.sa, &slen) == -1 ||
+			cur.in.sa.sa_family != sa->in.sa.sa_family) {
+		return false;
+	}
+
+	if (sa->in.sa.sa_family == AF_UNIX) {
+		return strcmp(cur.un.sun_path, sa->un.sun_path) == 0;
+	}
+
+	return memcmp(&cur.in, &sa->in, dns_addr_len(&sa->in)) == 0;
+}
+
+static int
+metrics_socket(const union metrics_sockaddr *sa, socklen_t slen)
+{
+	int sock, on = 1;
+
+	if (sa->in.sa.sa_family == AF_UNIX) {
+		/* Left by a previous instance */
+		unlink(sa->un.sun_path);
+	}
+
+	sock = socket(sa->in.sa.sa_family, SOCK_STREAM, 0);
+
+	if (sock == -1) {
+		return -1;
+	}
+
+	if (sa->in.sa.sa_family != AF_UNIX) {
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const void *)&on,
+				sizeof (int));
+	}
+
+	if (fcntl(sock, F_SETFD, FD_CLOEXEC) == -1 ||
+			fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) == -1 ||
+			bind(sock, &sa->in.sa, slen) == -1 ||
+			listen(sock, 16) == -1) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+void
+metrics_adopt(int sock)
+{
+	if (passed_sock != -1) {
+		close(passed_sock);
+	}
+
+	passed_sock = sock;
+}
+
+bool
+metrics_listen(struct ev_loop *loop)
+{
+	union metrics_sockaddr sa;
+	socklen_t slen;
+	int sock = -1;
+
+	if (metrics_addr == NULL) {
+		if (passed_sock != -1) {
+			close(passed_sock);
+			passed_sock = -1;
+		}
+
+		return true;
+	}
+
+	if (!metrics_parse_addr(metrics_addr, &sa, &slen)) {
+		fprintf(stderr, "metrics: cannot listen on %s: %s\n", metrics_addr,
+				strerror(errno));
+		return false;
+	}
+
+	if (passed_sock != -1) {
+		if (metrics_same_addr(passed_sock, &sa) &&
+				fcntl(passed_sock, F_SETFD, FD_CLOEXEC) != -1 &&
+				fcntl(passed_sock, F_SETFL,
+						fcntl(passed_sock, F_GETFL, 0) | O_NONBLOCK) != -1) {
+			sock = passed_sock;
+		}
+		else {
+			close(passed_sock);
+		}
+
+		passed_sock = -1;
+	}
+
+	if (sock == -1 && (sock = metrics_socket(&sa, slen)) == -1) {
+		fprintf(stderr, "metrics: cannot listen on %s: %s\n", metrics_addr,
+				strerror(errno));
+		return false;
+	}
+
+	ev_io_init(&accept_ev, metrics_accept_cb, sock, EV_READ);
+	ev_io_start(loop, &accept_ev);
+
+	return true;
+}
+
+int
+metrics_fd(void)
+{
+	return ev_is_active(&accept_ev) ? accept_ev.fd : -1;
+}
+
+void
+metrics_stop(struct ev_loop *loop)
+{
+	if (ev_is_active(&accept_ev)) {
+		ev_io_stop(loop, &accept_ev);
+		close(accept_ev.fd);
+	}
+}
@@ -33,22 +33,147 @@
 #include <sys/uio.h>
 #include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
 
 #include "ev.h"
 #include "ucl.h"
 #include "util.h"
 #include "ringbuf.h"
+#include "bufpool.h"
 #include "sni-private.h"
 
+extern int buflen;
+
+/* Chunks for session buffers, each worker process has its own pool */
+static struct bufpool *pool;
+static struct ev_loop *pool_loop;
+/* Sessions waiting for buffer memory to be released */
+static struct ssl_session *parked;
+static ev_prepare unpark_ev;
+
 static void proxy_state_machine(struct ssl_session *s);
+static void proxy_resume_greeting(struct ssl_session *s);
+
+static void
+park_session(struct ssl_session *s)
+{
+	if (!s->parked) {
+		s->parked = true;
+		s->park_prev = NULL;
+		s->park_next = parked;
+
+		if (parked) {
+			parked->park_prev = s;
+		}
+
+		parked = s;
+	}
+}
+
+static void
+unpark_session(struct ssl_session *s)
+{
+	if (s->parked) {
+		if (s->park_prev) {
+			s->park_prev->park_next = s->park_next;
+		}
+		else {
+			parked = s->park_next;
+		}
+		if (s->park_next) {
+			s->park_next->park_prev = s->park_prev;
+		}
+
+		s->park_next = NULL;
+		s->park_prev = NULL;
+		s->parked = false;
+	}
+}
 
 static void
-timer_cb(EV_P_ ev_timer *w, int revents)
+unpark_cb(EV_P_ ev_prepare *w, int revents)
 {
-	struct ssl_session *ssl = w->data;
+	struct ssl_session *s, *next;
+
+	ev_prepare_stop(loop, w);
+	s = parked;
+	parked = NULL;
 
-	ev_timer_stop(loop, &ssl->tm);
-	terminate_session(ssl);
+	while (s) {
+		next = s->park_next;
+		s->park_next = NULL;
+		s->park_prev = NULL;
+		s->parked = false;
+
+		/* Either resumes reading or parks the session again */
+		if (s->state == ssl_state_init) {
+			proxy_resume_greeting(s);
+		}
+		else {
+			proxy_state_machine(s);
+		}
+
+		s = next;
+	}
+}
+
+static void
+pool_release_cb(void *ud)
+{
+	/* Deferred, as we are called from inside of some state machine */
+	if (parked && !ev_is_active(&unpark_ev)) {
+		ev_prepare_start(pool_loop, &unpark_ev);
+	}
+}
+
+/*
+ * Buffer state helpers: with the splice engine data stays in kernel pipes,
+ * and cl2bk only keeps the ClientHello that must reach the backend first
+ */
+static inline bool
+cl2bk_can_read(struct ssl_session *s)
+{
+#ifdef HAVE_SPLICE
+	if (s->spliced) {
+		return !ringbuf_can_write(&s->cl2bk) && !s->cl2bk_pipe.full &&
+				s->cl2bk_pipe.len < s->cl2bk_pipe.size;
+	}
+#endif
+	return ringbuf_can_read(&s->cl2bk);
+}
+
+static inline bool
+cl2bk_can_write(struct ssl_session *s)
+{
+#ifdef HAVE_SPLICE
+	if (s->spliced && s->cl2bk_pipe.len > 0) {
+		return true;
+	}
+#endif
+	return ringbuf_can_write(&s->cl2bk);
+}
+
+static inline bool
+bk2cl_can_read(struct ssl_session *s)
+{
+#ifdef HAVE_SPLICE
+	if (s->spliced) {
+		return !s->bk2cl_pipe.full &&
+				s->bk2cl_pipe.len < s->bk2cl_pipe.size;
+	}
+#endif
+	return ringbuf_can_read(&s->bk2cl);
+}
+
+static inline bool
+bk2cl_can_write(struct ssl_session *s)
+{
+#ifdef HAVE_SPLICE
+	if (s->spliced) {
+		return s->bk2cl_pipe.len > 0;
+	}
+#endif
+	return ringbuf_can_write(&s->bk2cl);
 }
 
 static void
@@ -59,17 +184,16 @@ close_backend(struct ssl_session *s)
 		close(s->bk_fd);
 		s->bk_fd = -1;
 
-		if (ringbuf_can_write(s->bk2cl)) {
+		if (bk2cl_can_write(s)) {
 			/* We have some more data in bk2cl buffer */
 			shutdown(s->fd, SHUT_RD);
-			ev_timer_init(&s->tm, timer_cb, 5.0, 1);
-			ev_timer_start(s->loop, &s->tm);
 		}
 		else {
 			/* Nothing to write, close connection completely */
 			s->state ++;
-			ev_timer_stop(s->loop, &s->tm);
 		}
+
+		session_timeout(s, half_close_timeout, true);
 	}
 }
 
@@ -81,17 +205,16 @@ close_client(struct ssl_session *s)
 		close(s->fd);
 		s->fd = -1;
 
-		if (ringbuf_can_write(s->cl2bk)) {
+		if (cl2bk_can_write(s)) {
 			/* We have some more data in cl2bk buffer */
 			shutdown(s->bk_fd, SHUT_RD);
-			ev_timer_init(&s->tm, timer_cb, 5.0, 1);
-			ev_timer_start(s->loop, &s->tm);
 		}
 		else {
 			/* Nothing to write, close connection completely */
 			s->state ++;
-			ev_timer_stop(s->loop, &s->tm);
 		}
+
+		session_timeout(s, half_close_timeout, true);
 	}
 }
 
@@ -105,7 +228,7 @@ proxy_cl_bk(EV_P_ ev_io *w, int revents)
 
 	if (revents & EV_READ) {
 		/* Can read from client fd to cl2bk buffer */
-		iov = ringbuf_readvec(s->cl2bk, &cnt);
+		iov = ringbuf_readvec(&s->cl2bk, &cnt);
 
 		if (iov[0].iov_len > 0) {
 			while ((r = readv(s->fd, iov, cnt)) == -1) {
@@ -128,12 +251,15 @@ proxy_cl_bk(EV_P_ ev_io *w, int revents)
 				return;
 			}
 
-			ringbuf_update_read(s->cl2bk, r);
+			stats->bytes_cl2bk += r;
+			s->bk_stats->bytes_cl2bk += r;
+			session_touch(s);
+			ringbuf_update_read(&s->cl2bk, r);
 		}
 	}
 	if (revents & EV_WRITE) {
 		/* Can write to bk fd from cl2bk buffer */
-		iov = ringbuf_writevec(s->cl2bk, &cnt);
+		iov = ringbuf_writevec(&s->cl2bk, &cnt);
 
 		if (iov[0].iov_len > 0) {
 			while ((r = writev(s->bk_fd, iov, cnt)) == -1) {
@@ -143,7 +269,7 @@ proxy_cl_bk(EV_P_ ev_io *w, int revents)
 				else if (errno == EAGAIN) {
 					return;
 				}
-				/* XXX: Handle that */
+				session_backend_error(s, errno);
 				s->state ++;
 				close_backend(s);
 				return;
@@ -156,7 +282,7 @@ proxy_cl_bk(EV_P_ ev_io *w, int revents)
 				return;
 			}
 
-			ringbuf_update_write(s->cl2bk, r);
+			ringbuf_update_write(&s->cl2bk, r);
 		}
 	}
 }
@@ -171,7 +297,7 @@ proxy_bk_cl(EV_P_ ev_io *w, int revents)
 
 	if (revents & EV_READ) {
 		/* Can read from backend fd to bk2cl buffer */
-		iov = ringbuf_readvec(s->bk2cl, &cnt);
+		iov = ringbuf_readvec(&s->bk2cl, &cnt);
 
 		if (iov[0].iov_len > 0) {
 			while ((r = readv(s->bk_fd, iov, cnt)) == -1) {
@@ -181,6 +307,7 @@ proxy_bk_cl(EV_P_ ev_io *w, int revents)
 				else if (errno == EAGAIN) {
 					return;
 				}
+				session_backend_error(s, errno);
 				s->state ++;
 				close_backend(s);
 				return;
@@ -192,12 +319,19 @@ proxy_bk_cl(EV_P_ ev_io *w, int revents)
 				return;
 			}
 
-			ringbuf_update_read(s->bk2cl, r);
+			if (!s->bk_replied) {
+				session_backend_replied(s);
+			}
+
+			stats->bytes_bk2cl += r;
+			s->bk_stats->bytes_bk2cl += r;
+			session_touch(s);
+			ringbuf_update_read(&s->bk2cl, r);
 		}
 	}
 	if (revents & EV_WRITE) {
 		/* Can write to client fd from bk2cl buffer */
-		iov = ringbuf_writevec(s->bk2cl, &cnt);
+		iov = ringbuf_writevec(&s->bk2cl, &cnt);
 
 		if (iov[0].iov_len > 0) {
 			while ((r = writev(s->fd, iov, cnt)) == -1) {
@@ -219,11 +353,184 @@ proxy_bk_cl(EV_P_ ev_io *w, int revents)
 				return;
 			}
 
-			ringbuf_update_write(s->bk2cl, r);
+			ringbuf_update_write(&s->bk2cl, r);
 		}
 	}
 }
 
+#ifdef HAVE_SPLICE
+/*
+ * Moves up to `len` bytes between a socket and a pipe without copying them
+ * to userspace
+ */
+static ssize_t
+splice_move(int from, int to, int len)
+{
+	ssize_t r;
+
+	while ((r = splice(from, NULL, to, NULL, len,
+			SPLICE_F_MOVE|SPLICE_F_NONBLOCK)) == -1) {
+		if (errno != EINTR) {
+			break;
+		}
+	}
+
+	return r;
+}
+
+static void
+splice_cl_bk(EV_P_ ev_io *w, int revents)
+{
+	ssize_t r;
+	struct ssl_session *s = w->data;
+	struct proxy_pipe *p = &s->cl2bk_pipe;
+
+	if ((revents & EV_READ) && cl2bk_can_read(s)) {
+		/* Can read from client fd to cl2bk pipe */
+		r = splice_move(s->fd, p->fds[1], p->size - p->len);
+
+		if (r == -1 && errno == EAGAIN) {
+			/* Socket is readable, so a pipe with data has no free slots */
+			p->full = p->len > 0;
+			return;
+		}
+		if (r <= 0) {
+			s->state ++;
+			close_client(s);
+			return;
+		}
+
+		stats->bytes_cl2bk += r;
+		s->bk_stats->bytes_cl2bk += r;
+		session_touch(s);
+		p->len += r;
+	}
+	if (revents & EV_WRITE) {
+		if (ringbuf_can_write(&s->cl2bk)) {
+			/* Saved ClientHello goes to the backend before the pipe */
+			proxy_cl_bk(loop, w, EV_WRITE);
+
+			if (!ringbuf_can_write(&s->cl2bk)) {
+				ringbuf_fini(&s->cl2bk);
+			}
+
+			return;
+		}
+		if (p->len > 0) {
+			/* Can write to bk fd from cl2bk pipe */
+			r = splice_move(p->fds[0], s->bk_fd, p->len);
+
+			if (r == -1 && errno == EAGAIN) {
+				return;
+			}
+			if (r <= 0) {
+				if (r == -1) {
+					session_backend_error(s, errno);
+				}
+				s->state ++;
+				close_backend(s);
+				return;
+			}
+
+			p->len -= r;
+			p->full = false;
+		}
+	}
+}
+
+static void
+splice_bk_cl(EV_P_ ev_io *w, int revents)
+{
+	ssize_t r;
+	struct ssl_session *s = w->data;
+	struct proxy_pipe *p = &s->bk2cl_pipe;
+
+	if ((revents & EV_READ) && bk2cl_can_read(s)) {
+		/* Can read from backend fd to bk2cl pipe */
+		r = splice_move(s->bk_fd, p->fds[1], p->size - p->len);
+
+		if (r == -1 && errno == EAGAIN) {
+			/* Socket is readable, so a pipe with data has no free slots */
+			p->full = p->len > 0;
+			return;
+		}
+		if (r <= 0) {
+			if (r == -1) {
+				session_backend_error(s, errno);
+			}
+			s->state ++;
+			close_backend(s);
+			return;
+		}
+		if (!s->bk_replied) {
+			session_backend_replied(s);
+		}
+
+		stats->bytes_bk2cl += r;
+		s->bk_stats->bytes_bk2cl += r;
+		session_touch(s);
+		p->len += r;
+	}
+	if ((revents & EV_WRITE) && p->len > 0) {
+		/* Can write to client fd from bk2cl pipe */
+		r = splice_move(p->fds[0], s->fd, p->len);
+
+		if (r == -1 && errno == EAGAIN) {
+			return;
+		}
+		if (r <= 0) {
+			s->state ++;
+			close_client(s);
+			return;
+		}
+
+		p->len -= r;
+		p->full = false;
+	}
+}
+
+static bool
+pipe_open(struct proxy_pipe *p)
+{
+	if (pipe2(p->fds, O_NONBLOCK|O_CLOEXEC) == -1) {
+		p->fds[0] = -1;
+		p->fds[1] = -1;
+
+		return false;
+	}
+
+	p->len = 0;
+	p->full = false;
+#ifdef F_SETPIPE_SZ
+	/* Kernel rounds it up to the page size */
+	fcntl(p->fds[1], F_SETPIPE_SZ, buflen);
+#endif
+#ifdef F_GETPIPE_SZ
+	p->size = fcntl(p->fds[1], F_GETPIPE_SZ);
+#else
+	p->size = -1;
+#endif
+
+	if (p->size <= 0) {
+		/* Default pipe capacity on Linux */
+		p->size = 65536;
+	}
+
+	return true;
+}
+
+static void
+pipe_close(struct proxy_pipe *p)
+{
+	if (p->fds[0] != -1) {
+		close(p->fds[0]);
+		close(p->fds[1]);
+		p->fds[0] = -1;
+		p->fds[1] = -1;
+	}
+}
+#endif
+
 static void
 proxy_bk_cb(EV_P_ ev_io *w, int revents)
 {
@@ -231,11 +538,23 @@ proxy_bk_cb(EV_P_ ev_io *w, int revents)
 
 	if (s->bk_fd != -1 && (revents & EV_READ)) {
 		/* Backend to client */
-		proxy_bk_cl(loop, w, revents);
+#ifdef HAVE_SPLICE
+		if (s->spliced) {
+			splice_bk_cl(loop, w, EV_READ);
+		}
+		else
+#endif
+		proxy_bk_cl(loop, w, EV_READ);
 	}
 	if (s->bk_fd != -1 && (revents & EV_WRITE)) {
 		/* Buffer to backend */
-		proxy_cl_bk(loop, w, revents);
+#ifdef HAVE_SPLICE
+		if (s->spliced) {
+			splice_cl_bk(loop, w, EV_WRITE);
+		}
+		else
+#endif
+		proxy_cl_bk(loop, w, EV_WRITE);
 	}
 	proxy_state_machine(s);
 }
@@ -247,11 +566,23 @@ proxy_cl_cb(EV_P_ ev_io *w, int revents)
 
 	if (s->fd != -1 && (revents & EV_READ)) {
 		/* Client to backend */
-		proxy_cl_bk(loop, w, revents);
+#ifdef HAVE_SPLICE
+		if (s->spliced) {
+			splice_cl_bk(loop, w, EV_READ);
+		}
+		else
+#endif
+		proxy_cl_bk(loop, w, EV_READ);
 	}
 	if (s->fd != -1 && (revents & EV_WRITE)) {
 		/* Buffer to client */
-		proxy_bk_cl(loop, w, revents);
+#ifdef HAVE_SPLICE
+		if (s->spliced) {
+			splice_bk_cl(loop, w, EV_WRITE);
+		}
+		else
+#endif
+		proxy_bk_cl(loop, w, EV_WRITE);
 	}
 	proxy_state_machine(s);
 }
@@ -261,30 +592,43 @@ proxy_state_machine(struct ssl_session *s)
 {
 	int bk_ev = 0, cl_ev = 0;
 
+	session_account(s);
+
 	if (s->state >= ssl_state_proxy_both_closed) {
-		ev_timer_stop(s->loop, &s->tm);
 		terminate_session(s);
 		return;
 	}
+
+	/* Idle directions do not hold buffers */
+	ringbuf_trim(&s->cl2bk);
+	ringbuf_trim(&s->bk2cl);
+
 	/* Client to backend */
-	if (ringbuf_can_read(s->cl2bk)) {
+	if (cl2bk_can_read(s)) {
 		/* Read data from client to cl2bk buffer */
 		cl_ev |= EV_READ;
 	}
-	if (ringbuf_can_write(s->cl2bk)) {
+	if (cl2bk_can_write(s)) {
 		/* Write data from client to backend using cl2bk buffer */
 		bk_ev |= EV_WRITE;
 	}
 	/* Backend to client */
-	if (ringbuf_can_read(s->bk2cl)) {
+	if (bk2cl_can_read(s)) {
 		/* Read data from backend to bk2cl buffer */
 		bk_ev |= EV_READ;
 	}
-	if (ringbuf_can_write(s->bk2cl)) {
+	if (bk2cl_can_write(s)) {
 		/* Write data from backend to client using bk2cl buffer */
 		cl_ev |= EV_WRITE;
 	}
 
+	if (!s->spliced &&
+			((s->fd != -1 && ringbuf_starved(&s->cl2bk)) ||
+			(s->bk_fd != -1 && ringbuf_starved(&s->bk2cl)))) {
+		/* Memory limit is reached, resume reading once buffers are freed */
+		park_session(s);
+	}
+
 	if (s->bk_fd != -1) {
 		ev_io_stop(s->loop, &s->bk_io);
 
@@ -303,12 +647,199 @@ proxy_state_machine(struct ssl_session *s)
 	}
 }
 
+/*
+ * Room for the largest ClientHello split into records, and for the data of
+ * one receive that follows it. Greeting rings grow up to it whatever the
+ * buffer limits are
+ */
+static inline size_t
+greeting_max(void)
+{
+	return TLS_HELLO_MAX * 2 + buflen;
+}
+
+static void
+proxy_pool_init(struct ev_loop *loop)
+{
+	if (pool == NULL) {
+		/* Classes for larger buffers and greetings are added when needed */
+		pool = bufpool_create(buffer_min, buflen, buffer_hugepages);
+		pool_loop = loop;
+		ev_prepare_init(&unpark_ev, unpark_cb);
+		bufpool_set_limit(pool, memory_limit, pool_release_cb, NULL);
+	}
+}
+
+static inline size_t
+proxy_max_buffer(struct ssl_session *s)
+{
+	return s->max_buffer > 0 ? s->max_buffer : buflen;
+}
+
+/*
+ * ClientHello is received right into cl2bk, parsed there and sent to the
+ * backend from it. Nothing is written out of the ring before the backend is
+ * connected, so the greeting stays linear from `write_pos`. Fails with
+ * ENOBUFS over the memory limit and with EMSGSIZE once the ring is full
+ */
+static bool
+greeting_space(struct ssl_session *s)
+{
+	if (s->cl2bk.pool == NULL) {
+		proxy_pool_init(s->loop);
+		/* Backend and its window are not known yet */
+		ringbuf_init_pooled(&s->cl2bk, pool, greeting_max(), NULL, 0);
+	}
+
+	if (s->cl2bk.buf != NULL && s->cl2bk.rd_avail == 0) {
+		if (ringbuf_expand(&s->cl2bk)) {
+			return true;
+		}
+
+		errno = s->cl2bk.cls < s->cl2bk.max_cls ? ENOBUFS : EMSGSIZE;
+
+		return false;
+	}
+
+	if (!ringbuf_can_read(&s->cl2bk)) {
+		errno = ENOBUFS;
+		return false;
+	}
+
+	return true;
+}
+
+ssize_t
+proxy_read_greeting(struct ssl_session *s)
+{
+	const struct iovec *iov;
+	ssize_t r;
+	int cnt;
+
+	if (!greeting_space(s)) {
+		return -1;
+	}
+
+	iov = ringbuf_readvec(&s->cl2bk, &cnt);
+
+	while ((r = read(s->fd, iov[0].iov_base, iov[0].iov_len)) == -1) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+
+	if (r > 0) {
+		stats->bytes_cl2bk += r;
+		ringbuf_update_read(&s->cl2bk, r);
+	}
+
+	return r;
+}
+
+ssize_t
+proxy_add_greeting(struct ssl_session *s, const uint8_t *buf, size_t len)
+{
+	const struct iovec *iov;
+	size_t n, added = 0;
+	int cnt;
+
+	while (added < len) {
+		if (!greeting_space(s)) {
+			if (added == 0) {
+				return -1;
+			}
+
+			break;
+		}
+
+		iov = ringbuf_readvec(&s->cl2bk, &cnt);
+		n = MIN(len - added, iov[0].iov_len);
+		memcpy(iov[0].iov_base, buf + added, n);
+		ringbuf_update_read(&s->cl2bk, n);
+		added += n;
+	}
+
+	stats->bytes_cl2bk += added;
+
+	return added;
+}
+
+void
+proxy_park_greeting(struct ssl_session *s)
+{
+	ev_io_stop(s->loop, &s->io);
+	park_session(s);
+}
+
+static void
+proxy_resume_greeting(struct ssl_session *s)
+{
+#ifdef HAVE_LIBURING
+	if (s->uring) {
+		uring_greet_add(s);
+		return;
+	}
+#endif
+	ev_io_start(s->loop, &s->io);
+}
+
+void
+proxy_save_greeting(struct ssl_session *s)
+{
+	/* Greeting chunk is replaced by a smaller one once it is sent */
+	ringbuf_set_limit(&s->cl2bk, proxy_max_buffer(s));
+
+#ifdef HAVE_SPLICE
+	if (use_splice) {
+		/* Only the ClientHello is kept in userspace */
+		return;
+	}
+#endif
+
+	ringbuf_init_pooled(&s->bk2cl, pool, proxy_max_buffer(s), NULL, 0);
+}
+
 void
 proxy_create(struct ssl_session *s)
 {
 	s->state = ssl_state_proxy;
+	s->spliced = false;
+	session_timeout(s, idle_timeout, true);
+
+#ifdef HAVE_SPLICE
+	if (use_splice) {
+		if (pipe_open(&s->cl2bk_pipe)) {
+			if (pipe_open(&s->bk2cl_pipe)) {
+				s->spliced = true;
+			}
+			else {
+				pipe_close(&s->cl2bk_pipe);
+			}
+		}
+
+		if (!s->spliced) {
+			/* Fall back to buffered IO */
+			ringbuf_init_pooled(&s->bk2cl, pool, proxy_max_buffer(s),
+					NULL, 0);
+		}
+	}
+#endif
 
 	ev_io_init(&s->bk_io, proxy_bk_cb, s->bk_fd, EV_READ|EV_WRITE);
 	ev_io_init(&s->io, proxy_cl_cb, s->fd, EV_READ|EV_WRITE);
 	proxy_state_machine(s);
 }
+
+void
+proxy_destroy(struct ssl_session *s)
+{
+	unpark_session(s);
+#ifdef HAVE_SPLICE
+	if (s->spliced) {
+		pipe_close(&s->cl2bk_pipe);
+		pipe_close(&s->bk2cl_pipe);
+	}
+#endif
+	ringbuf_fini(&s->bk2cl);
+	ringbuf_fini(&s->cl2bk);
+}
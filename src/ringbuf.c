@@ -33,16 +33,20 @@
 #include <sys/uio.h>
 
 #include "ringbuf.h"
+#include "bufpool.h"
 #include "util.h"
 
-struct ringbuf*
-ringbuf_create(size_t len, const uint8_t *init, size_t initlen)
+/* Number of times a ring must be filled up before it grows */
+static const int grow_after = 2;
+
+void
+ringbuf_init(struct ringbuf *r, size_t len, const uint8_t *init,
+		size_t initlen)
 {
-	struct ringbuf *r;
 	size_t real_len;
 
 	real_len = initlen > len ? initlen + len : len;
-	r = xmalloc(sizeof(*r));
+	memset(r, 0, sizeof(*r));
 	r->buf = xmalloc(real_len);
 	r->end = r->buf + real_len;
 	r->read_pos = initlen;
@@ -53,13 +57,161 @@ ringbuf_create(size_t len, const uint8_t *init, size_t initlen)
 	if (init) {
 		memcpy(r->buf, init, initlen);
 	}
+}
+
+struct ringbuf*
+ringbuf_create(size_t len, const uint8_t *init, size_t initlen)
+{
+	struct ringbuf *r;
+
+	r = xmalloc(sizeof(*r));
+	ringbuf_init(r, len, init, initlen);
 
 	return r;
 }
 
+void
+ringbuf_init_pooled(struct ringbuf *r, struct bufpool *pool, size_t max_len,
+		const uint8_t *init, size_t initlen)
+{
+	size_t len;
+
+	memset(r, 0, sizeof(*r));
+	r->pool = pool;
+	r->max_cls = bufpool_class(pool, max_len);
+	r->cls = 0;
+
+	if (initlen > 0) {
+		r->cls = bufpool_class(pool, initlen);
+		len = bufpool_class_size(pool, r->cls);
+
+		if (initlen <= len && (r->buf = bufpool_alloc(pool, r->cls)) != NULL) {
+			r->pooled = true;
+		}
+		else {
+			/* Private buffer is used until the greeting is drained */
+			len = initlen;
+			r->buf = xmalloc(len);
+		}
+
+		r->end = r->buf + len;
+		memcpy(r->buf, init, initlen);
+		r->read_pos = initlen % len;
+		r->wr_avail = initlen;
+		r->rd_avail = len - initlen;
+	}
+	else {
+		r->rd_avail = bufpool_class_size(pool, r->cls);
+	}
+}
+
+static void
+ringbuf_release(struct ringbuf *r)
+{
+	uint8_t *buf = r->buf;
+
+	r->buf = NULL;
+	r->end = NULL;
+
+	if (r->pooled) {
+		r->pooled = false;
+		bufpool_free(r->pool, buf, r->cls);
+	}
+	else {
+		free(buf);
+	}
+}
+
+static void
+ringbuf_grow(struct ringbuf *r)
+{
+	const struct iovec *iov;
+	uint8_t *nbuf;
+	size_t off = 0, len;
+	int cnt, i;
+
+	if ((nbuf = bufpool_alloc(r->pool, r->cls + 1)) == NULL) {
+		/* Over the memory limit, keep the current window */
+		return;
+	}
+
+	iov = ringbuf_writevec(r, &cnt);
+
+	for (i = 0; i < cnt; i ++) {
+		memcpy(nbuf + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+
+	ringbuf_release(r);
+	r->cls ++;
+	len = bufpool_class_size(r->pool, r->cls);
+	r->buf = nbuf;
+	r->end = nbuf + len;
+	r->pooled = true;
+	r->write_pos = 0;
+	r->read_pos = off;
+	r->rd_avail = len - off;
+	r->full = 0;
+}
+
+void
+ringbuf_set_limit(struct ringbuf *r, size_t max_len)
+{
+	if (r->pool) {
+		r->max_cls = bufpool_class(r->pool, max_len);
+	}
+}
+
+bool
+ringbuf_expand(struct ringbuf *r)
+{
+	short cls = r->cls;
+
+	if (r->pool == NULL || r->buf == NULL || r->cls >= r->max_cls) {
+		return false;
+	}
+
+	ringbuf_grow(r);
+
+	return r->cls != cls;
+}
+
+void
+ringbuf_trim(struct ringbuf *r)
+{
+	if (r && r->pool && r->buf && r->wr_avail == 0) {
+		ringbuf_release(r);
+
+		/* Limit has been lowered, or the flow has been quiet, shrink it */
+		if (r->cls > r->max_cls) {
+			r->cls = r->max_cls;
+		}
+		else if (r->cls > 0 &&
+				r->peak * 4 <= (int)bufpool_class_size(r->pool, r->cls)) {
+			r->cls --;
+		}
+
+		r->read_pos = 0;
+		r->write_pos = 0;
+		r->peak = 0;
+		r->full = 0;
+		r->rd_avail = bufpool_class_size(r->pool, r->cls);
+	}
+}
+
+bool
+ringbuf_starved(struct ringbuf *r)
+{
+	return r->buf == NULL && r->pool && !bufpool_can_alloc(r->pool, r->cls);
+}
+
 bool
 ringbuf_can_read(struct ringbuf *r)
 {
+	if (r->buf == NULL && r->pool) {
+		return bufpool_can_alloc(r->pool, r->cls);
+	}
+
 	return r->rd_avail > 0;
 }
 
@@ -75,6 +227,20 @@ ringbuf_readvec(struct ringbuf *r, int *cnt)
 	static struct iovec iov[2];
 	int p1;
 
+	if (r->buf == NULL && r->pool) {
+		/* Data is going to arrive, attach storage */
+		if ((r->buf = bufpool_alloc(r->pool, r->cls)) == NULL) {
+			iov[0].iov_base = NULL;
+			iov[0].iov_len = 0;
+			*cnt = 1;
+
+			return iov;
+		}
+
+		r->end = r->buf + r->rd_avail;
+		r->pooled = true;
+	}
+
 	p1 = MIN(r->rd_avail, (r->end - r->buf) - r->read_pos);
 	/* read_pos to end + start to write_pos */
 	iov[0].iov_base = r->buf + r->read_pos;
@@ -98,6 +264,14 @@ ringbuf_writevec(struct ringbuf *r, int *cnt)
 	static struct iovec iov[2];
 	int p1;
 
+	if (r->buf == NULL) {
+		iov[0].iov_base = NULL;
+		iov[0].iov_len = 0;
+		*cnt = 1;
+
+		return iov;
+	}
+
 	/* write_pos to end + start to read_pos */
 	p1 = MIN(r->wr_avail, (r->end - r->buf) - r->write_pos);
 	iov[0].iov_base = r->buf + r->write_pos;
@@ -132,6 +306,17 @@ ringbuf_update_read(struct ringbuf *r, ssize_t len)
 	r->wr_avail += len;
 	r->rd_avail -= len;
 
+	if (r->pooled) {
+		if (r->wr_avail > r->peak) {
+			r->peak = r->wr_avail;
+		}
+		/* Flow keeps filling the window, give it a larger one */
+		if (r->rd_avail == 0 && ++r->full >= grow_after &&
+				r->cls < r->max_cls) {
+			ringbuf_grow(r);
+		}
+	}
+
 #ifdef RBUF_DEBUG
 	fprintf(stderr, "r: %d, ravail: %d, wavail: %d, rpos: %d, wpos: %d\n",
 			(int)len, r->rd_avail, r->wr_avail, r->read_pos, r->write_pos);
@@ -160,11 +345,19 @@ ringbuf_update_write(struct ringbuf *r, ssize_t len)
 #endif
 }
 
+void
+ringbuf_fini(struct ringbuf *r)
+{
+	if (r->buf) {
+		ringbuf_release(r);
+	}
+}
+
 void
 ringbuf_destroy(struct ringbuf *r)
 {
 	if (r) {
-		free(r->buf);
+		ringbuf_fini(r);
 		free(r);
 	}
 }
@@ -31,16 +31,42 @@
 #include <unistd.h>
 #include <sys/uio.h>
 
+struct bufpool;
+
 struct ringbuf {
 	uint8_t *buf;
 	uint8_t *end;
+	struct bufpool *pool;
 	int read_pos;
 	int write_pos;
 	int wr_avail;
 	int rd_avail;
+	int peak;
+	int full;
+	short cls;
+	short max_cls;
+	bool pooled;
 };
 
 struct ringbuf* ringbuf_create(size_t len, const uint8_t *init, size_t initlen);
+void ringbuf_init(struct ringbuf *r, size_t len, const uint8_t *init,
+		size_t initlen);
+/*
+ * Pooled ring takes a chunk from the pool only when it is about to receive
+ * data and gives it back on ringbuf_trim() once everything is written out.
+ * It starts with the smallest chunk, moves to a larger one when the flow
+ * keeps filling it (up to max_len) and to a smaller one when it is drained
+ * without being used much.
+ */
+void ringbuf_init_pooled(struct ringbuf *r, struct bufpool *pool,
+		size_t max_len, const uint8_t *init, size_t initlen);
+void ringbuf_trim(struct ringbuf *r);
+/* Changes the largest chunk a pooled ring can move to */
+void ringbuf_set_limit(struct ringbuf *r, size_t max_len);
+/* Moves a pooled ring with data to a larger chunk now, false if it cannot */
+bool ringbuf_expand(struct ringbuf *r);
+/* Ring has no storage and the pool refuses to give more memory */
+bool ringbuf_starved(struct ringbuf *r);
 
 bool ringbuf_can_read(struct ringbuf *r);
 bool ringbuf_can_write(struct ringbuf *r);
@@ -51,6 +77,8 @@ const struct iovec* ringbuf_writevec(struct ringbuf *r, int *cnt);
 void ringbuf_update_read(struct ringbuf *r, ssize_t len);
 void ringbuf_update_write(struct ringbuf *r, ssize_t len);
 
+/* Releases storage of a ring embedded into another structure */
+void ringbuf_fini(struct ringbuf *r);
 void ringbuf_destroy(struct ringbuf *r);
 
 #endif /* SRC_RINGBUF_H_ */
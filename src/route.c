@@ -0,0 +1,688 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "route.h"
+#include "util.h"
+
+/*
+ * The table is a single block, so it could be copied or mapped as is:
+ *
+ * header | hash slots | trie nodes | names
+ *
+ * All references inside are 32 bit offsets or indexes. Slots keep the full
+ * hash, so a probe rarely touches the names area on a mismatch. Trie nodes
+ * hold one label each, children of a node are stored contiguously and are
+ * sorted by (length, bytes) for a binary search. Node 0 is the root.
+ */
+#define ROUTE_MAGIC "SNIROUTE"
+#define ROUTE_VERSION 1
+
+struct route_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t nnames;
+	uint32_t nwildcards;
+	uint32_t nnodes;
+	uint32_t slots_off;
+	uint32_t nodes_off;
+	uint32_t names_off;
+	uint32_t names_len;
+	uint32_t total_len;
+};
+
+struct route_slot {
+	uint32_t hash;
+	uint32_t name_off;
+	uint32_t name_len; /* 0 for an empty slot */
+	uint32_t value;
+};
+
+struct route_node {
+	uint32_t label_off;
+	uint32_t label_len;
+	uint32_t first_child;
+	uint32_t nchildren;
+	uint32_t value;
+};
+
+struct route_table {
+	const struct route_header *hdr;
+	const struct route_slot *slots;
+	const struct route_node *nodes;
+	const char *names;
+	uint32_t mask;
+	void *blob; /* NULL when the block is not owned */
+};
+
+/* Builder keeps every name, including "*." ones, in a growing hash */
+struct route_builder {
+	struct route_slot *slots;
+	uint32_t nslots;
+	uint32_t nnames;
+	char *names;
+	size_t names_len;
+	size_t names_alloc;
+};
+
+/* Trie node while building, children are a singly linked list */
+struct route_bnode {
+	uint32_t label_off;
+	uint32_t label_len;
+	uint32_t value;
+	uint32_t first_child;
+	uint32_t last_child;
+	uint32_t next;
+	uint32_t nchildren;
+};
+
+static inline uint32_t
+route_hash(const char *s, size_t len)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i ++) {
+		h ^= (uint8_t)s[i];
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+/*
+ * Folds case and strips a trailing dot, returns the normalized length or 0
+ * if the name cannot be a server name
+ */
+static size_t
+route_normalize(const char *name, size_t len, char *out)
+{
+	size_t i;
+	char c;
+
+	if (len > 0 && name[len - 1] == '.') {
+		len --;
+	}
+
+	if (len == 0 || len > ROUTE_MAX_NAME) {
+		return 0;
+	}
+
+	for (i = 0; i < len; i ++) {
+		c = name[i];
+
+		if (c >= 'A' && c <= 'Z') {
+			c += 'a' - 'A';
+		}
+
+		out[i] = c;
+	}
+
+	return len;
+}
+
+static struct route_slot*
+route_probe(struct route_slot *slots, uint32_t mask, const char *names,
+		const char *name, size_t len, uint32_t h)
+{
+	struct route_slot *slot;
+	uint32_t i = h & mask;
+
+	for (;;) {
+		slot = &slots[i];
+
+		if (slot->name_len == 0) {
+			return slot;
+		}
+
+		if (slot->hash == h && slot->name_len == len &&
+				memcmp(names + slot->name_off, name, len) == 0) {
+			return slot;
+		}
+
+		i = (i + 1) & mask;
+	}
+}
+
+static void
+route_builder_rehash(struct route_builder *b, uint32_t nslots)
+{
+	struct route_slot *nslot, *old = b->slots;
+	uint32_t i;
+
+	b->slots = xmalloc0(sizeof(*b->slots) * nslots);
+
+	for (i = 0; i < b->nslots; i ++) {
+		if (old[i].name_len != 0) {
+			nslot = route_probe(b->slots, nslots - 1, b->names,
+					b->names + old[i].name_off, old[i].name_len, old[i].hash);
+			*nslot = old[i];
+		}
+	}
+
+	b->nslots = nslots;
+	free(old);
+}
+
+struct route_builder*
+route_builder_new(void)
+{
+	struct route_builder *b;
+
+	b = xmalloc0(sizeof(*b));
+	b->nslots = 16;
+	b->slots = xmalloc0(sizeof(*b->slots) * b->nslots);
+	b->names_alloc = 4096;
+	b->names = xmalloc(b->names_alloc);
+
+	return b;
+}
+
+bool
+route_builder_add(struct route_builder *b, const char *name, size_t len,
+		uint32_t value)
+{
+	char norm[ROUTE_MAX_NAME];
+	struct route_slot *slot;
+	size_t i;
+	uint32_t h;
+
+	len = route_normalize(name, len, norm);
+
+	if (len == 0 || value == ROUTE_NONE) {
+		return false;
+	}
+
+	if (norm[0] == '*') {
+		/* Wildcard suffix must be a sequence of non-empty labels */
+		if (len <= 2 || norm[1] != '.' || norm[2] == '.' ||
+				norm[len - 1] == '.') {
+			return false;
+		}
+
+		for (i = 3; i < len; i ++) {
+			if (norm[i] == '.' && norm[i - 1] == '.') {
+				return false;
+			}
+		}
+	}
+
+	h = route_hash(norm, len);
+	slot = route_probe(b->slots, b->nslots - 1, b->names, norm, len, h);
+
+	if (slot->name_len != 0) {
+		return false;
+	}
+
+	if (b->names_len + len > b->names_alloc) {
+		while (b->names_len + len > b->names_alloc) {
+			b->names_alloc *= 2;
+		}
+
+		b->names = xrealloc(b->names, b->names_alloc);
+	}
+
+	memcpy(b->names + b->names_len, norm, len);
+	slot->hash = h;
+	slot->name_off = b->names_len;
+	slot->name_len = len;
+	slot->value = value;
+	b->names_len += len;
+	b->nnames ++;
+
+	if (b->nnames * 2 > b->nslots) {
+		route_builder_rehash(b, b->nslots * 2);
+	}
+
+	return true;
+}
+
+/*
+ * Compares labels from the rightmost one, each label by length and then by
+ * bytes, which is the order of children in the trie
+ */
+static const char *route_sort_names;
+
+static int
+route_label_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	if (alen != blen) {
+		return alen < blen ? -1 : 1;
+	}
+
+	return memcmp(a, b, alen);
+}
+
+static int
+route_wildcard_cmp(const void *pa, const void *pb)
+{
+	const struct route_slot *sa = pa, *sb = pb;
+	const char *a = route_sort_names + sa->name_off + 2,
+			*b = route_sort_names + sb->name_off + 2;
+	size_t aend = sa->name_len - 2, bend = sb->name_len - 2, as, bs;
+	int r;
+
+	for (;;) {
+		if (aend == 0 || bend == 0) {
+			return aend == bend ? 0 : (aend == 0 ? -1 : 1);
+		}
+
+		for (as = aend; as > 0 && a[as - 1] != '.'; as --);
+		for (bs = bend; bs > 0 && b[bs - 1] != '.'; bs --);
+
+		r = route_label_cmp(a + as, aend - as, b + bs, bend - bs);
+
+		if (r != 0) {
+			return r;
+		}
+
+		aend = as > 0 ? as - 1 : 0;
+		bend = bs > 0 ? bs - 1 : 0;
+	}
+}
+
+static uint32_t
+route_build_trie(struct route_builder *b, struct route_slot *wc, uint32_t nwc,
+		struct route_bnode **pnodes)
+{
+	struct route_bnode *nodes, *parent, *child;
+	uint32_t nnodes = 1, nalloc = 16, i, cur;
+	size_t end, start;
+	const char *name;
+
+	nodes = xmalloc0(sizeof(*nodes) * nalloc);
+	nodes[0].value = ROUTE_NONE;
+	nodes[0].first_child = ROUTE_NONE;
+
+	route_sort_names = b->names;
+	qsort(wc, nwc, sizeof(*wc), route_wildcard_cmp);
+
+	for (i = 0; i < nwc; i ++) {
+		/* Skip "*." */
+		name = b->names + wc[i].name_off + 2;
+		end = wc[i].name_len - 2;
+		cur = 0;
+
+		for (;;) {
+			for (start = end; start > 0 && name[start - 1] != '.'; start --);
+
+			parent = &nodes[cur];
+
+			/* Names are sorted, so an existing child is always the last one */
+			if (parent->nchildren > 0) {
+				child = &nodes[parent->last_child];
+
+				if (route_label_cmp(b->names + child->label_off,
+						child->label_len, name + start, end - start) == 0) {
+					cur = parent->last_child;
+					goto next;
+				}
+			}
+
+			if (nnodes == nalloc) {
+				nalloc *= 2;
+				nodes = xrealloc(nodes, sizeof(*nodes) * nalloc);
+				parent = &nodes[cur];
+			}
+
+			child = &nodes[nnodes];
+			child->label_off = name + start - b->names;
+			child->label_len = end - start;
+			child->value = ROUTE_NONE;
+			child->first_child = ROUTE_NONE;
+			child->nchildren = 0;
+			child->next = ROUTE_NONE;
+
+			if (parent->nchildren == 0) {
+				parent->first_child = nnodes;
+			}
+			else {
+				nodes[parent->last_child].next = nnodes;
+			}
+
+			parent->last_child = nnodes;
+			parent->nchildren ++;
+			cur = nnodes ++;
+next:
+			if (start == 0) {
+				break;
+			}
+
+			end = start - 1;
+		}
+
+		nodes[cur].value = wc[i].value;
+	}
+
+	*pnodes = nodes;
+
+	return nnodes;
+}
+
+struct route_table*
+route_builder_finish(struct route_builder *b)
+{
+	struct route_table *t;
+	struct route_header *hdr;
+	struct route_slot *slots, *wc, *slot;
+	struct route_node *out;
+	struct route_bnode *nodes;
+	uint32_t *queue, nslots, nexact = 0, nwc = 0, nnodes, i, head, tail, c;
+	size_t total, slots_off, nodes_off, names_off;
+	uint8_t *blob;
+
+	wc = xmalloc(sizeof(*wc) * (b->nnames + 1));
+
+	for (i = 0; i < b->nslots; i ++) {
+		slot = &b->slots[i];
+
+		if (slot->name_len == 0) {
+			continue;
+		}
+
+		if (slot->name_len > 2 && b->names[slot->name_off] == '*' &&
+				b->names[slot->name_off + 1] == '.') {
+			wc[nwc ++] = *slot;
+		}
+		else {
+			nexact ++;
+		}
+	}
+
+	nnodes = route_build_trie(b, wc, nwc, &nodes);
+
+	/* Keep load factor under 1/2 so misses stop after a couple of probes */
+	for (nslots = 2; nslots < nexact * 2; nslots <<= 1);
+
+	slots_off = sizeof(*hdr);
+	slots_off = (slots_off + 63) & ~(size_t)63;
+	nodes_off = slots_off + sizeof(struct route_slot) * nslots;
+	names_off = nodes_off + sizeof(struct route_node) * nnodes;
+	total = names_off + b->names_len;
+
+	/* Hash slots start on a cache line, four slots per line */
+	if (posix_memalign((void **)&blob, 64, total) != 0) {
+		abort();
+	}
+
+	memset(blob, 0, total);
+	hdr = (struct route_header *)blob;
+	slots = (struct route_slot *)(blob + slots_off);
+	out = (struct route_node *)(blob + nodes_off);
+
+	memcpy(hdr->magic, ROUTE_MAGIC, sizeof(hdr->magic));
+	hdr->version = ROUTE_VERSION;
+	hdr->nslots = nslots;
+	hdr->nnames = nexact;
+	hdr->nwildcards = nwc;
+	hdr->nnodes = nnodes;
+	hdr->slots_off = slots_off;
+	hdr->nodes_off = nodes_off;
+	hdr->names_off = names_off;
+	hdr->names_len = b->names_len;
+	hdr->total_len = total;
+	memcpy(blob + names_off, b->names, b->names_len);
+
+	for (i = 0; i < b->nslots; i ++) {
+		slot = &b->slots[i];
+
+		if (slot->name_len == 0 || (slot->name_len > 2 &&
+				b->names[slot->name_off] == '*' &&
+				b->names[slot->name_off + 1] == '.')) {
+			continue;
+		}
+
+		*route_probe(slots, nslots - 1, b->names,
+				b->names + slot->name_off, slot->name_len, slot->hash) = *slot;
+	}
+
+	/* Breadth first layout makes siblings contiguous */
+	queue = xmalloc(sizeof(*queue) * nnodes);
+	queue[0] = 0;
+	head = 0;
+	tail = 1;
+
+	while (head < tail) {
+		i = queue[head];
+		out[head].label_off = nodes[i].label_off;
+		out[head].label_len = nodes[i].label_len;
+		out[head].value = nodes[i].value;
+		out[head].nchildren = nodes[i].nchildren;
+		out[head].first_child = tail;
+
+		for (c = nodes[i].first_child; nodes[i].nchildren > 0 && c != ROUTE_NONE;
+				c = nodes[c].next) {
+			queue[tail ++] = c;
+		}
+
+		head ++;
+	}
+
+	free(queue);
+	free(nodes);
+	free(wc);
+	free(b->slots);
+	free(b->names);
+	free(b);
+
+	t = xmalloc0(sizeof(*t));
+	t->blob = blob;
+	t->hdr = hdr;
+	t->slots = slots;
+	t->nodes = out;
+	t->names = (const char *)(blob + names_off);
+	t->mask = nslots - 1;
+
+	return t;
+}
+
+struct route_table*
+route_table_open(const void *blob, size_t len)
+{
+	const struct route_header *hdr = blob;
+	struct route_table *t;
+
+	/*
+	 * Only the layout is checked here, it is O(1) and does not fault in
+	 * the whole block. Contents are checked by route_table_check()
+	 */
+	if (len < sizeof(*hdr) || ((uintptr_t)blob & 63) != 0 ||
+			memcmp(hdr->magic, ROUTE_MAGIC, sizeof(hdr->magic)) != 0 ||
+			hdr->version != ROUTE_VERSION || hdr->total_len > len ||
+			hdr->nslots == 0 || (hdr->nslots & (hdr->nslots - 1)) != 0 ||
+			hdr->nnodes == 0 ||
+			hdr->slots_off < sizeof(*hdr) ||
+			hdr->nodes_off < hdr->slots_off ||
+			(hdr->nodes_off - hdr->slots_off) / sizeof(struct route_slot) <
+					hdr->nslots ||
+			hdr->names_off < hdr->nodes_off ||
+			(hdr->names_off - hdr->nodes_off) / sizeof(struct route_node) <
+					hdr->nnodes ||
+			hdr->names_off > hdr->total_len ||
+			hdr->names_len > hdr->total_len - hdr->names_off) {
+		return NULL;
+	}
+
+	t = xmalloc0(sizeof(*t));
+	t->hdr = hdr;
+	t->slots = (const struct route_slot *)((const uint8_t *)blob +
+			hdr->slots_off);
+	t->nodes = (const struct route_node *)((const uint8_t *)blob +
+			hdr->nodes_off);
+	t->names = (const char *)blob + hdr->names_off;
+	t->mask = hdr->nslots - 1;
+
+	return t;
+}
+
+bool
+route_table_check(const struct route_table *t)
+{
+	const struct route_slot *slot;
+	const struct route_node *node;
+	uint32_t names_len = t->hdr->names_len, nnodes = t->hdr->nnodes, i;
+	bool empty = false;
+
+	for (i = 0; i < t->hdr->nslots; i ++) {
+		slot = &t->slots[i];
+
+		if (slot->name_len == 0) {
+			/* Probes stop at an empty slot, there must be one */
+			empty = true;
+		}
+		else if (slot->name_len > ROUTE_MAX_NAME ||
+				slot->name_off > names_len ||
+				slot->name_len > names_len - slot->name_off) {
+			return false;
+		}
+	}
+
+	for (i = 0; i < nnodes; i ++) {
+		node = &t->nodes[i];
+
+		if (node->label_off > names_len ||
+				node->label_len > names_len - node->label_off) {
+			return false;
+		}
+
+		/* Children follow their parent, so lookups always move forward */
+		if (node->nchildren > 0 && (node->first_child <= i ||
+				node->first_child >= nnodes ||
+				node->nchildren > nnodes - node->first_child)) {
+			return false;
+		}
+	}
+
+	return empty;
+}
+
+const void*
+route_table_blob(const struct route_table *t, size_t *len)
+{
+	*len = t->hdr->total_len;
+
+	return t->hdr;
+}
+
+static const struct route_node*
+route_find_child(const struct route_table *t, const struct route_node *n,
+		const char *label, size_t len)
+{
+	const struct route_node *base = &t->nodes[n->first_child], *mid;
+	uint32_t lo = 0, hi = n->nchildren;
+	int r;
+
+	while (lo < hi) {
+		mid = &base[(lo + hi) / 2];
+		r = route_label_cmp(t->names + mid->label_off, mid->label_len,
+				label, len);
+
+		if (r == 0) {
+			return mid;
+		}
+		else if (r < 0) {
+			lo = (lo + hi) / 2 + 1;
+		}
+		else {
+			hi = (lo + hi) / 2;
+		}
+	}
+
+	return NULL;
+}
+
+uint32_t
+route_lookup(const struct route_table *t, const char *name, size_t len)
+{
+	char norm[ROUTE_MAX_NAME];
+	const struct route_slot *slot;
+	const struct route_node *node;
+	uint32_t h, best = ROUTE_NONE;
+	size_t start, end;
+
+	len = route_normalize(name, len, norm);
+
+	if (len == 0) {
+		return ROUTE_NONE;
+	}
+
+	h = route_hash(norm, len);
+	slot = route_probe((struct route_slot *)t->slots, t->mask, t->names,
+			norm, len, h);
+
+	if (slot->name_len != 0) {
+		return slot->value;
+	}
+
+	/* Walk labels from the right, remembering the deepest wildcard */
+	node = &t->nodes[0];
+	end = len;
+
+	while (node->nchildren > 0) {
+		for (start = end; start > 0 && norm[start - 1] != '.'; start --);
+
+		node = route_find_child(t, node, norm + start, end - start);
+
+		/* `*.suffix` needs at least one more label in front of suffix */
+		if (node == NULL || start == 0) {
+			break;
+		}
+
+		if (node->value != ROUTE_NONE) {
+			best = node->value;
+		}
+
+		end = start - 1;
+	}
+
+	return best;
+}
+
+unsigned
+route_count(const struct route_table *t)
+{
+	return t->hdr->nnames + t->hdr->nwildcards;
+}
+
+size_t
+route_table_size(const struct route_table *t)
+{
+	return t->hdr->total_len;
+}
+
+void
+route_table_destroy(struct route_table *t)
+{
+	if (t) {
+		free(t->blob);
+		free(t);
+	}
+}
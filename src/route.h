@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SRC_ROUTE_H_
+#define SRC_ROUTE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Immutable SNI routing table. It maps server names to small integers
+ * (backend indexes) and is stored as a single pointer-free block: an open
+ * addressing hash of exact names followed by a trie of reversed labels for
+ * `*.example.com` entries. Names are case-folded and have a trailing dot
+ * stripped both when the table is built and on lookup.
+ */
+#define ROUTE_NONE 0xffffffffU
+#define ROUTE_MAX_NAME 255
+
+struct route_table;
+struct route_builder;
+
+struct route_builder* route_builder_new(void);
+/* Returns false for invalid or duplicate names */
+bool route_builder_add(struct route_builder *b, const char *name, size_t len,
+		uint32_t value);
+/* Consumes the builder */
+struct route_table* route_builder_finish(struct route_builder *b);
+
+/* Exact match first, then the longest wildcard suffix */
+uint32_t route_lookup(const struct route_table *t, const char *name,
+		size_t len);
+/*
+ * Uses a block produced by route_table_blob() in place, it must be 64
+ * bytes aligned and outlive the table
+ */
+struct route_table* route_table_open(const void *blob, size_t len);
+/* Checks every slot and node against the bounds of the block, O(size) */
+bool route_table_check(const struct route_table *t);
+const void* route_table_blob(const struct route_table *t, size_t *len);
+
+unsigned route_count(const struct route_table *t);
+size_t route_table_size(const struct route_table *t);
+
+void route_table_destroy(struct route_table *t);
+
+#endif /* SRC_ROUTE_H_ */
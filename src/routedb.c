@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "routedb.h"
+#include "util.h"
+
+/*
+ * header | routing table | record index | record data
+ *
+ * Sections start on 64 bytes boundaries. Integers are in host byte order,
+ * so a database must be compiled on the same architecture it is used on.
+ * Each record in the data is its name, a zero byte and its definition.
+ */
+#define ROUTEDB_MAGIC "SNIRTDB"
+#define ROUTEDB_VERSION 2
+
+struct routedb_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nrecords;
+	uint32_t default_record;
+	uint32_t max_buffer;
+	uint64_t table_off;
+	uint64_t table_len;
+	uint64_t index_off;
+	uint64_t data_off;
+	uint64_t data_len;
+	uint64_t total_len;
+};
+
+struct routedb_index {
+	uint64_t off;
+	uint64_t len;
+	uint64_t name_len;
+};
+
+struct routedb {
+	const uint8_t *base;
+	size_t len;
+	const struct routedb_header *hdr;
+	const struct routedb_index *index;
+	struct route_table *table;
+};
+
+static inline uint64_t
+routedb_align(uint64_t off)
+{
+	return (off + 63) & ~(uint64_t)63;
+}
+
+static bool
+routedb_pad(FILE *f, uint64_t *off)
+{
+	static const char zeroes[64];
+	uint64_t aligned = routedb_align(*off);
+
+	if (aligned != *off && fwrite(zeroes, aligned - *off, 1, f) != 1) {
+		return false;
+	}
+
+	*off = aligned;
+
+	return true;
+}
+
+bool
+routedb_write(const char *path, const struct route_table *t,
+		const struct routedb_record *records, uint32_t nrecords,
+		uint32_t default_record, uint32_t max_buffer)
+{
+	struct routedb_header hdr;
+	struct routedb_index idx;
+	char tmp[PATH_MAX];
+	const void *blob;
+	size_t blob_len;
+	uint64_t off, data_len = 0;
+	uint32_t i;
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+
+	if (f == NULL) {
+		fprintf(stderr, "cannot open %s: %s\n", tmp, strerror(errno));
+		return false;
+	}
+
+	blob = route_table_blob(t, &blob_len);
+
+	for (i = 0; i < nrecords; i ++) {
+		data_len += strlen(records[i].name) + 1 + records[i].len;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, ROUTEDB_MAGIC, sizeof(hdr.magic));
+	hdr.version = ROUTEDB_VERSION;
+	hdr.nrecords = nrecords;
+	hdr.default_record = default_record;
+	hdr.max_buffer = max_buffer;
+	hdr.table_off = routedb_align(sizeof(hdr));
+	hdr.table_len = blob_len;
+	hdr.index_off = routedb_align(hdr.table_off + blob_len);
+	hdr.data_off = routedb_align(hdr.index_off + sizeof(idx) * nrecords);
+	hdr.data_len = data_len;
+	hdr.total_len = hdr.data_off + data_len;
+
+	off = sizeof(hdr);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 || !routedb_pad(f, &off) ||
+			fwrite(blob, blob_len, 1, f) != 1) {
+		goto err;
+	}
+
+	off += blob_len;
+
+	if (!routedb_pad(f, &off)) {
+		goto err;
+	}
+
+	idx.off = 0;
+
+	for (i = 0; i < nrecords; i ++) {
+		idx.len = records[i].len;
+		idx.name_len = strlen(records[i].name);
+
+		if (fwrite(&idx, sizeof(idx), 1, f) != 1) {
+			goto err;
+		}
+
+		idx.off += idx.name_len + 1 + idx.len;
+		off += sizeof(idx);
+	}
+
+	if (!routedb_pad(f, &off)) {
+		goto err;
+	}
+
+	for (i = 0; i < nrecords; i ++) {
+		if (fwrite(records[i].name, strlen(records[i].name) + 1, 1, f) != 1 ||
+				(records[i].len > 0 &&
+				fwrite(records[i].data, records[i].len, 1, f) != 1)) {
+			goto err;
+		}
+	}
+
+	if (fflush(f) != 0 || fsync(fileno(f)) == -1) {
+		goto err;
+	}
+
+	fclose(f);
+
+	/* Processes that have the old file mapped keep using it */
+	if (rename(tmp, path) == -1) {
+		fprintf(stderr, "cannot rename %s to %s: %s\n", tmp, path,
+				strerror(errno));
+		unlink(tmp);
+
+		return false;
+	}
+
+	return true;
+
+err:
+	fprintf(stderr, "cannot write %s: %s\n", tmp, strerror(errno));
+	fclose(f);
+	unlink(tmp);
+
+	return false;
+}
+
+struct routedb*
+routedb_open(const char *path)
+{
+	struct routedb *db;
+	const struct routedb_header *hdr;
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+
+	if (fd == -1) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(*hdr)) {
+		fprintf(stderr, "cannot use %s: bad size\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "cannot mmap %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	/* Lookups touch a few random pages, readahead is just a waste */
+	(void)madvise(p, st.st_size, MADV_RANDOM);
+
+	hdr = p;
+
+	if (memcmp(hdr->magic, ROUTEDB_MAGIC, sizeof(hdr->magic)) == 0 &&
+			hdr->version != ROUTEDB_VERSION) {
+		fprintf(stderr, "cannot use %s: version %u, rebuild it with "
+				"sni-routedb\n", path, hdr->version);
+		munmap(p, st.st_size);
+		return NULL;
+	}
+
+	if (memcmp(hdr->magic, ROUTEDB_MAGIC, sizeof(hdr->magic)) != 0 ||
+			hdr->total_len > (uint64_t)st.st_size ||
+			hdr->table_off < sizeof(*hdr) ||
+			hdr->table_off + hdr->table_len > hdr->index_off ||
+			hdr->index_off > hdr->data_off ||
+			routedb_align(hdr->index_off) != hdr->index_off ||
+			(hdr->data_off - hdr->index_off) / sizeof(struct routedb_index) <
+					hdr->nrecords ||
+			hdr->data_off + hdr->data_len > hdr->total_len ||
+			(hdr->default_record != ROUTE_NONE &&
+					hdr->default_record >= hdr->nrecords)) {
+		fprintf(stderr, "cannot use %s: bad routing database\n", path);
+		munmap(p, st.st_size);
+		return NULL;
+	}
+
+	db = xmalloc0(sizeof(*db));
+	db->base = p;
+	db->len = st.st_size;
+	db->hdr = hdr;
+	db->index = (const struct routedb_index *)(db->base + hdr->index_off);
+	db->table = route_table_open(db->base + hdr->table_off, hdr->table_len);
+
+	if (db->table == NULL) {
+		fprintf(stderr, "cannot use %s: bad routing table\n", path);
+		routedb_close(db);
+		return NULL;
+	}
+
+	return db;
+}
+
+const struct route_table*
+routedb_table(const struct routedb *db)
+{
+	return db->table;
+}
+
+uint32_t
+routedb_nrecords(const struct routedb *db)
+{
+	return db->hdr->nrecords;
+}
+
+uint32_t
+routedb_default(const struct routedb *db)
+{
+	return db->hdr->default_record;
+}
+
+uint32_t
+routedb_max_buffer(const struct routedb *db)
+{
+	return db->hdr->max_buffer;
+}
+
+static const struct routedb_index*
+routedb_index_get(const struct routedb *db, uint32_t idx)
+{
+	const struct routedb_index *ri;
+	const uint8_t *data = db->base + db->hdr->data_off;
+
+	if (idx >= db->hdr->nrecords) {
+		return NULL;
+	}
+
+	ri = &db->index[idx];
+
+	if (ri->off > db->hdr->data_len ||
+			ri->name_len >= db->hdr->data_len - ri->off ||
+			ri->len > db->hdr->data_len - ri->off - ri->name_len - 1 ||
+			data[ri->off + ri->name_len] != '\0') {
+		return NULL;
+	}
+
+	return ri;
+}
+
+const char*
+routedb_record(const struct routedb *db, uint32_t idx, size_t *len)
+{
+	const struct routedb_index *ri = routedb_index_get(db, idx);
+
+	if (ri == NULL) {
+		return NULL;
+	}
+
+	*len = ri->len;
+
+	return (const char *)db->base + db->hdr->data_off + ri->off +
+			ri->name_len + 1;
+}
+
+const char*
+routedb_record_name(const struct routedb *db, uint32_t idx)
+{
+	const struct routedb_index *ri = routedb_index_get(db, idx);
+
+	if (ri == NULL) {
+		return NULL;
+	}
+
+	return (const char *)db->base + db->hdr->data_off + ri->off;
+}
+
+bool
+routedb_check(const struct routedb *db)
+{
+	uint32_t i;
+
+	if (!route_table_check(db->table)) {
+		fprintf(stderr, "bad routing table\n");
+		return false;
+	}
+
+	for (i = 0; i < db->hdr->nrecords; i ++) {
+		if (routedb_index_get(db, i) == NULL) {
+			fprintf(stderr, "bad record %u\n", i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+size_t
+routedb_size(const struct routedb *db)
+{
+	return db->len;
+}
+
+void
+routedb_close(struct routedb *db)
+{
+	if (db) {
+		route_table_destroy(db->table);
+		munmap((void *)db->base, db->len);
+		free(db);
+	}
+}
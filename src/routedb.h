@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SRC_ROUTEDB_H_
+#define SRC_ROUTEDB_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "route.h"
+
+/*
+ * Precompiled routing database: a routing table block followed by backend
+ * records. Each record is a backend definition serialized as compact JSON
+ * with a stable name for it, names in the table map to record indexes. The
+ * file is mapped read-only and shared between processes; it is never
+ * modified in place, a new version is renamed over the old one.
+ */
+struct routedb;
+
+struct routedb_record {
+	const char *name;
+	const char *data;
+	size_t len;
+};
+
+bool routedb_write(const char *path, const struct route_table *t,
+		const struct routedb_record *records, uint32_t nrecords,
+		uint32_t default_record, uint32_t max_buffer);
+
+struct routedb* routedb_open(const char *path);
+const struct route_table* routedb_table(const struct routedb *db);
+uint32_t routedb_nrecords(const struct routedb *db);
+/* ROUTE_NONE if there is no default backend */
+uint32_t routedb_default(const struct routedb *db);
+/* Largest max_buffer of all records, 0 if none is set */
+uint32_t routedb_max_buffer(const struct routedb *db);
+const char* routedb_record(const struct routedb *db, uint32_t idx,
+		size_t *len);
+/* Name the record is counted under, NULL if `idx` is out of range */
+const char* routedb_record_name(const struct routedb *db, uint32_t idx);
+/*
+ * Reads the whole file and checks every table entry and record, it is meant
+ * to run before a new version is renamed into place
+ */
+bool routedb_check(const struct routedb *db);
+size_t routedb_size(const struct routedb *db);
+void routedb_close(struct routedb *db);
+
+#endif /* SRC_ROUTEDB_H_ */
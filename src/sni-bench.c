@@ -0,0 +1,353 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks for the ClientHello parser and session rings, run by
+ * `make bench`. Each case is repeated for a fixed time and reported in
+ * nanoseconds and heap allocations per operation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/param.h>
+
+#include "util.h"
+#include "hello.h"
+#include "hello-gen.h"
+#include "ringbuf.h"
+#include "bufpool.h"
+
+#ifdef __GLIBC__
+/* Counts heap allocations of the process, the glibc allocator does the job */
+extern void *__libc_malloc(size_t len);
+extern void *__libc_calloc(size_t n, size_t len);
+extern void *__libc_realloc(void *p, size_t len);
+
+static unsigned long nallocs;
+
+void *
+malloc(size_t len)
+{
+	nallocs ++;
+	return __libc_malloc(len);
+}
+
+void *
+calloc(size_t n, size_t len)
+{
+	nallocs ++;
+	return __libc_calloc(n, len);
+}
+
+void *
+realloc(void *p, size_t len)
+{
+	nallocs ++;
+	return __libc_realloc(p, len);
+}
+
+#define HAVE_ALLOC_COUNT 1
+#else
+static unsigned long nallocs;
+#endif
+
+static double bench_time = 0.3;
+static const char *bench_filter;
+static volatile size_t sink;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Deterministic so that runs are comparable */
+static uint32_t
+rnd(void)
+{
+	static uint32_t x = 2463534242U;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return x;
+}
+
+typedef void (*bench_fn)(void *ud, unsigned n);
+
+static void
+bench_run(const char *group, const char *name, const char *info,
+		bench_fn fn, void *ud)
+{
+	char full[128];
+	unsigned long allocs, ops = 0;
+	unsigned batch = 64;
+	double start, elapsed;
+
+	snprintf(full, sizeof(full), "%s/%s", group, name);
+
+	if (bench_filter && strstr(full, bench_filter) == NULL) {
+		return;
+	}
+
+	/* Warm up caches and the pool */
+	fn(ud, batch);
+
+	allocs = nallocs;
+	start = now();
+
+	do {
+		fn(ud, batch);
+		ops += batch;
+
+		if (batch < 65536) {
+			batch *= 2;
+		}
+
+		elapsed = now() - start;
+	} while (elapsed < bench_time);
+
+	printf("%-28s %-32s %8.1f ns/op", full, info, elapsed * 1e9 / ops);
+#ifdef HAVE_ALLOC_COUNT
+	printf(" %8.2f allocs/op\n", (double)(nallocs - allocs) / ops);
+#else
+	printf(" %8s allocs/op\n", "n/a");
+#endif
+}
+
+struct hello_case {
+	uint8_t buf[HELLO_GEN_MAX];
+	size_t len;
+	/* Bytes delivered by each read, the whole hello if 0 */
+	size_t segment;
+	unsigned records;
+};
+
+static void
+bench_hello(void *ud, unsigned n)
+{
+	struct hello_case *c = ud;
+	struct tls_hello h;
+	char host[256];
+	enum tls_hello_status st;
+	size_t len;
+
+	while (n --) {
+		tls_hello_init(&h, host, sizeof(host));
+
+		if (c->segment == 0) {
+			st = tls_hello_parse(&h, c->buf, c->len);
+		}
+		else {
+			/* Parsed again after every segment, as the listener does */
+			len = 0;
+
+			do {
+				len = MIN(len + c->segment, c->len);
+				st = tls_hello_parse(&h, c->buf, len);
+			} while (st == tls_hello_more && len < c->len);
+		}
+
+		if (st != tls_hello_done || h.hostlen == 0) {
+			fprintf(stderr, "parser failed on a valid ClientHello\n");
+			exit(EXIT_FAILURE);
+		}
+
+		sink += h.hostlen;
+	}
+}
+
+static void
+bench_parser(void)
+{
+	static const size_t segments[] = {0, 1460, 64};
+	static const char *segment_names[] = {"whole", "mss", "64b"};
+	struct hello_case c;
+	char info[64], name[64];
+	unsigned i, j;
+
+	for (i = 0; i < hello_nshapes; i ++) {
+		c.len = hello_generate(&hello_shapes[i], "www.example.com", c.buf,
+				&c.records);
+
+		for (j = 0; j < sizeof(segments) / sizeof(segments[0]); j ++) {
+			if (segments[j] != 0 && segments[j] >= c.len) {
+				/* Same as whole */
+				continue;
+			}
+
+			c.segment = segments[j];
+			snprintf(name, sizeof(name), "%s/%s", hello_shapes[i].name,
+					segment_names[j]);
+			snprintf(info, sizeof(info), "%zu bytes, %u records", c.len,
+					c.records);
+			bench_run("parser", name, info, bench_hello, &c);
+		}
+	}
+}
+
+/*
+ * Ring patterns: reads from a socket and writes to the peer, sizes drawn
+ * from a precomputed random sequence. A pooled ring gives its chunk back
+ * whenever it is drained, as in the proxy state machine
+ */
+struct ring_pattern {
+	const char *name;
+	unsigned max_read;
+	unsigned max_write;
+	bool pooled;
+};
+
+static const struct ring_pattern patterns[] = {
+	{"small", 256, 256, true},
+	{"mixed", 16384, 16384, true},
+	{"read-heavy", 4096, 1024, true},
+	{"bulk", 65536, 65536, true},
+	{"mixed-private", 16384, 16384, false},
+};
+
+#define RING_STEPS 4096
+
+struct ring_case {
+	const struct ring_pattern *pat;
+	struct ringbuf r;
+	struct bufpool *pool;
+	uint32_t reads[RING_STEPS];
+	uint32_t writes[RING_STEPS];
+	unsigned step;
+	uint8_t src[65536];
+};
+
+static void
+bench_ring(void *ud, unsigned n)
+{
+	struct ring_case *c = ud;
+	const struct iovec *iov;
+	size_t want, done, chunk;
+	int cnt, i;
+
+	while (n --) {
+		want = c->reads[c->step];
+
+		if (ringbuf_can_read(&c->r)) {
+			iov = ringbuf_readvec(&c->r, &cnt);
+			done = 0;
+
+			for (i = 0; i < cnt && done < want; i ++) {
+				chunk = MIN(iov[i].iov_len, want - done);
+				memcpy(iov[i].iov_base, c->src + done, chunk);
+				done += chunk;
+			}
+
+			ringbuf_update_read(&c->r, done);
+		}
+
+		want = c->writes[c->step];
+		iov = ringbuf_writevec(&c->r, &cnt);
+		done = 0;
+
+		for (i = 0; i < cnt && done < want; i ++) {
+			chunk = MIN(iov[i].iov_len, want - done);
+			sink += ((const uint8_t *)iov[i].iov_base)[chunk ? chunk - 1 : 0];
+			done += chunk;
+		}
+
+		ringbuf_update_write(&c->r, done);
+		ringbuf_trim(&c->r);
+		c->step = (c->step + 1) % RING_STEPS;
+	}
+}
+
+static void
+bench_ringbuf(void)
+{
+	struct ring_case *c;
+	char info[64];
+	unsigned i, j;
+
+	c = xmalloc0(sizeof(*c));
+	c->pool = bufpool_create(4096, 65536, false);
+
+	for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i ++) {
+		c->pat = &patterns[i];
+		c->step = 0;
+
+		for (j = 0; j < RING_STEPS; j ++) {
+			c->reads[j] = 1 + rnd() % c->pat->max_read;
+			c->writes[j] = 1 + rnd() % c->pat->max_write;
+		}
+
+		if (c->pat->pooled) {
+			ringbuf_init_pooled(&c->r, c->pool, 65536, NULL, 0);
+		}
+		else {
+			ringbuf_init(&c->r, 16384, NULL, 0);
+		}
+
+		snprintf(info, sizeof(info), "reads <= %u, writes <= %u",
+				c->pat->max_read, c->pat->max_write);
+		bench_run("ringbuf", c->pat->name, info, bench_ring, c);
+		ringbuf_fini(&c->r);
+	}
+
+	bufpool_destroy(c->pool);
+	free(c);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch;
+
+	while ((ch = getopt(argc, argv, "t:h")) != -1) {
+		switch (ch) {
+		case 't':
+			bench_time = strtod(optarg, NULL);
+			break;
+		case 'h':
+		default:
+			fprintf(stderr, "usage: sni-bench [-t seconds] [filter]\n");
+			exit(ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	if (optind < argc) {
+		bench_filter = argv[optind];
+	}
+
+	bench_parser();
+	bench_ringbuf();
+
+	return 0;
+}
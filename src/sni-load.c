@@ -0,0 +1,937 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Loopback load generator and test backend. The backend echoes or sinks
+ * what it receives; the generator drives a running sni-proxy with
+ * synthetic ClientHellos and prints a JSON report to stdout:
+ *
+ *	sni-load -B -p 4 127.0.0.1:8443
+ *	sni-load -w storm -c 256 -n a.example.com:3 -n b.example.com 127.0.0.1:443
+ *
+ * The first bytes of a backend reply complete the "handshake", nothing is
+ * encrypted on either side.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "ev.h"
+#include "util.h"
+#include "hello-gen.h"
+
+enum load_workload {
+	/* Short-lived connections: connect, hello, first reply byte, close */
+	workload_storm = 0,
+	/* Long flows writing as fast as possible */
+	workload_bulk,
+	/* Connections kept open without traffic after the handshake */
+	workload_idle
+};
+
+static const char *workload_names[] = {"storm", "bulk", "idle"};
+
+struct load_name {
+	const char *name;
+	unsigned weight;
+	uint8_t *hello;
+	size_t len;
+};
+
+/* Latencies in microseconds */
+struct load_samples {
+	uint32_t *v;
+	size_t n;
+	size_t size;
+};
+
+struct load_result {
+	/* Completed handshakes and failed connects or handshakes */
+	uint64_t connections;
+	uint64_t errors;
+	/* Established connections closed by the other side */
+	uint64_t dropped;
+	uint64_t established;
+	uint64_t bytes_sent;
+	uint64_t bytes_received;
+	double elapsed;
+	struct load_samples connect;
+	struct load_samples handshake;
+};
+
+struct load_conn {
+	ev_io io;
+	ev_timer tm;
+	struct ev_loop *loop;
+	const struct load_name *name;
+	ev_tstamp start;
+	size_t off;
+	int fd;
+	enum {
+		conn_idle = 0,
+		conn_connecting,
+		conn_hello,
+		conn_reply,
+		conn_established
+	} state;
+};
+
+struct sink_conn {
+	ev_io io;
+	int fd;
+	bool replied;
+	size_t len;
+	size_t off;
+	uint8_t buf[16384];
+};
+
+static enum load_workload workload = workload_storm;
+static int concurrency = 64;
+static double duration = 10.0;
+static int nprocs = 1;
+static size_t chunk = 16384;
+static const char *label = "";
+static const char *target_name;
+static const struct hello_shape *shape;
+static bool backend_sink = false;
+static struct addrinfo *target;
+
+static struct load_name *names;
+static unsigned nnames, total_weight;
+
+static struct load_result res;
+static bool running;
+static uint8_t *payload;
+static uint8_t rbuf[65536];
+
+/* Fake ServerHello record sent by the sink backend */
+static const uint8_t sink_reply[64] = {0x16, 0x3, 0x3, 0x0, 0x3b, 0x2};
+
+static uint32_t
+rnd(void)
+{
+	static uint32_t x;
+
+	if (x == 0) {
+		x = 2463534242U ^ (uint32_t)getpid();
+	}
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return x;
+}
+
+static void
+samples_add(struct load_samples *s, ev_tstamp t)
+{
+	if (s->n == s->size) {
+		s->size = s->size ? s->size * 2 : 4096;
+		s->v = xrealloc(s->v, s->size * sizeof(*s->v));
+	}
+
+	s->v[s->n ++] = t > 0 ? t * 1e6 : 0;
+}
+
+static int
+samples_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+set_nonblock(int fd)
+{
+	int on = 1;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+static const struct load_name *
+pick_name(void)
+{
+	unsigned i, w = rnd() % total_weight;
+
+	for (i = 0; i < nnames - 1; i ++) {
+		if (w < names[i].weight) {
+			break;
+		}
+		w -= names[i].weight;
+	}
+
+	return &names[i];
+}
+
+static void conn_start(struct load_conn *c);
+
+static void
+conn_close(struct load_conn *c)
+{
+	ev_io_stop(c->loop, &c->io);
+	ev_timer_stop(c->loop, &c->tm);
+
+	if (c->fd != -1) {
+		close(c->fd);
+		c->fd = -1;
+	}
+
+	c->state = conn_idle;
+}
+
+static void
+conn_fail(struct load_conn *c)
+{
+	if (c->state == conn_established) {
+		res.dropped ++;
+	}
+	else {
+		res.errors ++;
+	}
+
+	conn_close(c);
+
+	if (running && workload == workload_storm) {
+		/* Do not spin on a refusing proxy */
+		ev_timer_set(&c->tm, 0.01, 0.0);
+		ev_timer_start(c->loop, &c->tm);
+	}
+}
+
+static void
+conn_watch(struct load_conn *c, int events)
+{
+	ev_io_stop(c->loop, &c->io);
+	ev_io_set(&c->io, c->fd, events);
+	ev_io_start(c->loop, &c->io);
+}
+
+static void
+conn_io_cb(EV_P_ ev_io *w, int revents)
+{
+	struct load_conn *c = w->data;
+	socklen_t slen = sizeof(int);
+	ssize_t r;
+	int err = 0;
+
+	switch (c->state) {
+	case conn_connecting:
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &slen) == -1 ||
+				err != 0) {
+			conn_fail(c);
+			return;
+		}
+
+		samples_add(&res.connect, ev_time() - c->start);
+		c->state = conn_hello;
+		c->off = 0;
+		/* FALLTHROUGH */
+	case conn_hello:
+		r = write(c->fd, c->name->hello + c->off, c->name->len - c->off);
+
+		if (r == -1) {
+			if (errno != EAGAIN && errno != EINTR) {
+				conn_fail(c);
+			}
+			return;
+		}
+
+		res.bytes_sent += r;
+		c->off += r;
+
+		if (c->off == c->name->len) {
+			c->state = conn_reply;
+			conn_watch(c, EV_READ);
+		}
+		break;
+	case conn_reply:
+		if ((r = read(c->fd, rbuf, sizeof(rbuf))) == -1 &&
+				(errno == EAGAIN || errno == EINTR)) {
+			return;
+		}
+		if (r <= 0) {
+			conn_fail(c);
+			return;
+		}
+
+		res.bytes_received += r;
+		res.connections ++;
+		samples_add(&res.handshake, ev_time() - c->start);
+
+		if (workload == workload_storm) {
+			conn_close(c);
+			conn_start(c);
+		}
+		else {
+			c->state = conn_established;
+			res.established ++;
+			conn_watch(c, workload == workload_bulk ?
+					EV_READ|EV_WRITE : EV_READ);
+		}
+		break;
+	case conn_established:
+		if (revents & EV_READ) {
+			if ((r = read(c->fd, rbuf, sizeof(rbuf))) == -1 &&
+					(errno == EAGAIN || errno == EINTR)) {
+				r = 0;
+			}
+			else if (r <= 0) {
+				res.established --;
+				conn_fail(c);
+				return;
+			}
+
+			res.bytes_received += r;
+		}
+		if (revents & EV_WRITE) {
+			if ((r = write(c->fd, payload, chunk)) == -1) {
+				if (errno != EAGAIN && errno != EINTR) {
+					res.established --;
+					conn_fail(c);
+				}
+				return;
+			}
+
+			res.bytes_sent += r;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+conn_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct load_conn *c = w->data;
+
+	conn_start(c);
+}
+
+static void
+conn_start(struct load_conn *c)
+{
+	c->name = pick_name();
+	c->start = ev_time();
+
+	if ((c->fd = socket(target->ai_family, SOCK_STREAM, 0)) == -1) {
+		conn_fail(c);
+		return;
+	}
+
+	set_nonblock(c->fd);
+	c->state = conn_connecting;
+
+	if (connect(c->fd, target->ai_addr, target->ai_addrlen) == -1 &&
+			errno != EINPROGRESS) {
+		conn_fail(c);
+		return;
+	}
+
+	ev_io_set(&c->io, c->fd, EV_WRITE);
+	ev_io_start(c->loop, &c->io);
+}
+
+static void
+stop_cb(EV_P_ ev_timer *w, int revents)
+{
+	running = false;
+	ev_break(loop, EVBREAK_ALL);
+}
+
+/* Runs the workload with `n` connections in this process */
+static void
+load_run(int n)
+{
+	struct ev_loop *loop;
+	struct load_conn *conns;
+	ev_timer stop;
+	ev_tstamp start;
+	int i;
+
+	loop = ev_loop_new(EVFLAG_AUTO);
+	conns = xmalloc0(sizeof(*conns) * n);
+	payload = xmalloc0(chunk);
+	running = true;
+	start = ev_time();
+
+	for (i = 0; i < n; i ++) {
+		conns[i].loop = loop;
+		conns[i].fd = -1;
+		ev_io_init(&conns[i].io, conn_io_cb, -1, EV_WRITE);
+		conns[i].io.data = &conns[i];
+		ev_timer_init(&conns[i].tm, conn_timer_cb, 0.0, 0.0);
+		conns[i].tm.data = &conns[i];
+		conn_start(&conns[i]);
+	}
+
+	ev_timer_init(&stop, stop_cb, duration, 0.0);
+	ev_timer_start(loop, &stop);
+	ev_run(loop, 0);
+	res.elapsed = ev_time() - start;
+
+	for (i = 0; i < n; i ++) {
+		conn_close(&conns[i]);
+	}
+
+	free(conns);
+	free(payload);
+	ev_loop_destroy(loop);
+}
+
+static bool
+write_full(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t r;
+
+	while (len > 0) {
+		if ((r = write(fd, p, len)) <= 0) {
+			if (r == -1 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		p += r;
+		len -= r;
+	}
+
+	return true;
+}
+
+static bool
+read_full(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t r;
+
+	while (len > 0) {
+		if ((r = read(fd, p, len)) <= 0) {
+			if (r == -1 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		p += r;
+		len -= r;
+	}
+
+	return true;
+}
+
+static void
+samples_send(int fd, const struct load_samples *s)
+{
+	write_full(fd, &s->n, sizeof(s->n));
+	write_full(fd, s->v, s->n * sizeof(*s->v));
+}
+
+static bool
+samples_recv(int fd, struct load_samples *s)
+{
+	size_t n;
+
+	if (!read_full(fd, &n, sizeof(n))) {
+		return false;
+	}
+
+	s->v = xrealloc(s->v, (s->n + n + 1) * sizeof(*s->v));
+	s->size = s->n + n + 1;
+
+	if (!read_full(fd, s->v + s->n, n * sizeof(*s->v))) {
+		return false;
+	}
+
+	s->n += n;
+
+	return true;
+}
+
+/* Workers report their counters and samples through pipes */
+static bool
+load_fork(void)
+{
+	struct load_result part;
+	pid_t pid;
+	int i, status, *fds;
+	int fd[2];
+	bool ok = true;
+
+	fds = xmalloc(sizeof(*fds) * nprocs);
+
+	for (i = 0; i < nprocs; i ++) {
+		if (pipe(fd) == -1 || (pid = fork()) == -1) {
+			perror("fork");
+			exit(EXIT_FAILURE);
+		}
+
+		if (pid == 0) {
+			close(fd[0]);
+			load_run(concurrency / nprocs + (i < concurrency % nprocs));
+			write_full(fd[1], &res, sizeof(res));
+			samples_send(fd[1], &res.connect);
+			samples_send(fd[1], &res.handshake);
+			_exit(EXIT_SUCCESS);
+		}
+
+		close(fd[1]);
+		fds[i] = fd[0];
+	}
+
+	for (i = 0; i < nprocs; i ++) {
+		if (!read_full(fds[i], &part, sizeof(part)) ||
+				!samples_recv(fds[i], &res.connect) ||
+				!samples_recv(fds[i], &res.handshake)) {
+			fprintf(stderr, "worker %d failed\n", i);
+			ok = false;
+		}
+		else {
+			res.connections += part.connections;
+			res.errors += part.errors;
+			res.dropped += part.dropped;
+			res.established += part.established;
+			res.bytes_sent += part.bytes_sent;
+			res.bytes_received += part.bytes_received;
+
+			if (part.elapsed > res.elapsed) {
+				res.elapsed = part.elapsed;
+			}
+		}
+
+		close(fds[i]);
+	}
+
+	while (wait(&status) > 0);
+	free(fds);
+
+	return ok;
+}
+
+static void
+json_str(const char *key, const char *s)
+{
+	printf("  \"%s\": \"", key);
+
+	for (; *s; s ++) {
+		if (*s == '"' || *s == '\\') {
+			putchar('\\');
+		}
+		if ((unsigned char)*s >= 0x20) {
+			putchar(*s);
+		}
+	}
+
+	printf("\",\n");
+}
+
+static void
+json_samples(const char *key, struct load_samples *s, bool last)
+{
+	static const double q[] = {0.5, 0.9, 0.99, 0.999};
+	static const char *qn[] = {"p50", "p90", "p99", "p999"};
+	unsigned i;
+
+	printf("  \"%s_ms\": {\"count\": %zu", key, s->n);
+
+	if (s->n > 0) {
+		qsort(s->v, s->n, sizeof(*s->v), samples_cmp);
+
+		for (i = 0; i < sizeof(q) / sizeof(q[0]); i ++) {
+			printf(", \"%s\": %.3f", qn[i],
+					s->v[(size_t)((s->n - 1) * q[i])] / 1e3);
+		}
+
+		printf(", \"max\": %.3f", s->v[s->n - 1] / 1e3);
+	}
+
+	printf("}%s\n", last ? "" : ",");
+}
+
+static void
+report(void)
+{
+	double t = res.elapsed > 0 ? res.elapsed : 1;
+	unsigned i;
+
+	printf("{\n");
+	json_str("label", label);
+	json_str("workload", workload_names[workload]);
+	json_str("target", target_name);
+	json_str("hello", shape->name);
+	printf("  \"names\": [");
+
+	for (i = 0; i < nnames; i ++) {
+		printf("%s{\"name\": \"%s\", \"weight\": %u, \"bytes\": %zu}",
+				i ? ", " : "", names[i].name ? names[i].name : "",
+				names[i].weight, names[i].len);
+	}
+
+	printf("],\n");
+	printf("  \"processes\": %d,\n", nprocs);
+	printf("  \"concurrency\": %d,\n", concurrency);
+	printf("  \"duration\": %.3f,\n", t);
+	printf("  \"connections\": %llu,\n", (unsigned long long)res.connections);
+	printf("  \"connections_per_sec\": %.1f,\n", res.connections / t);
+	printf("  \"errors\": %llu,\n", (unsigned long long)res.errors);
+	printf("  \"established\": %llu,\n", (unsigned long long)res.established);
+	printf("  \"dropped\": %llu,\n", (unsigned long long)res.dropped);
+	printf("  \"bytes_sent\": %llu,\n", (unsigned long long)res.bytes_sent);
+	printf("  \"bytes_received\": %llu,\n",
+			(unsigned long long)res.bytes_received);
+	printf("  \"mbit_sent\": %.1f,\n", res.bytes_sent * 8 / t / 1e6);
+	printf("  \"mbit_received\": %.1f,\n", res.bytes_received * 8 / t / 1e6);
+	json_samples("connect", &res.connect, false);
+	json_samples("handshake", &res.handshake, true);
+	printf("}\n");
+}
+
+static void
+sink_close(struct ev_loop *loop, struct sink_conn *c)
+{
+	ev_io_stop(loop, &c->io);
+	close(c->fd);
+	free(c);
+}
+
+static void
+sink_io_cb(EV_P_ ev_io *w, int revents)
+{
+	struct sink_conn *c = w->data;
+	ssize_t r;
+
+	if (c->off < c->len) {
+		/* Echo that did not fit into the socket */
+		if ((r = write(c->fd, c->buf + c->off, c->len - c->off)) == -1) {
+			if (errno != EAGAIN && errno != EINTR) {
+				sink_close(loop, c);
+			}
+			return;
+		}
+
+		c->off += r;
+
+		if (c->off == c->len) {
+			c->off = c->len = 0;
+			ev_io_stop(loop, w);
+			ev_io_set(w, c->fd, EV_READ);
+			ev_io_start(loop, w);
+		}
+
+		return;
+	}
+
+	if ((r = read(c->fd, c->buf, sizeof(c->buf))) == -1 &&
+			(errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+	if (r <= 0) {
+		sink_close(loop, c);
+		return;
+	}
+
+	if (backend_sink) {
+		if (!c->replied) {
+			c->replied = true;
+			(void)write(c->fd, sink_reply, sizeof(sink_reply));
+		}
+		return;
+	}
+
+	c->len = r;
+
+	if ((r = write(c->fd, c->buf, c->len)) == -1) {
+		if (errno != EAGAIN && errno != EINTR) {
+			sink_close(loop, c);
+			return;
+		}
+		r = 0;
+	}
+
+	if ((size_t)r == c->len) {
+		c->len = 0;
+	}
+	else {
+		/* Wait for the peer before reading more */
+		c->off = r;
+		ev_io_stop(loop, w);
+		ev_io_set(w, c->fd, EV_WRITE);
+		ev_io_start(loop, w);
+	}
+}
+
+static void
+sink_accept_cb(EV_P_ ev_io *w, int revents)
+{
+	struct sink_conn *c;
+	int fd;
+
+	while ((fd = accept(w->fd, NULL, NULL)) != -1) {
+		set_nonblock(fd);
+		c = xmalloc0(sizeof(*c));
+		c->fd = fd;
+		ev_io_init(&c->io, sink_io_cb, fd, EV_READ);
+		c->io.data = c;
+		ev_io_start(loop, &c->io);
+	}
+}
+
+static void
+backend_run(void)
+{
+	struct ev_loop *loop;
+	ev_io accept_io;
+	int fd, on = 1;
+
+	if ((fd = socket(target->ai_family, SOCK_STREAM, 0)) == -1) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+	set_nonblock(fd);
+
+	if (bind(fd, target->ai_addr, target->ai_addrlen) == -1 ||
+			listen(fd, -1) == -1) {
+		fprintf(stderr, "cannot listen on %s: %s\n", target_name,
+				strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	loop = ev_loop_new(EVFLAG_AUTO);
+	ev_io_init(&accept_io, sink_accept_cb, fd, EV_READ);
+	ev_io_start(loop, &accept_io);
+	ev_run(loop, 0);
+}
+
+static void
+backend_fork(void)
+{
+	int i, status;
+
+	for (i = 1; i < nprocs; i ++) {
+		if (fork() == 0) {
+			backend_run();
+			_exit(EXIT_SUCCESS);
+		}
+	}
+
+	backend_run();
+
+	while (wait(&status) > 0);
+}
+
+static void
+add_name(const char *arg)
+{
+	struct load_name *n;
+	char *s, *p;
+
+	s = strdup(arg);
+	names = xrealloc(names, sizeof(*names) * (nnames + 1));
+	n = &names[nnames ++];
+	memset(n, 0, sizeof(*n));
+	n->weight = 1;
+
+	if ((p = strrchr(s, ':')) != NULL) {
+		*p = '\0';
+		n->weight = strtoul(p + 1, NULL, 10);
+	}
+
+	/* "-" sends a ClientHello without SNI */
+	n->name = strcmp(s, "-") == 0 ? NULL : s;
+	total_weight += n->weight;
+}
+
+static void
+usage(const char *error)
+{
+	if (error) {
+		fprintf(stderr, "%s\n", error);
+	}
+
+	fprintf(stderr, "usage:"
+		"\tsni-load [-w storm|bulk|idle] [-c connections] [-d seconds]\n"
+		"\t\t[-p processes] [-n name[:weight]]... [-k hello] [-s bytes]\n"
+		"\t\t[-l label] host:port\n"
+		"\tsni-load -B [-m echo|sink] [-p processes] host:port\n");
+
+	exit(error ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct addrinfo hints;
+	struct rlimit rl;
+	char *host, *port;
+	bool backend = false;
+	unsigned i, records;
+	int ch, r;
+
+	shape = hello_shape_find("chrome-pq");
+
+	while ((ch = getopt(argc, argv, "Bm:w:c:d:p:n:k:s:l:h")) != -1) {
+		switch (ch) {
+		case 'B':
+			backend = true;
+			break;
+		case 'm':
+			backend_sink = strcmp(optarg, "sink") == 0;
+			break;
+		case 'w':
+			for (i = 0; i < 3; i ++) {
+				if (strcmp(optarg, workload_names[i]) == 0) {
+					break;
+				}
+			}
+			if (i == 3) {
+				usage("unknown workload");
+			}
+			workload = i;
+			break;
+		case 'c':
+			concurrency = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			duration = strtod(optarg, NULL);
+			break;
+		case 'p':
+			nprocs = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			add_name(optarg);
+			break;
+		case 'k':
+			if ((shape = hello_shape_find(optarg)) == NULL) {
+				usage("unknown hello shape");
+			}
+			break;
+		case 's':
+			chunk = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		case 'h':
+		default:
+			usage(NULL);
+			break;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage("target is required");
+	}
+	if (concurrency <= 0 || nprocs <= 0 || duration <= 0 || chunk == 0) {
+		usage("invalid argument");
+	}
+
+	/* host:port or [v6]:port */
+	target_name = argv[optind];
+	host = strdup(target_name);
+
+	if ((port = strrchr(host, ':')) == NULL) {
+		usage("port is required");
+	}
+
+	*port ++ = '\0';
+
+	if (host[0] == '[') {
+		host ++;
+		host[strlen(host) - 1] = '\0';
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+
+	if ((r = getaddrinfo(host, port, &hints, &target)) != 0) {
+		fprintf(stderr, "%s: %s\n", target_name, gai_strerror(r));
+		exit(EXIT_FAILURE);
+	}
+
+	/* Idle workloads need many descriptors */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (backend) {
+		backend_fork();
+		return 0;
+	}
+
+	if (nnames == 0) {
+		add_name("www.example.com");
+	}
+
+	for (i = 0; i < nnames; i ++) {
+		names[i].hello = xmalloc(HELLO_GEN_MAX);
+		names[i].len = hello_generate(shape, names[i].name, names[i].hello,
+				&records);
+	}
+
+	if (total_weight == 0) {
+		usage("names have no weight");
+	}
+
+	if (nprocs == 1) {
+		load_run(concurrency);
+	}
+	else if (!load_fork()) {
+		exit(EXIT_FAILURE);
+	}
+
+	report();
+	fprintf(stderr, "%s: %llu handshakes, %.1f/s, %llu errors, "
+			"%.1f Mbit/s sent, %.1f Mbit/s received\n",
+			workload_names[workload], (unsigned long long)res.connections,
+			res.connections / res.elapsed, (unsigned long long)res.errors,
+			res.bytes_sent * 8 / res.elapsed / 1e6,
+			res.bytes_received * 8 / res.elapsed / 1e6);
+
+	return 0;
+}
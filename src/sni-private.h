@@ -25,20 +25,156 @@
 #ifndef SNI_PRIVATE_H_
 #define SNI_PRIVATE_H_
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
 #include "ev.h"
 #include "ucl.h"
 #include "ringbuf.h"
+#include "dns.h"
+#include "hello.h"
+#include "wheel.h"
+
+/* Kernel pipe used by the splice engine instead of a ringbuf */
+struct proxy_pipe {
+	int fds[2];
+	int len;
+	int size;
+	/* Out of buffer slots, which small segments use up before bytes */
+	bool full;
+};
+
+struct uring_session;
+struct route_table;
+struct routedb;
+struct dns_addrs;
+struct dns_query;
+struct sni_upstream;
+struct sni_maglev;
+struct sni_connect;
+struct sni_warm;
+struct sni_backend_stats;
+
+/*
+ * Single backend address. Peers are shared by the backend's peer list and
+ * by sessions connected to them, so they survive address refreshes
+ */
+struct sni_peer {
+	union sni_sockaddr addr;
+	struct sni_upstream *up;
+	/* Time the peer appeared, 0 for peers known since startup */
+	ev_tstamp since;
+	/* Smooth weighted round robin state */
+	double current;
+	unsigned ref;
+	unsigned active;
+	/* Health state, see health.c */
+	ev_timer health_tm;
+	ev_io probe_io;
+	int probe_fd;
+	unsigned fails;
+	unsigned ejections;
+	bool down;
+	bool listed;
+	/* Pre-connected sockets, see connect.c */
+	struct sni_warm *warm;
+	unsigned nwarm;
+};
 
+/* Host of a backend, resolved and refreshed on its own */
+struct sni_upstream {
+	struct sni_backend *bk;
+	char *host;
+	struct dns_addrs *addrs;
+	struct dns_query *query;
+	ev_timer refresh;
+	int port;
+	unsigned weight;
+	unsigned failures;
+	enum {
+		upstream_unresolved = 0,
+		upstream_resolving,
+		upstream_ready,
+		upstream_failed
+	} state;
+};
+
+/* Backend selected by a server name */
+struct sni_backend {
+	char *name;
+	struct sni_upstream *upstreams;
+	unsigned nupstreams;
+	/* Addresses of all upstreams, rebuilt when any of them changes */
+	struct sni_peer **peers;
+	unsigned npeers;
+	unsigned rr;
+	/* Consistent hash lookup table, the next one is built in background */
+	struct sni_maglev *maglev;
+	struct sni_maglev *maglev_next;
+	/* Sessions waiting for the first resolution */
+	struct ssl_session *waiting;
+	/* Listed peers that are ejected */
+	unsigned ndown;
+	double slow_start;
+	/* Active checks, 0 interval disables them */
+	double health_interval;
+	double health_timeout;
+	/* Consecutive failures to eject a peer and the first ejection time */
+	unsigned max_fails;
+	double fail_timeout;
+	/* Idle connections kept per peer and their lifetime */
+	unsigned warm_connections;
+	double warm_timeout;
+	int max_buffer;
+	/* Counters in the metrics of this process, see backend_stats() */
+	struct sni_backend_stats *stats;
+	enum {
+		balance_round_robin = 0,
+		balance_least_conn,
+		balance_p2c,
+		balance_maglev
+	} balance;
+	enum {
+		backend_unloaded = 0,
+		backend_resolving,
+		backend_ready,
+		backend_failed
+	} state;
+	bool loaded;
+	/* Routes are replaced, only their remaining sessions use the backend */
+	bool retired;
+};
+
+/*
+ * Routing table maps names to indexes in `backends`. The table is immutable
+ * once created; backends from a routing database are loaded on first use.
+ * A reload replaces the routes of a process as a whole: sessions hold a
+ * reference to the routes they were accepted with, and replaced routes are
+ * freed when the last of them ends
+ */
+struct sni_routes {
+	const struct route_table *table;
+	struct route_table *own_table;
+	struct routedb *db;
+	struct sni_backend *backends;
+	unsigned nbackends;
+	uint32_t default_backend;
+	unsigned ref;
+	bool retired;
+	struct sni_routes *next_retired;
+};
+
+/*
+ * Fields used on every IO event go first, so they share the first cache
+ * lines with the libev watchers; greeting and bookkeeping data follows
+ */
 struct ssl_session {
-	const ucl_object_t *backends;
-	ev_io io;
-	ev_io bk_io;
-	ev_timer tm;
 	struct ev_loop *loop;
-	char *hostname;
-	struct ringbuf *cl2bk;
-	struct ringbuf *bk2cl;
-	unsigned hostlen;
+	int fd;
+	int bk_fd;
 	enum {
 		ssl_state_init = 0,
 		ssl_state_alert,
@@ -50,14 +186,304 @@ struct ssl_session {
 		ssl_state_proxy_peer_closed,
 		ssl_state_proxy_both_closed
 	} state;
-	int fd;
-	int bk_fd;
+	bool spliced;
+	bool uring;
+	bool parked;
+	bool client_hashed;
+	bool bk_replied;
+	/* State the session is counted in, see session_account() */
+	unsigned char stat_state;
+	struct ringbuf cl2bk;
+	struct ringbuf bk2cl;
+	ev_io io;
+	ev_io bk_io;
+	/* Handshake, idle or half-close timeout, see session_timeout() */
+	struct wheel_timer tm;
+	struct proxy_pipe cl2bk_pipe;
+	struct proxy_pipe bk2cl_pipe;
+	struct uring_session *ur;
+	struct ssl_session *park_next;
+	struct ssl_session *park_prev;
+	struct sni_routes *routes;
+	struct sni_backend *backend;
+	struct sni_peer *peer;
+	struct ssl_session *wait_next;
+	/* Connect attempts in progress */
+	struct sni_connect *conn;
+	/* Counters of the selected backend, a sink before selection */
+	struct sni_backend_stats *bk_stats;
+	/* Monotonic accept time and phase ends, microseconds after accept */
+	uint64_t t_accept;
+	uint32_t t_hello;
+	uint32_t t_connected;
+	uint32_t t_replied;
+	int max_buffer;
+	/* ClientHello parser state, the greeting accumulates in cl2bk */
+	struct tls_hello hello;
+	/* Hash of the client address for consistent hashing */
+	uint32_t client_hash;
 	uint8_t ssl_version[2];
-	uint8_t *saved_buf;
-	int buflen;
+	char hostname[256];
 };
 
+extern bool cpu_affinity;
+extern bool use_splice;
+extern bool buffer_hugepages;
+extern int buffer_min;
+extern size_t memory_limit;
+extern bool use_io_uring;
+extern int uring_entries;
+extern int uring_buffers;
+extern const char *dns_server;
+extern double dns_timeout;
+extern int dns_min_ttl;
+extern int dns_max_ttl;
+extern int resolve_parallel;
+extern bool lazy_resolve;
+extern double connect_timeout;
+extern double connect_delay;
+extern int connect_tries;
+/* Peers a connect can remember, the bound of connect_tries */
+#define CONNECT_MAX_TRIES 16
+extern int tcp_fastopen;
+extern int listen_backlog;
+extern int accept_batch;
+extern int defer_accept;
+extern double handshake_timeout;
+extern double idle_timeout;
+extern double half_close_timeout;
+extern bool backend_fastopen;
+
+extern const char *metrics_addr;
+extern unsigned metrics_backends;
+extern double slow_session;
+extern const char *upgrade_socket;
+extern double drain_timeout;
+
+/*
+ * Counters of a worker, written by its loop only and read by the process
+ * serving metrics. Each worker has its own cache line aligned slot in
+ * shared memory, so updates are plain increments
+ */
+struct sni_stats {
+	uint64_t accepts;
+	uint64_t accept_errors;
+	uint64_t alerts;
+	/* Server names without a backend */
+	uint64_t unknown_names;
+	/* Finished sessions */
+	uint64_t sessions;
+	uint64_t bytes_cl2bk;
+	uint64_t bytes_bk2cl;
+	/* Connect attempts to peers and failed ones */
+	uint64_t connects;
+	uint64_t connect_failures;
+	/* Sessions given a pre-connected socket */
+	uint64_t warm_hits;
+	/* ClientHello sent in the SYN with a cached cookie */
+	uint64_t tfo_syn_data;
+	/* No cookie yet, the SYN requested one */
+	uint64_t tfo_no_cookie;
+	/* Data in the SYN was accepted by the backend */
+	uint64_t tfo_acked;
+	/* Backends with counters, see backend_stats() */
+	uint32_t nbackends;
+	/* Sessions by state */
+	int64_t states[ssl_state_proxy_both_closed + 1];
+};
+
+/*
+ * Session phases: accept to ClientHello parsed, to backend connected, to
+ * the first byte from the backend, and accept to close
+ */
+enum sni_phase {
+	phase_hello = 0,
+	phase_connect,
+	phase_reply,
+	phase_session,
+	phase_max
+};
+
+/* Two buckets per power of two from 128 us to 33 s, and an overflow one */
+#define LATENCY_BUCKETS 38
+
+/* Per backend counters of a worker, summed over workers when served */
+struct sni_backend_stats {
+	uint64_t sessions;
+	uint64_t bytes_cl2bk;
+	uint64_t bytes_bk2cl;
+	uint64_t connect_failures;
+	uint64_t ejections;
+	int64_t active;
+	/* Phase durations: a histogram and the sum in microseconds */
+	uint64_t latency[phase_max][LATENCY_BUCKETS];
+	uint64_t latency_sum[phase_max];
+};
+
+extern struct sni_stats *stats;
+
+static inline uint64_t
+session_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Moves the session between state gauges if its state has changed */
+static inline void
+session_account(struct ssl_session *ssl)
+{
+	unsigned st = ssl->state;
+
+	/* Closing can step past both_closed */
+	if (st > ssl_state_proxy_both_closed) {
+		st = ssl_state_proxy_both_closed;
+	}
+
+	if (st != ssl->stat_state) {
+		stats->states[ssl->stat_state] --;
+		stats->states[st] ++;
+		ssl->stat_state = st;
+	}
+}
+
+/* Session timeouts of the process, one wheel per loop */
+extern struct wheel session_wheel;
+
+/* Data has moved, postpones an idle timeout */
+static inline void
+session_touch(struct ssl_session *ssl)
+{
+	wheel_touch(&session_wheel, &ssl->tm);
+}
+
 void send_alert(struct ssl_session *ssl);
+/*
+ * Terminates the session in `after` seconds, or after `after` seconds
+ * without data if `idle`; 0 removes the timeout
+ */
+void session_timeout(struct ssl_session *ssl, double after, bool idle);
 void terminate_session(struct ssl_session *ssl);
+/* Parses the greeting received so far, true if more is needed */
+bool parse_ssl_greeting(struct ssl_session *ssl);
+/* Greeting does not fit, `err` is ENOBUFS or EMSGSIZE as set by proxy */
+void greeting_overflow(struct ssl_session *ssl, int err);
+/* `sa` is the client address or NULL if accept did not return it */
+struct ssl_session *session_create(struct ev_loop *loop, int nfd,
+		const union sni_sockaddr *sa);
+uint32_t session_client_hash(struct ssl_session *ssl);
+size_t session_size(void);
+/* Receives the greeting into cl2bk, returns as read(2) */
+ssize_t proxy_read_greeting(struct ssl_session *s);
+/* Appends greeting bytes received elsewhere, returns as write(2) */
+ssize_t proxy_add_greeting(struct ssl_session *s, const uint8_t *buf,
+		size_t len);
+/* Stops reading the greeting until buffer memory is released */
+void proxy_park_greeting(struct ssl_session *s);
+/* Backend is selected, sets up buffers for its window */
+void proxy_save_greeting(struct ssl_session *s);
+void proxy_create(struct ssl_session *s);
+void proxy_destroy(struct ssl_session *s);
+/* Connects to the backend, racing and failing over between its peers */
+void connect_backend(struct ssl_session *ssl);
+void connect_cancel(struct ssl_session *ssl);
+void connect_start(struct ev_loop *loop);
+/* Keeps `warm_connections` idle connections to a listed peer */
+void peer_pool_start(struct sni_peer *peer);
+void peer_pool_stop(struct sni_peer *peer);
+
+/* Takes a listening socket passed on upgrade, before listen_prepare() */
+bool listen_adopt(int sock);
+/* Opens `nsets` sockets per address of `port`, reusing the adopted ones */
+bool listen_prepare(int port, unsigned nsets);
+/* Accepts in worker `idx` of `nworkers` on its share of the sockets */
+bool listen_start(struct ev_loop *loop, unsigned idx, unsigned nworkers);
+/* Copies up to `max` listening sockets, returns their number */
+unsigned listen_fds(int *fds, unsigned max);
+/* Stops accepting and closes the listening sockets of this process */
+void listen_stop(struct ev_loop *loop);
+/* Stops accepting, ends the loop when sessions are done or drain_timeout */
+void listen_drain(struct ev_loop *loop);
+/* Drains this process on SIGQUIT */
+void listen_quit_start(struct ev_loop *loop);
+bool start_workers(struct ev_loop *loop, int n, struct sni_routes *routes);
+/* Drains workers and exits after them, false if there are no workers */
+bool workers_drain(struct ev_loop *loop);
+
+/* Takes the sockets of the running process, see upgrade.c */
+bool upgrade_receive(void);
+/* Tells the previous process to stop accepting */
+void upgrade_ready(void);
+/* Passes sockets to a new binary on request, starts one on SIGUSR2 */
+bool upgrade_listen(struct ev_loop *loop, char **argv);
+
+struct sni_routes* routes_create(const ucl_object_t *obj);
+struct sni_routes* routes_open_db(const char *path);
+/* Largest max_buffer of the backends, 0 if none is set */
+int routes_max_buffer(const struct sni_routes *routes);
+/* Resolves all backends, runs the loop until done */
+bool routes_resolve(struct ev_loop *loop, struct sni_routes *routes);
+/* Starts address refresh in the current process, routes become current */
+bool routes_start(struct ev_loop *loop, struct sni_routes *routes);
+/* Replaces the current routes once they are resolved */
+void routes_update(struct sni_routes *routes);
+/* Current routes for a new session, and their release */
+struct sni_routes* routes_acquire(void);
+void routes_release(struct sni_routes *routes);
+/* Parses the configuration file again, NULL if its routes are invalid */
+struct sni_routes* config_load_routes(void);
+/* Installs routes of the configuration file on SIGHUP */
+void config_reload_start(struct ev_loop *loop);
+struct sni_backend* routes_lookup(const struct sni_routes *routes,
+		const char *name, size_t len);
+/* Connects the session when the backend has addresses */
+void backend_select(struct ssl_session *ssl, struct sni_backend *bk);
+/* Picks a peer according to the balancing method, takes a reference */
+struct sni_peer* backend_pick(struct ssl_session *ssl);
+/* Another peer for a new attempt, preferring `family` if not AF_UNSPEC */
+struct sni_peer* backend_pick_next(struct sni_backend *bk,
+		struct sni_peer *const *tried, unsigned ntried, int family);
+void peer_release(struct sni_peer *peer);
+
+void health_start(struct ev_loop *loop);
+void peer_health_init(struct sni_peer *peer);
+/* Starts active checks of a listed peer */
+void peer_health_start(struct sni_peer *peer);
+/* Called when a peer leaves the backend's list */
+void peer_health_stop(struct sni_peer *peer);
+/* Passive checks: a failed connect or reset, or data from the backend */
+void peer_report(struct sni_peer *peer, bool ok);
+void session_backend_error(struct ssl_session *ssl, int err);
+void session_backend_replied(struct ssl_session *ssl);
+void routes_destroy(struct sni_routes *routes);
+
+/* Allocates counters shared with `nworkers` workers, before forking */
+void metrics_init(int nworkers);
+/* Switches the process to the counters of worker `idx` */
+void metrics_worker(int idx);
+/* Counters of a backend, a sink for backends that are not counted */
+struct sni_backend_stats* backend_stats(struct sni_backend *bk);
+/* Ends a phase of the session, logs it if the handshake is slow */
+void session_phase(struct ssl_session *ssl, enum sni_phase phase);
+/* Serves counters of all workers at `metrics_addr` */
+bool metrics_listen(struct ev_loop *loop);
+/* Takes the metrics socket passed on upgrade, before metrics_listen() */
+void metrics_adopt(int sock);
+/* Listening socket of the metrics server or -1 */
+int metrics_fd(void);
+void metrics_stop(struct ev_loop *loop);
+
+#ifdef HAVE_LIBURING
+bool uring_listen(struct ev_loop *loop, int sock);
+void uring_unlisten(void);
+void uring_connected(struct ssl_session *ssl);
+void uring_send_alert(struct ssl_session *ssl, const void *data, size_t len);
+bool uring_release(struct ssl_session *ssl);
+/* Stores a received greeting segment, again once memory is released */
+void uring_greet_add(struct ssl_session *ssl);
+#endif
 
 #endif /* SNI_PRIVATE_H_ */
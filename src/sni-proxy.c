@@ -40,83 +40,159 @@
 #include "ev.h"
 #include "ucl.h"
 #include "util.h"
-
-static const int default_backend_port = 443;
+#include "route.h"
+#include "sni-private.h"
 
 int buflen = 16384;
+bool cpu_affinity = false;
+bool use_splice = false;
+bool buffer_hugepages = false;
+int buffer_min = 4096;
+size_t memory_limit = 0;
+bool use_io_uring = false;
+int uring_entries = 4096;
+int uring_buffers = 4096;
+const char *dns_server = NULL;
+double dns_timeout = 2.0;
+int dns_min_ttl = 5;
+int dns_max_ttl = 3600;
+int resolve_parallel = 64;
+bool lazy_resolve = false;
+double connect_timeout = 5.0;
+double connect_delay = 0.25;
+int connect_tries = 3;
+int tcp_fastopen = 0;
+int listen_backlog = 4096;
+int accept_batch = 64;
+int defer_accept = 0;
+double handshake_timeout = 2.0;
+double idle_timeout = 600.0;
+double half_close_timeout = 5.0;
+bool backend_fastopen = false;
+const char *metrics_addr = NULL;
+unsigned metrics_backends = 1024;
+double slow_session = 0;
+const char *upgrade_socket = NULL;
+double drain_timeout = 0;
 static int port = 443;
+static int nworkers = 1;
 static const char *cf_name = "/etc/sni-proxy.conf";
-
-extern bool start_listen(struct ev_loop *loop, int port,
-		const ucl_object_t *backends);
+static ev_tstamp boot_time, phase_time;
+static struct ev_loop *reload_loop;
+static ev_async reload_ev;
 
 static void
-usage(const char *error)
+startup_phase(const char *phase)
 {
-	if (error) {
-		fprintf(stderr, "%s\n", error);
+	ev_tstamp now = ev_time();
+
+	fprintf(stderr, "startup: %s took %.1f ms\n", phase,
+			(now - phase_time) * 1000.0);
+	phase_time = now;
+}
+
+/* Routes from the `backends` section or the routing database */
+static struct sni_routes *
+config_routes(const ucl_object_t *cfg)
+{
+	const ucl_object_t *elt;
+
+	elt = ucl_object_find_key(cfg, "routes_db");
+	if (elt) {
+		if (ucl_object_find_key(cfg, "backends") != NULL) {
+			fprintf(stderr, "backends are ignored with routes_db\n");
+		}
+
+		return routes_open_db(ucl_object_tostring(elt));
 	}
 
-	fprintf(stderr, "usage:"
-	    "\tsni-proxy  [-c config] [-b buflen] [-h]\n");
+	return routes_create(ucl_object_find_key(cfg, "backends"));
+}
 
-	if (error) {
-		exit(EXIT_FAILURE);
+/* Only routes are reloaded, other settings need a restart */
+struct sni_routes*
+config_load_routes(void)
+{
+	struct ucl_parser *parser;
+	ucl_object_t *cfg;
+	struct sni_routes *routes;
+
+	parser = ucl_parser_new(0);
+
+	if (!ucl_parser_add_file(parser, cf_name)) {
+		fprintf(stderr, "reload: cannot open file %s: %s\n", cf_name,
+				ucl_parser_get_error(parser));
+		ucl_parser_free(parser);
+		return NULL;
 	}
-	else {
-		exit(EXIT_SUCCESS);
+
+	cfg = ucl_parser_get_object(parser);
+	ucl_parser_free(parser);
+	routes = config_routes(cfg);
+	ucl_object_unref(cfg);
+
+	if (routes == NULL) {
+		fprintf(stderr, "reload: invalid or absent backends configuration, "
+				"keeping the previous one\n");
 	}
+
+	return routes;
 }
 
-static bool
-backends_sane(ucl_object_t *obj)
+static void
+reload_signal(int sig)
 {
-	ucl_object_iter_t it = NULL;
-	const ucl_object_t *cur, *elt;
-	struct addrinfo ai, *res;
-	int port = default_backend_port, ret;
-	ucl_object_t *be, *ai_obj;
-
-	memset(&ai, 0, sizeof(ai));
-
-	ai.ai_family = AF_UNSPEC;
-	ai.ai_socktype = SOCK_STREAM;
-	ai.ai_flags = AI_NUMERICSERV;
-
-	while ((cur = ucl_iterate_object(obj, &it, true))) {
-		be = ucl_object_ref(cur);
-		elt = ucl_object_find_key(cur, "port");
-
-		if (elt != NULL) {
-			port = ucl_object_toint(elt);
-			if (port <= 0 || port > 65535) {
-				return false;
-			}
-		}
+	ev_async_send(reload_loop, &reload_ev);
+}
 
-		elt = ucl_object_find_key(cur, "host");
+static void
+reload_cb(EV_P_ ev_async *w, int revents)
+{
+	struct sni_routes *routes;
 
-		if (elt == NULL) {
-			return false;
-		}
+	routes = config_load_routes();
 
-		res = NULL;
-		if ((ret = getaddrinfo(ucl_object_tostring(elt), port_to_str(port),
-				&ai, &res)) != 0) {
-			fprintf(stderr, "bad backend: %s:%d: %s\n", ucl_object_tostring(elt),
-					port, gai_strerror(ret));
-			return false;
-		}
+	if (routes != NULL) {
+		routes_update(routes);
+	}
+}
+
+/*
+ * Reloads routes of this process on SIGHUP. Not an ev_signal, as workers
+ * inherit the master's libev signal state with its own loop
+ */
+void
+config_reload_start(struct ev_loop *loop)
+{
+	struct sigaction sa;
 
-		/* Insert addrinfo as userdata */
-		ai_obj = ucl_object_typed_new(UCL_USERDATA);
-		ai_obj->value.ud = res;
+	reload_loop = loop;
+	ev_async_init(&reload_ev, reload_cb);
+	ev_async_start(loop, &reload_ev);
 
-		ucl_object_insert_key(be, ai_obj, "ai", 0, false);
-		ucl_object_unref(be);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = reload_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGHUP, &sa, NULL);
+}
+
+static void
+usage(const char *error)
+{
+	if (error) {
+		fprintf(stderr, "%s\n", error);
 	}
 
-	return true;
+	fprintf(stderr, "usage:"
+	    "\tsni-proxy  [-c config] [-b buflen] [-w workers] [-u] [-h]\n");
+
+	if (error) {
+		exit(EXIT_FAILURE);
+	}
+	else {
+		exit(EXIT_SUCCESS);
+	}
 }
 
 int
@@ -124,17 +200,24 @@ main(int argc, char **argv) {
 	static struct option long_options[] = {
 			{"config", 	required_argument, 0,  'c' },
 			{"bufsize", 	required_argument, 0,  'b' },
+			{"workers", 	required_argument, 0,  'w' },
+			{"upgrade", 	no_argument, 0,  'u' },
 			{"help", 	no_argument, 0,  'h' },
 			{0,         0,                 0,  0 }
 	};
 	struct ucl_parser *parser;
-	ucl_object_t *cfg, *backends;
+	ucl_object_t *cfg;
+	struct sni_routes *routes;
 	const ucl_object_t *elt;
 	struct ev_loop *loop = EV_DEFAULT;
 
-	char ch;
+	char ch, **orig_argv = argv;
+	int cli_workers = 0, max_buffer;
+	bool upgrade = false, supervise;
+
+	boot_time = phase_time = ev_time();
 
-	while ((ch = getopt_long(argc, argv, "c:hb:", long_options, NULL)) != -1) {
+	while ((ch = getopt_long(argc, argv, "c:hb:w:u", long_options, NULL)) != -1) {
 		switch (ch) {
 		case 'c':
 			cf_name = strdup(optarg);
@@ -142,6 +225,12 @@ main(int argc, char **argv) {
 		case 'b':
 			buflen = strtoul(optarg, NULL, 0);
 			break;
+		case 'w':
+			cli_workers = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			upgrade = true;
+			break;
 		case 'h':
 		default:
 			usage(NULL);
@@ -161,25 +250,300 @@ main(int argc, char **argv) {
 
 	cfg = ucl_parser_get_object(parser);
 	ucl_parser_free(parser);
+	startup_phase("parsing configuration");
 
-	backends = ucl_object_ref(ucl_object_find_key(cfg, "backends"));
+	routes = config_routes(cfg);
 
-	if (backends == NULL || !backends_sane(backends)) {
+	if (routes == NULL) {
 		fprintf(stderr, "invalid or absent backends configuration\n");
 		exit(EXIT_FAILURE);
 	}
 
+	startup_phase("building routes");
+
+	elt = ucl_object_find_key(cfg, "dns_server");
+	if (elt) {
+		dns_server = ucl_object_tostring(elt);
+	}
+
+	elt = ucl_object_find_key(cfg, "dns_timeout");
+	if (elt) {
+		dns_timeout = ucl_object_todouble(elt);
+	}
+
+	elt = ucl_object_find_key(cfg, "dns_min_ttl");
+	if (elt) {
+		dns_min_ttl = ucl_object_toint(elt);
+	}
+
+	elt = ucl_object_find_key(cfg, "dns_max_ttl");
+	if (elt) {
+		dns_max_ttl = ucl_object_toint(elt);
+	}
+	if (dns_min_ttl < 1) {
+		dns_min_ttl = 1;
+	}
+	if (dns_max_ttl < dns_min_ttl) {
+		dns_max_ttl = dns_min_ttl;
+	}
+	if (dns_timeout <= 0) {
+		dns_timeout = 2.0;
+	}
+
+	elt = ucl_object_find_key(cfg, "resolve_parallel");
+	if (elt) {
+		resolve_parallel = ucl_object_toint(elt);
+	}
+	if (resolve_parallel <= 0) {
+		resolve_parallel = 1;
+	}
+
+	elt = ucl_object_find_key(cfg, "lazy_resolve");
+	if (elt) {
+		lazy_resolve = ucl_object_toboolean(elt);
+	}
+
+	elt = ucl_object_find_key(cfg, "connect_timeout");
+	if (elt) {
+		connect_timeout = ucl_object_todouble(elt);
+	}
+	if (connect_timeout <= 0) {
+		connect_timeout = 5.0;
+	}
+
+	elt = ucl_object_find_key(cfg, "connect_delay");
+	if (elt) {
+		connect_delay = ucl_object_todouble(elt);
+	}
+
+	elt = ucl_object_find_key(cfg, "connect_tries");
+	if (elt) {
+		connect_tries = ucl_object_toint(elt);
+	}
+	if (connect_tries <= 0) {
+		connect_tries = 1;
+	}
+	/* Bounded by the attempts a connect can remember */
+	if (connect_tries > CONNECT_MAX_TRIES) {
+		connect_tries = CONNECT_MAX_TRIES;
+	}
+
+	elt = ucl_object_find_key(cfg, "handshake_timeout");
+	if (elt) {
+		handshake_timeout = ucl_object_todouble(elt);
+	}
+	if (handshake_timeout <= 0) {
+		handshake_timeout = 2.0;
+	}
+
+	elt = ucl_object_find_key(cfg, "idle_timeout");
+	if (elt) {
+		idle_timeout = ucl_object_todouble(elt);
+	}
+
+	elt = ucl_object_find_key(cfg, "half_close_timeout");
+	if (elt) {
+		half_close_timeout = ucl_object_todouble(elt);
+	}
+	if (half_close_timeout <= 0) {
+		half_close_timeout = 5.0;
+	}
+
+	elt = ucl_object_find_key(cfg, "tcp_fastopen");
+	if (elt) {
+		tcp_fastopen = ucl_object_toint(elt);
+	}
+
+	elt = ucl_object_find_key(cfg, "listen_backlog");
+	if (elt) {
+		listen_backlog = ucl_object_toint(elt);
+	}
+	if (listen_backlog <= 0) {
+		listen_backlog = 4096;
+	}
+
+	elt = ucl_object_find_key(cfg, "accept_batch");
+	if (elt) {
+		accept_batch = ucl_object_toint(elt);
+	}
+	if (accept_batch <= 0) {
+		accept_batch = 1;
+	}
+
+	elt = ucl_object_find_key(cfg, "defer_accept");
+	if (elt) {
+		defer_accept = ucl_object_toint(elt);
+	}
+
+	elt = ucl_object_find_key(cfg, "backend_fastopen");
+	if (elt) {
+		backend_fastopen = ucl_object_toboolean(elt);
+	}
+
+	/* Lazy backends are resolved by workers when first selected */
+	if (!lazy_resolve) {
+		if (!routes_resolve(loop, routes)) {
+			fprintf(stderr, "cannot resolve backends\n");
+			exit(EXIT_FAILURE);
+		}
+
+		startup_phase("resolving backends");
+	}
+
 	elt = ucl_object_find_key(cfg, "port");
 	if (elt) {
 		port = ucl_object_toint(elt);
 	}
 
+	elt = ucl_object_find_key(cfg, "workers");
+	if (elt) {
+		nworkers = ucl_object_toint(elt);
+	}
+	if (cli_workers > 0) {
+		nworkers = cli_workers;
+	}
+	if (nworkers <= 0) {
+		fprintf(stderr, "invalid number of workers: %d\n", nworkers);
+		exit(EXIT_FAILURE);
+	}
+
+	elt = ucl_object_find_key(cfg, "cpu_affinity");
+	if (elt) {
+		cpu_affinity = ucl_object_toboolean(elt);
+	}
+
+	elt = ucl_object_find_key(cfg, "splice");
+	if (elt) {
+		use_splice = ucl_object_toboolean(elt);
+#ifndef HAVE_SPLICE
+		if (use_splice) {
+			fprintf(stderr, "splice is not supported, using buffered IO\n");
+			use_splice = false;
+		}
+#endif
+	}
+
+	elt = ucl_object_find_key(cfg, "buffer_hugepages");
+	if (elt) {
+		buffer_hugepages = ucl_object_toboolean(elt);
+	}
+
+	elt = ucl_object_find_key(cfg, "buffer_min");
+	if (elt) {
+		buffer_min = ucl_object_toint(elt);
+	}
+	if (buffer_min <= 0 || buffer_min > buflen) {
+		buffer_min = buflen;
+	}
+
+	elt = ucl_object_find_key(cfg, "memory_limit");
+	if (elt) {
+		memory_limit = ucl_object_toint(elt);
+	}
+
+	elt = ucl_object_find_key(cfg, "io_uring");
+	if (elt) {
+		use_io_uring = ucl_object_toboolean(elt);
+#ifndef HAVE_LIBURING
+		if (use_io_uring) {
+			fprintf(stderr, "io_uring support is not compiled in, using libev\n");
+			use_io_uring = false;
+		}
+#endif
+	}
+
+	elt = ucl_object_find_key(cfg, "io_uring_entries");
+	if (elt) {
+		uring_entries = ucl_object_toint(elt);
+	}
+
+	elt = ucl_object_find_key(cfg, "io_uring_buffers");
+	if (elt) {
+		uring_buffers = ucl_object_toint(elt);
+	}
+
+	elt = ucl_object_find_key(cfg, "metrics");
+	if (elt) {
+		metrics_addr = ucl_object_tostring(elt);
+	}
+
+	elt = ucl_object_find_key(cfg, "metrics_backends");
+	if (elt) {
+		metrics_backends = ucl_object_toint(elt);
+	}
+
+	elt = ucl_object_find_key(cfg, "slow_session");
+	if (elt) {
+		slow_session = ucl_object_todouble(elt);
+	}
+
+	elt = ucl_object_find_key(cfg, "upgrade_socket");
+	if (elt) {
+		upgrade_socket = ucl_object_tostring(elt);
+	}
+
+	elt = ucl_object_find_key(cfg, "drain_timeout");
+	if (elt) {
+		drain_timeout = ucl_object_todouble(elt);
+	}
+
+	if (use_io_uring && use_splice) {
+		fprintf(stderr, "splice is ignored with io_uring engine\n");
+		use_splice = false;
+	}
+
+	fprintf(stderr, "%u server names in %zu bytes routing table\n",
+			route_count(routes->table), route_table_size(routes->table));
+	max_buffer = routes_max_buffer(routes);
+	fprintf(stderr, "%zu bytes per session, %d to %d bytes per active "
+			"direction\n", session_size(), buffer_min,
+			max_buffer > buflen ? max_buffer : buflen);
+
 	signal(SIGPIPE, SIG_IGN);
+	metrics_init(nworkers);
+
+	/* The running process keeps accepting until we are ready */
+	if (upgrade && !upgrade_receive()) {
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * Scrapes are served by the master off the workers' loops, so with
+	 * metrics enabled even a single loop runs in a worker process
+	 */
+	supervise = nworkers > 1 || metrics_addr != NULL;
+
+	if (!metrics_listen(loop) || !listen_prepare(port, nworkers)) {
+		exit(EXIT_FAILURE);
+	}
+
+	if (supervise) {
+		/* The default loop is left to the master process */
+		if (!start_workers(loop, nworkers, routes)) {
+			exit(EXIT_FAILURE);
+		}
+	}
+	else {
+		metrics_worker(0);
 
-	if (!start_listen(loop, port, backends)) {
+		if (!routes_start(loop, routes) || !listen_start(loop, 0, 1)) {
+			exit(EXIT_FAILURE);
+		}
+
+		config_reload_start(loop);
+		listen_quit_start(loop);
+	}
+
+	upgrade_ready();
+
+	if (!upgrade_listen(loop, orig_argv)) {
 		exit(EXIT_FAILURE);
 	}
 
+	startup_phase(supervise ? "starting workers" : "starting listeners");
+	fprintf(stderr, "startup: ready in %.1f ms\n",
+			(ev_time() - boot_time) * 1000.0);
+
 	ev_run(loop, 0);
 
 	return 0;
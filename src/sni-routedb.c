@@ -0,0 +1,352 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "ucl.h"
+#include "util.h"
+#include "route.h"
+#include "routedb.h"
+
+/*
+ * Compiles the backends section of a configuration into a routing database
+ * that sni-proxy maps with the `routes_db` option. Identical backend
+ * definitions are stored once, so a million names pointing to a handful of
+ * upstreams cost a table entry each and nothing more.
+ */
+static const char *cf_name = "/etc/sni-proxy.conf";
+static const char *out_name = NULL;
+static const char *check_name = NULL;
+
+static void
+usage(const char *error)
+{
+	if (error) {
+		fprintf(stderr, "%s\n", error);
+	}
+
+	fprintf(stderr, "usage:"
+	    "\tsni-routedb [-c config] -o database [-h]\n"
+	    "\tsni-routedb -C database\n");
+
+	if (error) {
+		exit(EXIT_FAILURE);
+	}
+	else {
+		exit(EXIT_SUCCESS);
+	}
+}
+
+static bool
+upstream_sane(const char *name, const ucl_object_t *obj)
+{
+	const ucl_object_t *elt;
+	int64_t port;
+
+	if (ucl_object_type(obj) != UCL_OBJECT) {
+		fprintf(stderr, "bad backend %s: upstream is not an object\n", name);
+		return false;
+	}
+
+	elt = ucl_object_find_key(obj, "host");
+
+	if (elt == NULL || ucl_object_type(elt) != UCL_STRING) {
+		fprintf(stderr, "bad backend %s: no host\n", name);
+		return false;
+	}
+
+	elt = ucl_object_find_key(obj, "port");
+
+	if (elt != NULL) {
+		port = ucl_object_toint(elt);
+
+		if (port <= 0 || port > 65535) {
+			fprintf(stderr, "bad backend %s: invalid port\n", name);
+			return false;
+		}
+	}
+
+	elt = ucl_object_find_key(obj, "weight");
+
+	if (elt != NULL && ucl_object_toint(elt) <= 0) {
+		fprintf(stderr, "bad backend %s: invalid weight\n", name);
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+record_sane(const char *name, const ucl_object_t *obj, uint32_t *max_buffer)
+{
+	const ucl_object_t *elt, *cur;
+	ucl_object_iter_t it = NULL;
+	const char *balance;
+
+	if (ucl_object_type(obj) != UCL_OBJECT) {
+		fprintf(stderr, "bad backend %s: not an object\n", name);
+		return false;
+	}
+
+	elt = ucl_object_find_key(obj, "upstreams");
+
+	if (elt != NULL) {
+		if (ucl_object_type(elt) != UCL_ARRAY || ucl_array_size(elt) == 0) {
+			fprintf(stderr, "bad backend %s: invalid upstreams\n", name);
+			return false;
+		}
+
+		while ((cur = ucl_iterate_object(elt, &it, true))) {
+			if (!upstream_sane(name, cur)) {
+				return false;
+			}
+		}
+	}
+	else if (!upstream_sane(name, obj)) {
+		return false;
+	}
+
+	elt = ucl_object_find_key(obj, "balance");
+
+	if (elt != NULL) {
+		balance = ucl_object_tostring(elt);
+
+		if (balance == NULL || (strcmp(balance, "round_robin") != 0 &&
+				strcmp(balance, "least_conn") != 0 &&
+				strcmp(balance, "p2c") != 0 &&
+				strcmp(balance, "maglev") != 0)) {
+			fprintf(stderr, "bad backend %s: invalid balance\n", name);
+			return false;
+		}
+	}
+
+	elt = ucl_object_find_key(obj, "slow_start");
+
+	if (elt != NULL && ucl_object_todouble(elt) < 0) {
+		fprintf(stderr, "bad backend %s: invalid slow_start\n", name);
+		return false;
+	}
+
+	elt = ucl_object_find_key(obj, "max_fails");
+
+	if (elt != NULL && ucl_object_toint(elt) < 0) {
+		fprintf(stderr, "bad backend %s: invalid max_fails\n", name);
+		return false;
+	}
+
+	elt = ucl_object_find_key(obj, "health_timeout");
+
+	if (elt != NULL && ucl_object_todouble(elt) <= 0) {
+		fprintf(stderr, "bad backend %s: invalid health_timeout\n", name);
+		return false;
+	}
+
+	elt = ucl_object_find_key(obj, "fail_timeout");
+
+	if (elt != NULL && ucl_object_todouble(elt) <= 0) {
+		fprintf(stderr, "bad backend %s: invalid fail_timeout\n", name);
+		return false;
+	}
+
+	elt = ucl_object_find_key(obj, "warm_connections");
+
+	if (elt != NULL && ucl_object_toint(elt) < 0) {
+		fprintf(stderr, "bad backend %s: invalid warm_connections\n", name);
+		return false;
+	}
+
+	elt = ucl_object_find_key(obj, "warm_timeout");
+
+	if (elt != NULL && ucl_object_todouble(elt) <= 0) {
+		fprintf(stderr, "bad backend %s: invalid warm_timeout\n", name);
+		return false;
+	}
+
+	elt = ucl_object_find_key(obj, "max_buffer");
+
+	if (elt != NULL) {
+		if (ucl_object_toint(elt) <= 0) {
+			fprintf(stderr, "bad backend %s: invalid max_buffer\n", name);
+			return false;
+		}
+
+		if (ucl_object_toint(elt) > *max_buffer) {
+			*max_buffer = ucl_object_toint(elt);
+		}
+	}
+
+	return true;
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+			{"config", 	required_argument, 0,  'c' },
+			{"output", 	required_argument, 0,  'o' },
+			{"check", 	required_argument, 0,  'C' },
+			{"help", 	no_argument, 0,  'h' },
+			{0,         0,                 0,  0 }
+	};
+	struct ucl_parser *parser;
+	ucl_object_t *cfg, *seen;
+	const ucl_object_t *backends, *cur, *elt;
+	ucl_object_iter_t it = NULL;
+	struct route_builder *b;
+	struct route_table *table;
+	struct routedb *db;
+	struct routedb_record *records;
+	uint32_t nrecords = 0, nalloc = 64, nnames = 0, idx,
+			default_record = ROUTE_NONE, max_buffer = 0;
+	unsigned char *json;
+	const char *key;
+	size_t keylen, i;
+	char ch;
+
+	while ((ch = getopt_long(argc, argv, "c:o:C:h", long_options, NULL)) != -1) {
+		switch (ch) {
+		case 'c':
+			cf_name = strdup(optarg);
+			break;
+		case 'o':
+			out_name = strdup(optarg);
+			break;
+		case 'C':
+			check_name = strdup(optarg);
+			break;
+		case 'h':
+		default:
+			usage(NULL);
+			break;
+		}
+	}
+
+	if (check_name != NULL) {
+		db = routedb_open(check_name);
+
+		if (db == NULL || !routedb_check(db)) {
+			fprintf(stderr, "%s: check failed\n", check_name);
+			exit(EXIT_FAILURE);
+		}
+
+		fprintf(stderr, "%s: %u names, %u backends\n", check_name,
+				route_count(routedb_table(db)), routedb_nrecords(db));
+		routedb_close(db);
+
+		return 0;
+	}
+
+	if (out_name == NULL) {
+		usage("output file is not specified");
+	}
+
+	parser = ucl_parser_new(0);
+
+	if (!ucl_parser_add_file(parser, cf_name)) {
+		fprintf(stderr, "cannot open file %s: %s\n", cf_name,
+				ucl_parser_get_error(parser));
+		exit(EXIT_FAILURE);
+	}
+
+	cfg = ucl_parser_get_object(parser);
+	ucl_parser_free(parser);
+
+	backends = ucl_object_find_key(cfg, "backends");
+
+	if (backends == NULL || ucl_object_type(backends) != UCL_OBJECT) {
+		fprintf(stderr, "invalid or absent backends configuration\n");
+		exit(EXIT_FAILURE);
+	}
+
+	b = route_builder_new();
+	seen = ucl_object_typed_new(UCL_OBJECT);
+	records = xmalloc(sizeof(*records) * nalloc);
+
+	while ((cur = ucl_iterate_object(backends, &it, true))) {
+		key = ucl_object_keyl(cur, &keylen);
+
+		if (!record_sane(key, cur, &max_buffer)) {
+			exit(EXIT_FAILURE);
+		}
+
+		/* Backends with the same definition share a record */
+		json = ucl_object_emit(cur, UCL_EMIT_JSON_COMPACT);
+		elt = ucl_object_find_key(seen, (const char *)json);
+
+		if (elt != NULL) {
+			idx = ucl_object_toint(elt);
+			free(json);
+		}
+		else {
+			if (nrecords == nalloc) {
+				nalloc *= 2;
+				records = xrealloc(records, sizeof(*records) * nalloc);
+			}
+
+			/* Record is counted under the first name it is defined for */
+			idx = nrecords ++;
+			records[idx].name = key;
+			records[idx].data = (const char *)json;
+			records[idx].len = strlen((const char *)json);
+			ucl_object_insert_key(seen, ucl_object_fromint(idx),
+					records[idx].data, records[idx].len, false);
+		}
+
+		if (strcmp(key, "default") == 0) {
+			default_record = idx;
+		}
+		else if (!route_builder_add(b, key, keylen, idx)) {
+			fprintf(stderr, "invalid or duplicate server name: %s\n", key);
+			exit(EXIT_FAILURE);
+		}
+		else {
+			nnames ++;
+		}
+	}
+
+	table = route_builder_finish(b);
+
+	if (!routedb_write(out_name, table, records, nrecords, default_record,
+			max_buffer)) {
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(stderr, "%s: %u names, %u backends, %zu bytes routing table\n",
+			out_name, nnames, nrecords, route_table_size(table));
+
+	route_table_destroy(table);
+	ucl_object_unref(seen);
+
+	for (i = 0; i < nrecords; i ++) {
+		free((void *)records[i].data);
+	}
+
+	free(records);
+	ucl_object_unref(cfg);
+
+	return 0;
+}
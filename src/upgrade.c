@@ -0,0 +1,458 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Binary upgrade without refusing connections. The running process serves
+ * `upgrade_socket`; a new binary started with -u connects to it and gets
+ * the listening sockets (and the metrics one) as SCM_RIGHTS, starts
+ * accepting on them and reports that it is ready. Only then the old process
+ * stops accepting and drains its sessions: the sockets are never closed, so
+ * connections queued in them are not lost. If the new binary fails before
+ * that, the old one carries on as if nothing happened.
+ *
+ * Messages are SOCK_SEQPACKET datagrams with a kind byte per passed socket;
+ * a message with a single UPGRADE_END byte ends the list.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "sni-private.h"
+
+#define UPGRADE_LISTENER 'L'
+#define UPGRADE_METRICS 'M'
+#define UPGRADE_END 'E'
+#define UPGRADE_READY 'R'
+/* Sockets per message, well below SCM_MAX_FD */
+#define UPGRADE_BATCH 64
+
+/* How long a new binary waits for the sockets */
+static const int upgrade_timeout = 10;
+
+/* Connection of a new binary to the old one */
+static int upgrade_conn = -1;
+static char **upgrade_argv;
+static ev_io upgrade_accept_ev, upgrade_conn_ev;
+static ev_signal upgrade_sig;
+static bool upgrade_done = false;
+
+static bool
+upgrade_addr(struct sockaddr_un *sun)
+{
+	if (strlen(upgrade_socket) >= sizeof(sun->sun_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	strcpy(sun->sun_path, upgrade_socket);
+
+	return true;
+}
+
+static bool
+upgrade_send(int fd, const char *kinds, size_t len, const int *fds,
+		unsigned nfds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int) * UPGRADE_BATCH)];
+	} cbuf;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void *)kinds;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (nfds > 0) {
+		memset(&cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	return sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+/* Passes all sockets, the send buffer holds them, so it does not block */
+static bool
+upgrade_pass(int fd)
+{
+	char kinds[UPGRADE_BATCH];
+	int *fds;
+	unsigned n, nlisten, i, j, batch;
+	bool ret = true;
+
+	nlisten = listen_fds(NULL, 0);
+	fds = xmalloc(sizeof(int) * (nlisten + 1));
+	n = listen_fds(fds, nlisten);
+
+	if (metrics_fd() != -1) {
+		fds[n ++] = metrics_fd();
+	}
+
+	for (i = 0; i < n && ret; i += batch) {
+		batch = n - i < UPGRADE_BATCH ? n - i : UPGRADE_BATCH;
+
+		for (j = 0; j < batch; j ++) {
+			kinds[j] = i + j < nlisten ? UPGRADE_LISTENER : UPGRADE_METRICS;
+		}
+
+		ret = upgrade_send(fd, kinds, batch, &fds[i], batch);
+	}
+
+	kinds[0] = UPGRADE_END;
+	ret = ret && upgrade_send(fd, kinds, 1, NULL, 0);
+	free(fds);
+
+	return ret;
+}
+
+static void
+upgrade_finish(struct ev_loop *loop)
+{
+	fprintf(stderr, "upgrade: new process is accepting, draining sessions\n");
+	upgrade_done = true;
+	ev_io_stop(loop, &upgrade_accept_ev);
+	close(upgrade_accept_ev.fd);
+	ev_signal_stop(loop, &upgrade_sig);
+	metrics_stop(loop);
+
+	if (!workers_drain(loop)) {
+		listen_drain(loop);
+	}
+}
+
+static void
+upgrade_conn_cb(EV_P_ ev_io *w, int revents)
+{
+	char c;
+	ssize_t r;
+
+	r = read(w->fd, &c, 1);
+
+	if (r == -1 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+
+	ev_io_stop(loop, w);
+	close(w->fd);
+
+	if (r == 1 && c == UPGRADE_READY) {
+		upgrade_finish(loop);
+	}
+	else {
+		fprintf(stderr, "upgrade: new process failed, still accepting\n");
+	}
+}
+
+/* Only the same user (or root) may take the sockets */
+static bool
+upgrade_peer_allowed(int fd)
+{
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+		return false;
+	}
+
+	return cred.uid == 0 || cred.uid == geteuid();
+#else
+	uid_t uid;
+	gid_t gid;
+
+	if (getpeereid(fd, &uid, &gid) == -1) {
+		return false;
+	}
+
+	return uid == 0 || uid == geteuid();
+#endif
+}
+
+static void
+upgrade_accept_cb(EV_P_ ev_io *w, int revents)
+{
+	int fd;
+
+	fd = accept(w->fd, NULL, NULL);
+
+	if (fd == -1) {
+		return;
+	}
+
+	if (ev_is_active(&upgrade_conn_ev)) {
+		fprintf(stderr, "upgrade: already in progress\n");
+		close(fd);
+		return;
+	}
+
+	if (!upgrade_peer_allowed(fd)) {
+		fprintf(stderr, "upgrade: refused a process of another user\n");
+		close(fd);
+		return;
+	}
+
+	if (!upgrade_pass(fd) ||
+			fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+		fprintf(stderr, "upgrade: cannot pass sockets: %s\n", strerror(errno));
+		close(fd);
+		return;
+	}
+
+	fprintf(stderr, "upgrade: sockets passed, waiting for the new process\n");
+	ev_io_init(&upgrade_conn_ev, upgrade_conn_cb, fd, EV_READ);
+	ev_io_start(loop, &upgrade_conn_ev);
+}
+
+/* Starts the configured binary again with -u */
+static void
+upgrade_exec_cb(EV_P_ ev_signal *w, int revents)
+{
+	sigset_t set;
+	pid_t pid;
+
+	if (ev_is_active(&upgrade_conn_ev) || upgrade_done) {
+		fprintf(stderr, "upgrade: already in progress\n");
+		return;
+	}
+
+	pid = fork();
+
+	if (pid == -1) {
+		fprintf(stderr, "upgrade: cannot fork: %s\n", strerror(errno));
+	}
+	else if (pid == 0) {
+		sigemptyset(&set);
+		sigprocmask(SIG_SETMASK, &set, NULL);
+		execvp(upgrade_argv[0], upgrade_argv);
+		fprintf(stderr, "upgrade: cannot execute %s: %s\n", upgrade_argv[0],
+				strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	else {
+		fprintf(stderr, "upgrade: started %s (%d)\n", upgrade_argv[0], pid);
+	}
+}
+
+bool
+upgrade_receive(void)
+{
+	struct sockaddr_un sun;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct timeval tv;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int) * UPGRADE_BATCH)];
+	} cbuf;
+	char kinds[UPGRADE_BATCH];
+	int fd, fds[UPGRADE_BATCH];
+	unsigned i, nfds, total = 0;
+	ssize_t r;
+
+	if (upgrade_socket == NULL) {
+		fprintf(stderr, "upgrade: upgrade_socket is not configured\n");
+		return false;
+	}
+
+	if (!upgrade_addr(&sun) ||
+			(fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
+		fprintf(stderr, "upgrade: %s: %s\n", upgrade_socket, strerror(errno));
+		return false;
+	}
+
+	tv.tv_sec = upgrade_timeout;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		fprintf(stderr, "upgrade: cannot connect to %s: %s\n", upgrade_socket,
+				strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = kinds;
+		iov.iov_len = sizeof(kinds);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf.buf;
+		msg.msg_controllen = sizeof(cbuf.buf);
+
+		r = recvmsg(fd, &msg, 0);
+
+		if (r <= 0) {
+			fprintf(stderr, "upgrade: cannot receive sockets: %s\n",
+					r == 0 ? "connection closed" : strerror(errno));
+			close(fd);
+			return false;
+		}
+
+		nfds = 0;
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+				cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+					cmsg->cmsg_type == SCM_RIGHTS) {
+				nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+			}
+		}
+
+		if (nfds == 0 && r == 1 && kinds[0] == UPGRADE_END) {
+			break;
+		}
+
+		for (i = 0; i < nfds; i ++) {
+			if (msg.msg_flags & MSG_CTRUNC || i >= (size_t)r) {
+				close(fds[i]);
+			}
+			else if (kinds[i] == UPGRADE_METRICS) {
+				metrics_adopt(fds[i]);
+			}
+			else if (kinds[i] == UPGRADE_LISTENER && listen_adopt(fds[i])) {
+				total ++;
+			}
+			else {
+				close(fds[i]);
+			}
+		}
+
+		if (msg.msg_flags & MSG_CTRUNC) {
+			fprintf(stderr, "upgrade: sockets are truncated\n");
+			close(fd);
+			return false;
+		}
+	}
+
+	fprintf(stderr, "upgrade: received %u listening sockets\n", total);
+	upgrade_conn = fd;
+
+	return true;
+}
+
+void
+upgrade_ready(void)
+{
+	char c = UPGRADE_READY;
+
+	if (upgrade_conn == -1) {
+		return;
+	}
+
+	if (write(upgrade_conn, &c, 1) != 1) {
+		fprintf(stderr, "upgrade: cannot notify the old process: %s\n",
+				strerror(errno));
+	}
+
+	close(upgrade_conn);
+	upgrade_conn = -1;
+}
+
+bool
+upgrade_listen(struct ev_loop *loop, char **argv)
+{
+	struct sockaddr_un sun;
+	unsigned n, i;
+	int fd;
+	bool has_flag = false;
+
+	if (upgrade_socket == NULL) {
+		return true;
+	}
+
+	for (n = 0; argv[n] != NULL; n ++) {
+		if (strcmp(argv[n], "-u") == 0 || strcmp(argv[n], "--upgrade") == 0) {
+			has_flag = true;
+		}
+	}
+
+	upgrade_argv = xmalloc(sizeof(char *) * (n + 2));
+
+	for (i = 0; i < n; i ++) {
+		upgrade_argv[i] = argv[i];
+	}
+
+	if (!has_flag) {
+		upgrade_argv[n ++] = "-u";
+	}
+
+	upgrade_argv[n] = NULL;
+
+	if (!upgrade_addr(&sun) ||
+			(fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
+		fprintf(stderr, "upgrade: %s: %s\n", upgrade_socket, strerror(errno));
+		return false;
+	}
+
+	/* The previous process keeps the old socket until it drains */
+	unlink(upgrade_socket);
+
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1 ||
+			bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+			chmod(upgrade_socket, S_IRUSR|S_IWUSR) == -1 ||
+			listen(fd, 4) == -1) {
+		fprintf(stderr, "upgrade: cannot listen on %s: %s\n", upgrade_socket,
+				strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	ev_io_init(&upgrade_accept_ev, upgrade_accept_cb, fd, EV_READ);
+	ev_io_start(loop, &upgrade_accept_ev);
+	ev_signal_init(&upgrade_sig, upgrade_exec_cb, SIGUSR2);
+	ev_signal_start(loop, &upgrade_sig);
+
+	return true;
+}
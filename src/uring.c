@@ -0,0 +1,723 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * io_uring data path. libev still drives the process: completions are
+ * signalled through an eventfd watched by an ev_io, and all SQEs queued
+ * while handling one batch are submitted at once from an ev_prepare
+ * watcher, right before the loop goes to sleep. Socket reads use a ring of
+ * provided buffers, so a session owns a buffer only while its data is in
+ * flight to the peer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include <liburing.h>
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "sni-private.h"
+
+extern int buflen;
+
+enum uring_op_type {
+	uring_op_accept = 0,
+	uring_op_greet,
+	uring_op_recv,
+	uring_op_send,
+	uring_op_alert
+};
+
+struct uring_dir;
+
+/* Passed as user_data of every SQE */
+struct uring_op {
+	enum uring_op_type type;
+	struct ssl_session *s;
+	struct uring_dir *dir;
+};
+
+/* One forwarding direction of a session */
+struct uring_dir {
+	struct uring_op recv_op;
+	struct uring_op send_op;
+	struct uring_dir *wprev;
+	struct uring_dir *wnext;
+	const uint8_t *data;
+	int from;
+	int to;
+	int bid;
+	unsigned off;
+	unsigned len;
+	bool waiting;
+};
+
+struct uring_session {
+	struct uring_dir cl2bk;
+	struct uring_dir bk2cl;
+	struct uring_op alert_op;
+	uint8_t alert[16];
+	int inflight;
+	bool dying;
+};
+
+struct uring_listener {
+	struct uring_op op;
+	ev_timer tm;
+	int fd;
+	bool stopped;
+	struct uring_listener *next;
+};
+
+static const int uring_bgid = 0;
+/* Buffer ids are 16 bit */
+static const unsigned uring_max_buffers = 32768;
+
+static struct io_uring ring;
+static struct io_uring_buf_ring *bufring;
+static uint8_t *bufmem;
+static unsigned nbufs;
+static struct ev_loop *uring_loop;
+static ev_io efd_io;
+static struct uring_listener *uring_listeners;
+static ev_prepare submit_ev;
+static int efd = -1;
+/* Directions starving for a provided buffer */
+static struct uring_dir *waiters, *waiters_tail;
+
+static void uring_dir_recv(struct uring_dir *d);
+
+static struct io_uring_sqe *
+uring_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = io_uring_get_sqe(&ring)) == NULL) {
+		/* Submission queue is full, flush it */
+		io_uring_submit(&ring);
+
+		if ((sqe = io_uring_get_sqe(&ring)) == NULL) {
+			abort();
+		}
+	}
+
+	return sqe;
+}
+
+static void
+uring_queue(struct io_uring_sqe *sqe, struct uring_op *op)
+{
+	io_uring_sqe_set_data(sqe, op);
+
+	if (op->s) {
+		op->s->ur->inflight ++;
+	}
+}
+
+static inline uint8_t *
+uring_buf(int bid)
+{
+	return bufmem + (size_t)bid * buflen;
+}
+
+static void
+uring_unwait(struct uring_dir *d)
+{
+	if (!d->waiting) {
+		return;
+	}
+
+	if (d->wprev) {
+		d->wprev->wnext = d->wnext;
+	}
+	else {
+		waiters = d->wnext;
+	}
+	if (d->wnext) {
+		d->wnext->wprev = d->wprev;
+	}
+	else {
+		waiters_tail = d->wprev;
+	}
+
+	d->wprev = NULL;
+	d->wnext = NULL;
+	d->waiting = false;
+}
+
+static void
+uring_wait_buffer(struct uring_dir *d)
+{
+	d->waiting = true;
+	d->wnext = NULL;
+	d->wprev = waiters_tail;
+
+	if (waiters_tail) {
+		waiters_tail->wnext = d;
+	}
+	else {
+		waiters = d;
+	}
+
+	waiters_tail = d;
+}
+
+static void
+uring_buf_return(int bid)
+{
+	struct uring_dir *d;
+
+	io_uring_buf_ring_add(bufring, uring_buf(bid), buflen, bid,
+			io_uring_buf_ring_mask(nbufs), 0);
+	io_uring_buf_ring_advance(bufring, 1);
+
+	if ((d = waiters) != NULL) {
+		uring_unwait(d);
+		uring_dir_recv(d);
+	}
+}
+
+static void
+uring_dir_recv(struct uring_dir *d)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe();
+	io_uring_prep_recv(sqe, d->from, NULL, buflen, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = uring_bgid;
+	uring_queue(sqe, &d->recv_op);
+}
+
+static void
+uring_dir_send(struct uring_dir *d)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe();
+	io_uring_prep_send(sqe, d->to, d->data + d->off, d->len - d->off,
+			MSG_NOSIGNAL);
+	uring_queue(sqe, &d->send_op);
+}
+
+static void
+uring_dir_init(struct ssl_session *s, struct uring_dir *d,
+		enum uring_op_type recv_type)
+{
+	d->recv_op.type = recv_type;
+	d->recv_op.s = s;
+	d->recv_op.dir = d;
+	d->send_op.type = uring_op_send;
+	d->send_op.s = s;
+	d->send_op.dir = d;
+	d->bid = -1;
+}
+
+static void
+uring_session_init(struct ssl_session *s)
+{
+	struct uring_session *ur;
+
+	ur = xmalloc0(sizeof(*ur));
+	s->uring = true;
+	s->ur = ur;
+
+	/* Client side starts with reading of the greeting */
+	uring_dir_init(s, &ur->cl2bk, uring_op_greet);
+	uring_dir_init(s, &ur->bk2cl, uring_op_recv);
+	ur->cl2bk.from = s->fd;
+	ur->alert_op.type = uring_op_alert;
+	ur->alert_op.s = s;
+}
+
+/* Backend socket is connected by the common connector */
+void
+uring_connected(struct ssl_session *s)
+{
+	struct uring_session *ur = s->ur;
+
+	s->state = ssl_state_proxy;
+	session_account(s);
+	session_timeout(s, idle_timeout, true);
+	ur->cl2bk.recv_op.type = uring_op_recv;
+	ur->cl2bk.from = s->fd;
+	ur->cl2bk.to = s->bk_fd;
+	ur->bk2cl.from = s->bk_fd;
+	ur->bk2cl.to = s->fd;
+
+	/* Saved ClientHello goes first, client is read once it is sent */
+	ur->cl2bk.data = s->cl2bk.buf + s->cl2bk.write_pos;
+	ur->cl2bk.off = 0;
+	ur->cl2bk.len = s->cl2bk.wr_avail;
+
+	if (ur->cl2bk.len > 0) {
+		uring_dir_send(&ur->cl2bk);
+	}
+	else {
+		/* Whole ClientHello went with a fast open SYN */
+		uring_dir_recv(&ur->cl2bk);
+	}
+
+	uring_dir_recv(&ur->bk2cl);
+}
+
+void
+uring_send_alert(struct ssl_session *s, const void *data, size_t len)
+{
+	struct io_uring_sqe *sqe;
+
+	if (len > sizeof(s->ur->alert)) {
+		len = sizeof(s->ur->alert);
+	}
+
+	memcpy(s->ur->alert, data, len);
+	s->state = ssl_state_alert_sent;
+	session_account(s);
+	sqe = uring_sqe();
+	io_uring_prep_send(sqe, s->fd, s->ur->alert, len, MSG_NOSIGNAL);
+	uring_queue(sqe, &s->ur->alert_op);
+}
+
+static void
+uring_cancel(struct uring_op *op)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe();
+	io_uring_prep_cancel64(sqe, (uint64_t)(uintptr_t)op, 0);
+	/* Completion of cancel itself is ignored */
+	io_uring_sqe_set_data(sqe, NULL);
+}
+
+bool
+uring_release(struct ssl_session *s)
+{
+	struct uring_session *ur = s->ur;
+
+	if (ur == NULL) {
+		return true;
+	}
+
+	uring_unwait(&ur->cl2bk);
+	uring_unwait(&ur->bk2cl);
+
+	if (ur->inflight > 0) {
+		if (!ur->dying) {
+			ur->dying = true;
+			uring_cancel(&ur->cl2bk.recv_op);
+			uring_cancel(&ur->cl2bk.send_op);
+			uring_cancel(&ur->bk2cl.recv_op);
+			uring_cancel(&ur->bk2cl.send_op);
+			uring_cancel(&ur->alert_op);
+		}
+
+		return false;
+	}
+
+	if (ur->cl2bk.bid != -1) {
+		uring_buf_return(ur->cl2bk.bid);
+	}
+	if (ur->bk2cl.bid != -1) {
+		uring_buf_return(ur->bk2cl.bid);
+	}
+
+	free(ur);
+	s->ur = NULL;
+	s->uring = false;
+
+	return true;
+}
+
+static void
+uring_recv_done(struct ssl_session *s, struct uring_dir *d, int res, int bid)
+{
+	if (res == -ENOBUFS) {
+		/* Retried once some other direction returns its buffer */
+		uring_wait_buffer(d);
+		return;
+	}
+	if (res < 0) {
+		if (d == &s->ur->bk2cl) {
+			session_backend_error(s, -res);
+		}
+		terminate_session(s);
+		return;
+	}
+	if (res == 0) {
+		/* Half close: pass EOF to the peer */
+		shutdown(d->to, SHUT_WR);
+		s->state ++;
+		session_account(s);
+
+		if (s->state >= ssl_state_proxy_both_closed) {
+			terminate_session(s);
+		}
+		else {
+			session_timeout(s, half_close_timeout, true);
+		}
+
+		return;
+	}
+
+	if (d == &s->ur->bk2cl) {
+		stats->bytes_bk2cl += res;
+		s->bk_stats->bytes_bk2cl += res;
+
+		if (!s->bk_replied) {
+			session_backend_replied(s);
+		}
+	}
+	else {
+		stats->bytes_cl2bk += res;
+		s->bk_stats->bytes_cl2bk += res;
+	}
+
+	session_touch(s);
+	d->bid = bid;
+	d->data = uring_buf(bid);
+	d->off = 0;
+	d->len = res;
+	uring_dir_send(d);
+}
+
+static void
+uring_send_done(struct ssl_session *s, struct uring_dir *d, int res)
+{
+	int bid;
+
+	if (res <= 0) {
+		if (res < 0 && d == &s->ur->cl2bk) {
+			session_backend_error(s, -res);
+		}
+		terminate_session(s);
+		return;
+	}
+
+	d->off += res;
+
+	if (d->off < d->len) {
+		/* Short write */
+		uring_dir_send(d);
+		return;
+	}
+
+	if (d->bid != -1) {
+		bid = d->bid;
+		d->bid = -1;
+		uring_buf_return(bid);
+	}
+
+	uring_dir_recv(d);
+}
+
+/*
+ * Stores the received greeting segment kept in cl2bk. Over the memory limit
+ * the provided buffer is held while the session is parked
+ */
+void
+uring_greet_add(struct ssl_session *s)
+{
+	struct uring_dir *d = &s->ur->cl2bk;
+	ssize_t r;
+	int bid;
+
+	while (d->off < d->len) {
+		r = proxy_add_greeting(s, d->data + d->off, d->len - d->off);
+
+		if (r == -1) {
+			if (errno != ENOBUFS) {
+				bid = d->bid;
+				d->bid = -1;
+				uring_buf_return(bid);
+			}
+
+			greeting_overflow(s, errno);
+			return;
+		}
+
+		d->off += r;
+	}
+
+	/* Provided buffer goes back right away, the greeting is kept in cl2bk */
+	bid = d->bid;
+	d->bid = -1;
+	uring_buf_return(bid);
+
+	if (parse_ssl_greeting(s)) {
+		/* ClientHello continues in the next segments */
+		uring_dir_recv(d);
+	}
+}
+
+static void
+uring_greet_done(struct ssl_session *s, int res, int bid)
+{
+	struct uring_dir *d = &s->ur->cl2bk;
+
+	if (res == -ENOBUFS) {
+		uring_wait_buffer(d);
+		return;
+	}
+
+	if (res <= 0) {
+		terminate_session(s);
+		return;
+	}
+
+	d->bid = bid;
+	d->data = uring_buf(bid);
+	d->off = 0;
+	d->len = res;
+	uring_greet_add(s);
+}
+
+static void
+uring_listen_arm(struct uring_listener *l)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe();
+#ifdef IORING_ACCEPT_MULTISHOT
+	io_uring_prep_multishot_accept(sqe, l->fd, NULL, NULL,
+			SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+	io_uring_prep_accept(sqe, l->fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+#endif
+	uring_queue(sqe, &l->op);
+}
+
+static void
+uring_listen_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	struct uring_listener *l = w->data;
+
+	ev_timer_stop(loop, w);
+	uring_listen_arm(l);
+}
+
+static void
+uring_accept_done(struct uring_listener *l, struct io_uring_cqe *cqe)
+{
+	struct ssl_session *s;
+
+	if (cqe->res >= 0) {
+		s = session_create(uring_loop, cqe->res, NULL);
+		uring_session_init(s);
+		uring_dir_recv(&s->ur->cl2bk);
+	}
+	else if (!l->stopped) {
+		stats->accept_errors ++;
+		fprintf(stderr, "accept failed: %d, '%s'\n", -cqe->res,
+				strerror(-cqe->res));
+	}
+
+	if (!(cqe->flags & IORING_CQE_F_MORE) && !l->stopped) {
+		if (cqe->res >= 0) {
+			uring_listen_arm(l);
+		}
+		else {
+			/* Do not spin on EMFILE and friends */
+			ev_timer_start(uring_loop, &l->tm);
+		}
+	}
+}
+
+static void
+uring_complete(struct io_uring_cqe *cqe)
+{
+	struct uring_op *op = io_uring_cqe_get_data(cqe);
+	struct ssl_session *s;
+	int bid = -1;
+
+	if (op == NULL) {
+		return;
+	}
+	if (op->type == uring_op_accept) {
+		uring_accept_done((struct uring_listener *)op, cqe);
+		return;
+	}
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	}
+
+	s = op->s;
+	s->ur->inflight --;
+
+	if (s->ur->dying) {
+		if (bid != -1) {
+			uring_buf_return(bid);
+		}
+		if (s->ur->inflight == 0) {
+			terminate_session(s);
+		}
+
+		return;
+	}
+
+	switch (op->type) {
+	case uring_op_greet:
+		uring_greet_done(s, cqe->res, bid);
+		break;
+	case uring_op_recv:
+		uring_recv_done(s, op->dir, cqe->res, bid);
+		break;
+	case uring_op_send:
+		uring_send_done(s, op->dir, cqe->res);
+		break;
+	case uring_op_alert:
+		terminate_session(s);
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+uring_efd_cb(EV_P_ ev_io *w, int revents)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head, n = 0;
+	uint64_t cnt;
+
+	if (read(efd, &cnt, sizeof(cnt)) == -1 && errno != EAGAIN) {
+		fprintf(stderr, "eventfd read failed: %s\n", strerror(errno));
+	}
+
+	io_uring_for_each_cqe(&ring, head, cqe) {
+		uring_complete(cqe);
+		n ++;
+	}
+
+	io_uring_cq_advance(&ring, n);
+}
+
+static void
+uring_submit_cb(EV_P_ ev_prepare *w, int revents)
+{
+	/* One submission for everything queued during this iteration */
+	if (io_uring_sq_ready(&ring) > 0) {
+		io_uring_submit(&ring);
+	}
+}
+
+static bool
+uring_init(struct ev_loop *loop)
+{
+	unsigned i;
+	int ret;
+
+	if (uring_loop != NULL) {
+		return true;
+	}
+
+	if ((ret = io_uring_queue_init(uring_entries, &ring, 0)) < 0) {
+		fprintf(stderr, "cannot init io_uring: %s\n", strerror(-ret));
+		return false;
+	}
+
+	for (nbufs = 1; nbufs < (unsigned)uring_buffers && nbufs < uring_max_buffers;
+			nbufs <<= 1);
+
+	bufmem = xmalloc((size_t)nbufs * buflen);
+	bufring = io_uring_setup_buf_ring(&ring, nbufs, uring_bgid, 0, &ret);
+
+	if (bufring == NULL) {
+		fprintf(stderr, "cannot register io_uring buffers: %s\n",
+				strerror(-ret));
+		io_uring_queue_exit(&ring);
+		free(bufmem);
+
+		return false;
+	}
+
+	for (i = 0; i < nbufs; i ++) {
+		io_uring_buf_ring_add(bufring, uring_buf(i), buflen, i,
+				io_uring_buf_ring_mask(nbufs), i);
+	}
+
+	io_uring_buf_ring_advance(bufring, nbufs);
+
+	efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+
+	if (efd == -1 || io_uring_register_eventfd(&ring, efd) < 0) {
+		fprintf(stderr, "cannot register io_uring eventfd: %s\n",
+				strerror(errno));
+		io_uring_queue_exit(&ring);
+
+		return false;
+	}
+
+	ev_io_init(&efd_io, uring_efd_cb, efd, EV_READ);
+	ev_io_start(loop, &efd_io);
+	ev_prepare_init(&submit_ev, uring_submit_cb);
+	ev_prepare_start(loop, &submit_ev);
+	uring_loop = loop;
+
+	return true;
+}
+
+bool
+uring_listen(struct ev_loop *loop, int sock)
+{
+	struct uring_listener *l;
+
+	if (!uring_init(loop)) {
+		return false;
+	}
+
+	l = xmalloc0(sizeof(*l));
+	l->op.type = uring_op_accept;
+	l->fd = sock;
+	l->tm.data = l;
+	ev_timer_init(&l->tm, uring_listen_timer_cb, 0.1, 0.0);
+	uring_listen_arm(l);
+	l->next = uring_listeners;
+	uring_listeners = l;
+
+	return true;
+}
+
+/* Connections accepted before the cancel completes are still served */
+void
+uring_unlisten(void)
+{
+	struct uring_listener *l;
+
+	for (l = uring_listeners; l != NULL; l = l->next) {
+		l->stopped = true;
+		ev_timer_stop(uring_loop, &l->tm);
+		uring_cancel(&l->op);
+	}
+}
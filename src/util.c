@@ -54,6 +54,21 @@ xmalloc0(size_t len)
 	return (p);
 }
 
+void *
+xrealloc(void *ptr, size_t len)
+{
+	void *p;
+
+	if (len >= SIZE_MAX / 2) {
+		abort();
+	}
+
+	if (!(p = realloc(ptr, len))) {
+		abort();
+	}
+	return (p);
+}
+
 
 const char *
 port_to_str(int port)
@@ -25,6 +25,7 @@
 
 void * xmalloc(size_t len);
 void * xmalloc0(size_t len);
+void * xrealloc(void *ptr, size_t len);
 const char * port_to_str(int port);
 
 #endif /* UTIL_H_ */
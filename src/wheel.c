@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ev.h"
+#include "wheel.h"
+
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+/* Deadlines further away wait in the last level and are filed again */
+#define WHEEL_SPAN ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+static uint64_t
+wheel_now(struct wheel *w)
+{
+	return (uint64_t)(ev_now(w->loop) / w->tick);
+}
+
+static void
+wheel_link(struct wheel_timer **head, struct wheel_timer *t)
+{
+	t->next = *head;
+
+	if (t->next != NULL) {
+		t->next->pprev = &t->next;
+	}
+
+	t->pprev = head;
+	*head = t;
+}
+
+static void
+wheel_unlink(struct wheel_timer *t)
+{
+	if (t->next != NULL) {
+		t->next->pprev = t->pprev;
+	}
+
+	*t->pprev = t->next;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/* Level by the distance to the deadline, slot by the deadline itself */
+static void
+wheel_file(struct wheel *w, struct wheel_timer *t)
+{
+	uint64_t delta, when = t->deadline;
+	unsigned level;
+
+	if (when < w->base) {
+		when = w->base;
+	}
+
+	delta = when - w->base;
+
+	if (delta >= WHEEL_SPAN) {
+		delta = WHEEL_SPAN - 1;
+		when = w->base + delta;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level ++) {
+		if (delta < (uint64_t)1 << (WHEEL_BITS * (level + 1))) {
+			break;
+		}
+	}
+
+	wheel_link(&w->slots[level][(when >> (WHEEL_BITS * level)) & WHEEL_MASK],
+			t);
+}
+
+/* Moves timers of the slot of `level` that starts now to lower levels */
+static void
+wheel_cascade(struct wheel *w, unsigned level)
+{
+	struct wheel_timer *t, *next;
+	struct wheel_timer **slot;
+
+	slot = &w->slots[level][(w->base >> (WHEEL_BITS * level)) & WHEEL_MASK];
+	t = *slot;
+	*slot = NULL;
+
+	for (; t != NULL; t = next) {
+		next = t->next;
+		t->pprev = NULL;
+		wheel_file(w, t);
+	}
+}
+
+static void
+wheel_run(struct wheel *w)
+{
+	struct wheel_timer *t, *next, *expired;
+	struct wheel_timer **slot;
+	uint64_t now;
+	unsigned level;
+
+	for (level = 1; level < WHEEL_LEVELS; level ++) {
+		if ((w->base & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) != 0) {
+			break;
+		}
+
+		wheel_cascade(w, level);
+	}
+
+	slot = &w->slots[0][w->base & WHEEL_MASK];
+	expired = *slot;
+	*slot = NULL;
+	now = w->base ++;
+
+	for (t = expired; t != NULL; t = next) {
+		next = t->next;
+		t->next = NULL;
+		t->pprev = NULL;
+
+		if (t->deadline > now) {
+			/* Touched or too far for the wheel */
+			wheel_file(w, t);
+			continue;
+		}
+
+		w->count --;
+		t->cb(t);
+	}
+}
+
+static void
+wheel_cb_ev(EV_P_ ev_timer *ev, int revents)
+{
+	struct wheel *w = ev->data;
+	uint64_t now = wheel_now(w);
+
+	while (w->count > 0 && w->base <= now) {
+		wheel_run(w);
+	}
+
+	if (w->count == 0) {
+		ev_timer_stop(loop, ev);
+	}
+}
+
+void
+wheel_init(struct wheel *w, struct ev_loop *loop, double tick)
+{
+	memset(w, 0, sizeof(*w));
+	w->loop = loop;
+	w->tick = tick;
+	w->ev.data = w;
+	ev_timer_init(&w->ev, wheel_cb_ev, tick, tick);
+}
+
+void
+wheel_timer_init(struct wheel_timer *t, wheel_cb cb, void *data)
+{
+	memset(t, 0, sizeof(*t));
+	t->cb = cb;
+	t->data = data;
+}
+
+static void
+wheel_start(struct wheel *w, struct wheel_timer *t, double after,
+		bool idle)
+{
+	uint64_t ticks;
+
+	if (wheel_active(t)) {
+		wheel_unlink(t);
+	}
+	else if (w->count ++ == 0) {
+		/* Nothing was due meanwhile, skip the ticks */
+		w->base = wheel_now(w);
+		ev_timer_start(w->loop, &w->ev);
+	}
+
+	ticks = after > 0 ? (uint64_t)(after / w->tick) : 0;
+
+	/* Rounded up, a timeout never fires early */
+	if (ticks * w->tick < after) {
+		ticks ++;
+	}
+
+	if (idle) {
+		/* A zero period would not move on touch */
+		t->period = ticks == 0 ? 1 : ticks < UINT32_MAX ? ticks : UINT32_MAX;
+	}
+	else {
+		t->period = 0;
+	}
+
+	t->deadline = w->base + ticks;
+	wheel_file(w, t);
+}
+
+void
+wheel_add(struct wheel *w, struct wheel_timer *t, double after)
+{
+	wheel_start(w, t, after, false);
+}
+
+void
+wheel_add_idle(struct wheel *w, struct wheel_timer *t, double after)
+{
+	wheel_start(w, t, after, true);
+}
+
+void
+wheel_del(struct wheel *w, struct wheel_timer *t)
+{
+	if (wheel_active(t)) {
+		wheel_unlink(t);
+		w->count --;
+	}
+}
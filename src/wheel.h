@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SRC_WHEEL_H_
+#define SRC_WHEEL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ev.h"
+
+/*
+ * Hierarchical timer wheel driven by a single ev_timer of its loop, for
+ * coarse timeouts of many objects. Adding and removing a timer is O(1) and
+ * never touches the libev heap. Idle timers are moved by wheel_touch(),
+ * which only stores the new deadline: the timer is filed again when its
+ * old slot comes up. Deadlines are rounded up to a tick.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1u << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+struct wheel_timer;
+
+typedef void (*wheel_cb)(struct wheel_timer *t);
+
+struct wheel_timer {
+	struct wheel_timer *next;
+	/* NULL if the timer is not active */
+	struct wheel_timer **pprev;
+	uint64_t deadline;
+	/* Ticks an idle timer is moved by, 0 for a fixed deadline */
+	uint32_t period;
+	wheel_cb cb;
+	void *data;
+};
+
+struct wheel {
+	struct wheel_timer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+	/* Next tick to run, earlier deadlines have expired */
+	uint64_t base;
+	unsigned count;
+	double tick;
+	struct ev_loop *loop;
+	ev_timer ev;
+};
+
+void wheel_init(struct wheel *w, struct ev_loop *loop, double tick);
+void wheel_timer_init(struct wheel_timer *t, wheel_cb cb, void *data);
+/* Fires `t` once in `after` seconds, replaces its previous deadline */
+void wheel_add(struct wheel *w, struct wheel_timer *t, double after);
+/* Same, but each wheel_touch() moves the deadline `after` seconds away */
+void wheel_add_idle(struct wheel *w, struct wheel_timer *t, double after);
+void wheel_del(struct wheel *w, struct wheel_timer *t);
+
+static inline bool
+wheel_active(const struct wheel_timer *t)
+{
+	return t->pprev != NULL;
+}
+
+static inline void
+wheel_touch(struct wheel *w, struct wheel_timer *t)
+{
+	if (t->period != 0) {
+		t->deadline = w->base + t->period;
+	}
+}
+
+#endif /* SRC_WHEEL_H_ */
@@ -0,0 +1,332 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <signal.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+
+#include "ev.h"
+#include "ucl.h"
+#include "util.h"
+#include "sni-private.h"
+
+/*
+ * Each worker is a separate process with its own event loop and its own
+ * set of SO_REUSEPORT listening sockets, so the kernel spreads incoming
+ * connections between workers. The master keeps the sockets open, so the
+ * queue of a dead worker waits for its replacement.
+ */
+struct sni_worker {
+	ev_child cw;
+	pid_t pid;
+	int idx;
+};
+
+static struct sni_worker *workers;
+static int nworkers;
+static struct sni_routes *listen_routes;
+static bool terminating = false;
+static ev_timer respawn_tm;
+static ev_signal term_sig, int_sig, hup_sig, quit_sig;
+
+/* Delay before a dead worker is restarted */
+static const double respawn_delay = 1.0;
+
+static void spawn_worker(struct ev_loop *loop, struct sni_worker *wrk);
+
+static void
+pin_worker(int idx)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t set;
+	long ncpu;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (ncpu <= 0) {
+		return;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(idx % ncpu, &set);
+
+	if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+		fprintf(stderr, "worker %d: cannot set cpu affinity: %s\n", idx,
+				strerror(errno));
+	}
+#else
+	fprintf(stderr, "worker %d: cpu affinity is not supported\n", idx);
+#endif
+}
+
+static void
+worker_main(struct sni_worker *wrk)
+{
+	struct ev_loop *loop;
+	sigset_t set;
+
+	/* Get rid of the master's signal handling */
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGUSR2, SIG_IGN);
+	/* Until listen_quit_start() */
+	sigemptyset(&set);
+	sigaddset(&set, SIGQUIT);
+	sigprocmask(SIG_SETMASK, &set, NULL);
+
+	if (cpu_affinity) {
+		pin_worker(wrk->idx);
+	}
+
+	metrics_worker(wrk->idx);
+
+	loop = ev_loop_new(EVFLAG_AUTO);
+
+	if (loop == NULL) {
+		fprintf(stderr, "worker %d: cannot create event loop\n", wrk->idx);
+		_exit(EXIT_FAILURE);
+	}
+
+	if (!routes_start(loop, listen_routes) ||
+			!listen_start(loop, wrk->idx, nworkers)) {
+		_exit(EXIT_FAILURE);
+	}
+
+	config_reload_start(loop);
+	listen_quit_start(loop);
+
+	ev_run(loop, 0);
+
+	exit(EXIT_SUCCESS);
+}
+
+static void
+respawn_cb(EV_P_ ev_timer *w, int revents)
+{
+	int i;
+
+	ev_timer_stop(loop, w);
+
+	for (i = 0; i < nworkers; i ++) {
+		if (workers[i].pid == -1) {
+			spawn_worker(loop, &workers[i]);
+		}
+	}
+}
+
+static void
+worker_exit_cb(EV_P_ ev_child *w, int revents)
+{
+	struct sni_worker *wrk = w->data;
+	int i;
+	bool alive = false;
+
+	ev_child_stop(loop, w);
+	wrk->pid = -1;
+
+	if (WIFSIGNALED(w->rstatus)) {
+		fprintf(stderr, "worker %d (%d) terminated by signal %d\n", wrk->idx,
+				w->rpid, WTERMSIG(w->rstatus));
+	}
+	else {
+		fprintf(stderr, "worker %d (%d) exited with status %d\n", wrk->idx,
+				w->rpid, WEXITSTATUS(w->rstatus));
+	}
+
+	if (terminating) {
+		for (i = 0; i < nworkers; i ++) {
+			if (workers[i].pid != -1) {
+				alive = true;
+			}
+		}
+
+		if (!alive) {
+			ev_break(loop, EVBREAK_ALL);
+		}
+	}
+	else if (!ev_is_active(&respawn_tm)) {
+		/* Other workers still accept connections while this one restarts */
+		ev_timer_start(loop, &respawn_tm);
+	}
+}
+
+/* Workers exit on SIGTERM at once and on SIGQUIT when drained */
+static void
+stop_workers(struct ev_loop *loop, int sig)
+{
+	int i;
+	bool alive = false;
+
+	terminating = true;
+	ev_timer_stop(loop, &respawn_tm);
+
+	for (i = 0; i < nworkers; i ++) {
+		if (workers[i].pid != -1) {
+			kill(workers[i].pid, sig);
+			alive = true;
+		}
+	}
+
+	if (!alive) {
+		ev_break(loop, EVBREAK_ALL);
+	}
+}
+
+static void
+term_cb(EV_P_ ev_signal *w, int revents)
+{
+	stop_workers(loop, SIGTERM);
+}
+
+static void
+quit_cb(EV_P_ ev_signal *w, int revents)
+{
+	workers_drain(loop);
+}
+
+bool
+workers_drain(struct ev_loop *loop)
+{
+	if (workers == NULL) {
+		return false;
+	}
+
+	/* New connections are refused rather than queued for nobody */
+	listen_stop(loop);
+	stop_workers(loop, SIGQUIT);
+
+	return true;
+}
+
+/*
+ * Workers reload on their own, the master keeps the new routes for workers
+ * it starts later
+ */
+static void
+reload_cb(EV_P_ ev_signal *w, int revents)
+{
+	static bool reloading = false;
+	struct sni_routes *routes;
+	int i;
+
+	if (reloading) {
+		/* Resolution below runs the loop */
+		fprintf(stderr, "reload: already in progress\n");
+		return;
+	}
+
+	routes = config_load_routes();
+
+	if (routes == NULL) {
+		return;
+	}
+
+	if (!lazy_resolve) {
+		reloading = true;
+
+		if (!routes_resolve(loop, routes)) {
+			fprintf(stderr, "reload: cannot resolve backends, keeping the "
+					"previous configuration\n");
+			routes_destroy(routes);
+			reloading = false;
+			return;
+		}
+
+		reloading = false;
+	}
+
+	routes_destroy(listen_routes);
+	listen_routes = routes;
+
+	for (i = 0; i < nworkers; i ++) {
+		if (workers[i].pid != -1) {
+			kill(workers[i].pid, SIGHUP);
+		}
+	}
+}
+
+static void
+spawn_worker(struct ev_loop *loop, struct sni_worker *wrk)
+{
+	pid_t pid;
+
+	pid = fork();
+
+	if (pid == -1) {
+		fprintf(stderr, "cannot fork worker %d: %s\n", wrk->idx,
+				strerror(errno));
+
+		if (!ev_is_active(&respawn_tm)) {
+			ev_timer_start(loop, &respawn_tm);
+		}
+
+		return;
+	}
+	else if (pid == 0) {
+		worker_main(wrk);
+		/* Not reached */
+	}
+
+	wrk->pid = pid;
+	wrk->cw.data = wrk;
+	ev_child_init(&wrk->cw, worker_exit_cb, pid, 0);
+	ev_child_start(loop, &wrk->cw);
+}
+
+bool
+start_workers(struct ev_loop *loop, int n, struct sni_routes *routes)
+{
+	int i;
+
+	nworkers = n;
+	listen_routes = routes;
+	workers = xmalloc0(sizeof(*workers) * n);
+
+	ev_timer_init(&respawn_tm, respawn_cb, respawn_delay, 0.0);
+	ev_signal_init(&term_sig, term_cb, SIGTERM);
+	ev_signal_start(loop, &term_sig);
+	ev_signal_init(&int_sig, term_cb, SIGINT);
+	ev_signal_start(loop, &int_sig);
+	ev_signal_init(&hup_sig, reload_cb, SIGHUP);
+	ev_signal_start(loop, &hup_sig);
+	ev_signal_init(&quit_sig, quit_cb, SIGQUIT);
+	ev_signal_start(loop, &quit_sig);
+
+	for (i = 0; i < n; i ++) {
+		workers[i].idx = i;
+		workers[i].pid = -1;
+		spawn_worker(loop, &workers[i]);
+	}
+
+	return true;
+}